@@ -1,9 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 
 #include "audio_frame.h"
+#include "pcm.h"
 #include "log.h"
 
 bool same_format(struct audio_frame *a, struct audio_frame *b) {
@@ -15,9 +18,139 @@ double latency_to_usec(int samplerate, int64_t latency) {
   return latency * 1000000.0 / (256.0 * multiplier);
 }
 
+// Fixed pool of blocks holding a struct audio_frame followed by its payload.
+// Free blocks form a lock-free stack so frames can be allocated on the
+// network thread and released on the playback thread. The top of the stack
+// is tagged with a generation counter to avoid ABA.
+struct frame_pool {
+  uint8_t *blocks;
+  size_t block_size;
+  unsigned int count;
+  atomic_uint *next;       // index + 1 of the next free block, 0 terminates
+  atomic_uint_fast64_t top; // generation << 32 | index + 1
+  atomic_uint in_use;
+  atomic_uint high_water;
+  atomic_ulong exhausted;
+};
+
+static struct frame_pool pool;
+
+#define POOL_INDEX(top) ((unsigned int)((top) & 0xffffffff))
+#define POOL_TOP(generation, index) ((uint64_t)(generation) << 32 | (index))
+
+void frame_pool_init(unsigned int count) {
+  pool.block_size = (sizeof(struct audio_frame) + AUDIO_FRAME_MAX_PAYLOAD + 63) & ~(size_t)63;
+  pool.count = count;
+  pool.blocks = aligned_alloc(64, pool.block_size * count);
+  pool.next = calloc(count, sizeof(atomic_uint));
+
+  assert(pool.blocks != NULL && pool.next != NULL);
+
+  for (unsigned int i = 0; i < count; i++)
+    atomic_init(&pool.next[i], i + 1 < count ? i + 2 : 0);
+
+  atomic_init(&pool.top, POOL_TOP(0, count > 0 ? 1 : 0));
+  atomic_init(&pool.in_use, 0);
+  atomic_init(&pool.high_water, 0);
+  atomic_init(&pool.exhausted, 0);
+
+  log_printf("Frame pool: %u blocks of %zd bytes", count, pool.block_size);
+}
+
+static struct audio_frame *pool_get(void) {
+  uint64_t top = atomic_load_explicit(&pool.top, memory_order_acquire);
+
+  while (1) {
+    unsigned int index = POOL_INDEX(top);
+
+    if (index == 0)
+      return NULL;
+
+    unsigned int next = atomic_load_explicit(&pool.next[index - 1], memory_order_relaxed);
+
+    if (atomic_compare_exchange_weak_explicit(&pool.top, &top, POOL_TOP((top >> 32) + 1, next),
+                                              memory_order_acquire, memory_order_acquire))
+      return (struct audio_frame *)(pool.blocks + (index - 1) * pool.block_size);
+  }
+}
+
+static void pool_put(struct audio_frame *frame) {
+  unsigned int index = ((uint8_t *)frame - pool.blocks) / pool.block_size + 1;
+  uint64_t top = atomic_load_explicit(&pool.top, memory_order_relaxed);
+
+  do {
+    atomic_store_explicit(&pool.next[index - 1], POOL_INDEX(top), memory_order_relaxed);
+  } while (!atomic_compare_exchange_weak_explicit(&pool.top, &top, POOL_TOP((top >> 32) + 1, index),
+                                                  memory_order_release, memory_order_relaxed));
+}
+
+// Returns a zeroed frame with room for audio_length bytes of payload.
+// Falls back to malloc() if the pool is exhausted or the payload is too
+// large.
+struct audio_frame *alloc_frame(size_t audio_length) {
+  struct audio_frame *frame = NULL;
+
+  if (audio_length <= AUDIO_FRAME_MAX_PAYLOAD) {
+    frame = pool_get();
+
+    if (frame == NULL)
+      atomic_fetch_add_explicit(&pool.exhausted, 1, memory_order_relaxed);
+  }
+
+  if (frame != NULL) {
+    unsigned int in_use = atomic_fetch_add_explicit(&pool.in_use, 1, memory_order_relaxed) + 1;
+    unsigned int high_water = atomic_load_explicit(&pool.high_water, memory_order_relaxed);
+
+    while (in_use > high_water &&
+           !atomic_compare_exchange_weak_explicit(&pool.high_water, &high_water, in_use,
+                                                  memory_order_relaxed, memory_order_relaxed));
+
+    *frame = (struct audio_frame){
+      .pooled = true
+    };
+  } else {
+    frame = malloc(sizeof(struct audio_frame) + audio_length);
+
+    if (frame == NULL)
+      return NULL;
+
+    *frame = (struct audio_frame){
+      .pooled = false
+    };
+  }
+
+  frame->audio = frame + 1;
+  frame->readptr = frame->audio;
+  frame->audio_length = audio_length;
+
+  return frame;
+}
+
 void free_frame(struct audio_frame *frame) {
-  free(frame->audio);
-  free(frame);
+  if (!frame->pooled) {
+    free(frame);
+    return;
+  }
+
+  atomic_fetch_sub_explicit(&pool.in_use, 1, memory_order_relaxed);
+  pool_put(frame);
+}
+
+void frame_pool_get_stats(struct frame_pool_stats *stats) {
+  *stats = (struct frame_pool_stats){
+    .capacity = pool.count,
+    .in_use = atomic_load_explicit(&pool.in_use, memory_order_relaxed),
+    .high_water = atomic_load_explicit(&pool.high_water, memory_order_relaxed),
+    .exhausted = atomic_load_explicit(&pool.exhausted, memory_order_relaxed),
+  };
+}
+
+void print_frame_pool_stats(void) {
+  struct frame_pool_stats stats;
+  frame_pool_get_stats(&stats);
+
+  log_printf("Frame pool: %u/%u in use, high water %u, exhausted %lu times",
+             stats.in_use, stats.capacity, stats.high_water, stats.exhausted);
 }
 
 bool frame_to_sample_spec(pa_sample_spec *ss, int rate, int channels, int bitdepth) {
@@ -41,65 +174,43 @@ bool frame_to_sample_spec(pa_sample_spec *ss, int rate, int channels, int bitdep
 }
 
 struct audio_frame *parse_frame(ohm1_audio *frame) {
-  struct audio_frame *aframe = calloc(1, sizeof(struct audio_frame));
+  pa_sample_spec ss;
+  unsigned int framecount = ntohs(frame->samplecount);
 
-  if (aframe == NULL)
+  if (!frame_to_sample_spec(&ss, ntohl(frame->samplerate), frame->channels, frame->bitdepth)) {
+    log_printf("Unsupported sample spec");
     return NULL;
+  }
 
-  unsigned int framecount = ntohs(frame->samplecount);
+  ss.format = PA_SAMPLE_FLOAT32LE;
+
+  struct audio_frame *aframe = alloc_frame(pa_frame_size(&ss) * framecount);
+
+  if (aframe == NULL)
+    return NULL;
 
+  aframe->ss = ss;
   aframe->seqnum = ntohl(frame->frame);
   aframe->latency = ntohl(frame->media_latency);
   aframe->halt = frame->flags & OHM1_FLAG_HALT;
   aframe->resent = frame->flags & OHM1_FLAG_RESENT;
   aframe->timestamped = frame->flags & OHM1_FLAG_TIMESTAMPED;
-
-  if (!frame_to_sample_spec(&aframe->ss, ntohl(frame->samplerate), frame->channels, frame->bitdepth)) {
-    log_printf("Unsupported sample spec");
-    free(aframe);
-    return NULL;
-  }
-
-  aframe->ss.format = PA_SAMPLE_FLOAT32LE;
   aframe->bitdepth = frame->bitdepth;
 
   aframe->ts_network = ntohl(frame->network_timestamp);
   aframe->ts_media = ntohl(frame->media_timestamp);
 
-  aframe->audio_length = pa_frame_size(&aframe->ss) * framecount;
-
-  aframe->audio = malloc(aframe->audio_length);
-  aframe->readptr = aframe->audio;
-
-  if (aframe->audio == NULL) {
-    free(aframe);
-    return NULL;
-  }
-
   unsigned int samplecount = framecount * aframe->ss.channels;
   uint8_t *src = frame->data + frame->codec_length;
-  float *dst = aframe->audio;
 
   switch (aframe->bitdepth) {
     case 24:
-      for (size_t i = 0; i < samplecount; i++) {
-        int32_t s = src[3 * i + 0] << 24 | src[3 * i + 1] << 16 | src[3 * i + 2] << 8;
-        *dst++ = s * (1.0f / (1U << 31));
-      }
+      pcm_s24be_to_float(aframe->audio, src, samplecount);
       break;
     case 16:
-      for (size_t i = 0; i < samplecount; i++) {
-        int32_t s = src[2 * i + 0] << 24 | src[2 * i + 1] << 16;
-        *dst++ = s * (1.0f / (1U << 31));
-      }
+      pcm_s16be_to_float(aframe->audio, src, samplecount);
       break;
   }
 
-//  memcpy(aframe->audio, frame->data + frame->codec_length, aframe->audio_length);
-
-
-  // TODO convert from bitdepth to float here
-
-
   return aframe;
 }
@@ -23,9 +23,26 @@ struct audio_frame {
   bool resent;
   bool timestamped;
   bool timestamp_is_good;
+  bool pooled;
+  bool concealed; // synthesized for a frame that did not arrive in time
+};
+
+// Largest decoded payload of a single OHM packet: 16 bit samples double
+// in size when converted to float.
+#define AUDIO_FRAME_MAX_PAYLOAD ((OHM1_MAX_PACKET - sizeof(ohm1_audio)) * sizeof(float) / 2)
+
+struct frame_pool_stats {
+  unsigned int capacity;
+  unsigned int in_use;
+  unsigned int high_water;
+  unsigned long exhausted;
 };
 
 bool same_format(struct audio_frame *a, struct audio_frame *b);
 double latency_to_usec(int samplerate, int64_t latency);
+void frame_pool_init(unsigned int count);
+void frame_pool_get_stats(struct frame_pool_stats *stats);
+void print_frame_pool_stats(void);
+struct audio_frame *alloc_frame(size_t audio_length);
 void free_frame(struct audio_frame *frame);
 struct audio_frame *parse_frame(ohm1_audio *frame);
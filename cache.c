@@ -1,34 +1,174 @@
+#define _GNU_SOURCE
 #include <math.h>
 
 #include "cache.h"
 #include "audio_frame.h"
 #include "log.h"
 
+
 int cache_pos(struct cache *cache, int index) {
   return (index + cache->offset) % cache->size;
 }
 
-struct cache *cache_init(unsigned int size) {
-  struct cache *cache = calloc(1, sizeof(struct cache) + sizeof(struct audio_frame*) * size);
+static void cache_set(struct cache *cache, int pos, struct audio_frame *frame) {
+  assert(cache->frames[pos] == NULL);
+
+  cache->frames[pos] = frame;
+  cache->present[pos / 64] |= 1ULL << (pos % 64);
+  cache->count++;
+}
+
+static void cache_clear(struct cache *cache, int pos) {
+  assert(cache->frames[pos] != NULL);
+
+  cache->frames[pos] = NULL;
+  cache->present[pos / 64] &= ~(1ULL << (pos % 64));
+  cache->count--;
+}
+
+// Stores frame at index, which must be empty.
+void cache_insert(struct cache *cache, int index, struct audio_frame *frame) {
+  cache_set(cache, cache_pos(cache, index), frame);
+
+  if (index > cache->latest_index)
+    cache->latest_index = index;
+}
+
+// Removes the frame at index 0, if any, and advances the cache by one
+// frame. The caller owns the returned frame.
+struct audio_frame *cache_pop(struct cache *cache) {
+  int pos = cache_pos(cache, 0);
+  struct audio_frame *frame = cache->frames[pos];
+
+  if (frame != NULL)
+    cache_clear(cache, pos);
+
+  cache->offset++;
+  cache->start_seqnum++;
+
+  if (cache->latest_index > 0)
+    cache->latest_index--;
+
+  return frame;
+}
+
+// Number of missing frames before latest_index.
+unsigned int cache_holes(struct cache *cache) {
+  if (cache->count == 0)
+    return 0;
+
+  return cache->latest_index + 1 - cache->count;
+}
+
+// Calls found() for up to max missing indices in [0, latest_index], in
+// order, scanning the presence bitmap a word at a time. Returns the number
+// of holes found.
+int cache_scan_holes(struct cache *cache, int max, void (*found)(void *ctx, int index), void *ctx) {
+  int start = cache_pos(cache, 0);
+  int length = cache->latest_index + 1;
+  int n = 0;
+
+  // The range may wrap around the end of the ring, giving two segments.
+  for (int base = 0; base < length && n < max;) {
+    int a = (start + base) % cache->size;
+    int b = a + (length - base);
+
+    if (b > cache->size)
+      b = cache->size;
+
+    for (int word = a / 64; word <= (b - 1) / 64 && n < max; word++) {
+      uint64_t missing = ~cache->present[word];
+
+      if (word == a / 64)
+        missing &= ~0ULL << (a % 64);
+
+      if (word == (b - 1) / 64 && b % 64 != 0)
+        missing &= ~0ULL >> (64 - b % 64);
+
+      while (missing != 0 && n < max) {
+        int pos = word * 64 + __builtin_ctzll(missing);
+        missing &= missing - 1;
+
+        found(ctx, base + pos - a);
+        n++;
+      }
+    }
+
+    base += b - a;
+  }
+
+  return n;
+}
+
+// Allocates capacity slots of which the first size are used.
+struct cache *cache_init(unsigned int capacity, unsigned int size) {
+  assert(size > 0 && size <= capacity);
+
+  struct cache *cache = calloc(1, sizeof(struct cache) + sizeof(struct audio_frame*) * capacity);
   assert(cache != NULL);
 
+  cache->present = calloc((capacity + 63) / 64, sizeof(uint64_t));
+  assert(cache->present != NULL);
+
+  cache->capacity = capacity;
   cache->size = size;
   cache->latest_index = 0;
   cache->start_seqnum = 0;
   cache->offset = 0;
+  cache->count = 0;
 
   log_printf("Cache initialized");
 
   return cache;
 }
 
+// Changes the number of slots in use. Frames keep their index, those
+// beyond the new size are dropped.
+void cache_resize(struct cache *cache, unsigned int size) {
+  assert(size > 0 && size <= cache->capacity);
+
+  if (size == cache->size)
+    return;
+
+  unsigned int length = cache->count > 0 ? cache->latest_index + 1 : 0;
+  struct audio_frame **frames = calloc(length + 1, sizeof(struct audio_frame *));
+  assert(frames != NULL);
+
+  for (int index = 0; index < length; index++) {
+    int pos = cache_pos(cache, index);
+
+    frames[index] = cache->frames[pos];
+
+    if (frames[index] != NULL)
+      cache_clear(cache, pos);
+  }
+
+  cache->size = size;
+  cache->offset = 0;
+  cache->latest_index = 0;
+
+  for (int index = 0; index < length; index++) {
+    if (frames[index] == NULL)
+      continue;
+
+    if (index < size)
+      cache_insert(cache, index, frames[index]);
+    else
+      free_frame(frames[index]);
+  }
+
+  free(frames);
+
+  log_printf("Cache resized to %u frames", size);
+}
+
 void cache_reset(struct cache *cache) {
   int end = cache->size;
   for (int index = 0; index < end; index++) {
     struct audio_frame *frame = cache->frames[index];
     if (frame != NULL) {
+      cache_clear(cache, index);
       free_frame(frame);
-      cache->frames[index] = NULL;
     }
   }
 
@@ -39,18 +179,34 @@ void cache_reset(struct cache *cache) {
   log_printf("Cache reset");
 }
 
-void print_cache(struct cache *cache) {
+// Draws the first CACHE_PRINT_SLOTS slots into buf for the status display.
+// Returns the length written.
+size_t cache_render(struct cache *cache, char *buf, size_t size) {
   assert(cache != NULL);
 
-  printf("%10u [", cache->start_seqnum);
+  FILE *f = fmemopen(buf, size, "w");
+
+  if (f == NULL) {
+    buf[0] = '\0';
+    return 0;
+  }
+
+  fprintf(f, "%10u [", cache->start_seqnum);
 
+  // Always the same number of lines, whatever the size.
   struct audio_frame *last = NULL;
-  int end = cache->size;
+  int end = CACHE_PRINT_SLOTS;
   for (int index = 0; index < end; index++) {
     int pos = cache_pos(cache, index);
 
     if (index > 0 && index%100 == 0)
-      printf("]\n           [");
+      fprintf(f, "]\n           [");
+
+    // Nothing is stored beyond the latest frame.
+    if (index >= cache->size || index > cache->latest_index || cache->count == 0) {
+      fputc(' ', f);
+      continue;
+    }
 
     struct audio_frame *frame = cache->frames[pos];
     char c = '?';
@@ -68,156 +224,17 @@ void print_cache(struct cache *cache) {
     last = frame;
 
     if (fg != -1) {
-      printf("\e[3%1im%c\e[m", fg, c);
+      fprintf(f, "\e[3%1im%c\e[m", fg, c);
     } else
-      printf("%c", c);
+      fputc(c, f);
   }
 
-  printf("]\n");
-}
-
-struct cache_info cache_continuous_size(struct cache *cache) {
-  assert(cache != NULL);
-
-  struct audio_frame *last = NULL;
-
-  struct cache_info info = {
-    .available = 0,
-    .halt = false,
-    .format_change = false,
-    .start = 0,
-    .halt_index = -1,
-    .format_change_index = -1,
-    .latency_usec = 0,
-    .timestamped = true,
-    .has_timing = false,
-  };
-
-  double ts_mean = 0;
-
-  int64_t ts_min, ts_max;
-
-  int j = 0;
-
-  // Ignore the last frame. Its net_offset won't be ready yet.
-  // play_audio might still play it, though.
-  int end = cache->latest_index - 1;
-  for (int index = 0; index <= end; index++) {
-    int pos = cache_pos(cache, index);
-    struct audio_frame *frame = cache->frames[pos];
-
-    if (frame == NULL)
-      break;
-
-    if (!frame->timestamped)
-      info.timestamped = false;
-
-    if (last != NULL && !same_format(last, frame)) {
-      info.format_change_index = index;
-      info.format_change = true;
-      break;
-    }
-
-    info.available += frame->audio_length;
-
-    if (!frame->resent && frame->audio == frame->readptr && frame->audio_length > 0 &&
-        (!frame->timestamped || frame->timestamp_is_good)) {
-      int64_t ts;
-
-      if (frame->timestamped)
-        ts = frame->ts_due_usec - pa_bytes_to_usec(info.available, &frame->ss);
-      else
-        ts = frame->ts_recv_usec - pa_bytes_to_usec(info.available, &frame->ss);
-
-      double d;
-
-      // TODO use Kalman Filter + RTS to estimate start?
-      j++;
-
-      d = ts - ts_mean;
-      ts_mean += d / j;
-    }
-
-    info.latency_usec = latency_to_usec(frame->ss.rate, frame->latency);
-
-    if (frame->halt && (last != NULL && same_format(last, frame))) {
-      info.halt_index = index;
-      info.halt = true;
-      break;
-    }
-
-    last = frame;
-  }
-
-  if (j < 2)
-    return info;
+  fprintf(f, "]\n");
 
-  info.has_timing = true;
-  info.start = ts_mean + 0.5;
+  size_t length = ftell(f);
+  fclose(f);
 
-  return info;
-}
-
-// Remove trim amount of bytes from the start of the cache.
-// Returns true on success; false if there is not enough data to trim.
-bool trim_cache(struct cache *cache, size_t trim) {
-  if (trim == 0)
-    return true;
-
-  log_printf("Trimming %zd bytes", trim);
-
-  int end = cache->latest_index;
-  int adjust = 0;
-  for (int index = 0; index <= end && trim > 0; index++) {
-    int pos = cache_pos(cache, index);
-    struct audio_frame *frame = cache->frames[pos];
-
-    if (frame == NULL)
-      break;
-
-    if (frame->audio_length < trim) {
-      trim -= frame->audio_length;
-      free_frame(frame);
-      cache->frames[pos] = NULL;
-      adjust++;
-    } else {
-      frame->readptr = (uint8_t*)frame->readptr + trim;
-      frame->audio_length -= trim;
-      trim = 0;
-    }
-  }
-
-  cache->offset += adjust;
-  cache->start_seqnum += adjust;
-  cache->latest_index -= adjust;
-
-  assert(trim == 0);
-
-  if (trim != 0)
-    return false;
-
-  return true;
-}
-
-struct missing_frames *request_frames(struct cache *cache) {
-  assert(cache != NULL);
-
-  struct missing_frames *d = calloc(1, sizeof(struct missing_frames) + sizeof(unsigned int) * cache->latest_index);
-  assert(d != NULL);
-
-  int end = cache->latest_index;
-  for (int index = 0; index <= end; index++) {
-    int pos = cache_pos(cache, index);
-    if (cache->frames[pos] == NULL)
-      d->seqnums[d->count++] = (long long int)index + cache->start_seqnum;
-  }
-
-  if (d->count == 0) {
-    free(d);
-    return NULL;
-  }
-
-  return d;
+  return length;
 }
 
 // Adjusts cache such that the seqnum will fit within the cache, possibly
@@ -235,9 +252,11 @@ void cache_seek_forward(struct cache *cache, unsigned int seqnum) {
   for (int index = 0; index <= discard; index++) {
     int pos = cache_pos(cache, index);
 
-    if (cache->frames[pos] != NULL) {
-      free_frame(cache->frames[pos]);
-      cache->frames[pos] = NULL;
+    struct audio_frame *frame = cache->frames[pos];
+
+    if (frame != NULL) {
+      cache_clear(cache, pos);
+      free_frame(frame);
     }
   }
 
@@ -6,42 +6,32 @@
 #include <assert.h>
 #include <stdio.h>
 
-struct cache_info {
-  size_t available;
-  int64_t start;
-  int64_t net_offset;
-  double start_error;
-  double net_offset_error;
-  double clock_ratio;
-  double clock_ratio_error;
-  int halt_index;
-  int format_change_index;
-  bool halt;
-  bool format_change;
-  bool timestamped;
-  bool has_timing;
-  double latency_usec;
-};
-
 struct cache {
   unsigned int start_seqnum;
   unsigned int latest_index;
-  unsigned int size;
+  unsigned int size;     // slots in use
+  unsigned int capacity; // slots allocated
   unsigned int offset;
+  unsigned int count;  // frames present, all at index <= latest_index
+  uint64_t *present;   // one bit per slot, indexed by position
   struct audio_frame *frames[];
 };
 
+#define CACHE_PRINT_SLOTS 500
+#define CACHE_RENDER_SIZE 8192 // enough for CACHE_PRINT_SLOTS colored slots
+
 struct missing_frames {
   int count;
   unsigned int seqnums[];
 };
 
-struct cache *cache_init(unsigned int size);
+struct cache *cache_init(unsigned int capacity, unsigned int size);
+void cache_resize(struct cache *cache, unsigned int size);
 void cache_reset(struct cache *cache);
-void print_cache(struct cache *cache);
-struct cache_info cache_continuous_size(struct cache *cache);
+size_t cache_render(struct cache *cache, char *buf, size_t size);
 void cache_seek_forward(struct cache *cache, unsigned int seqnum);
 int cache_pos(struct cache *cache, int index);
-bool trim_cache(struct cache *cache, size_t trim);
-void discard_cache_through(struct cache *cache, int discard);
-struct missing_frames *request_frames(struct cache *cache);
+void cache_insert(struct cache *cache, int index, struct audio_frame *frame);
+struct audio_frame *cache_pop(struct cache *cache);
+unsigned int cache_holes(struct cache *cache);
+int cache_scan_holes(struct cache *cache, int max, void (*found)(void *ctx, int index), void *ctx);
@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include "clocktrace.h"
+#include "log.h"
+
+// Creates or truncates the trace file. Tracing starts disabled.
+struct clocktrace *clocktrace_open(const char *path, uint64_t capacity) {
+  size_t length = sizeof(struct clocktrace_header) + capacity * sizeof(struct clocktrace_record);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  if (fd == -1) {
+    log_printf("Could not open clock trace %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  if (ftruncate(fd, length) == -1) {
+    log_printf("Could not size clock trace %s: %s", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    log_printf("Could not map clock trace %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  struct clocktrace *trace = calloc(1, sizeof(struct clocktrace));
+
+  if (trace == NULL) {
+    munmap(map, length);
+    return NULL;
+  }
+
+  trace->header = map;
+  trace->records = (struct clocktrace_record *)(trace->header + 1);
+  trace->length = length;
+  atomic_init(&trace->enabled, false);
+
+  memcpy(trace->header->magic, CLOCKTRACE_MAGIC, sizeof(trace->header->magic));
+  trace->header->version = CLOCKTRACE_VERSION;
+  trace->header->record_size = sizeof(struct clocktrace_record);
+  trace->header->capacity = capacity;
+  atomic_init(&trace->header->written, 0);
+
+  log_printf("Clock trace: %s, %" PRIu64 " records", path, capacity);
+
+  return trace;
+}
+
+void clocktrace_close(struct clocktrace *trace) {
+  if (trace == NULL)
+    return;
+
+  munmap(trace->header, trace->length);
+  free(trace);
+}
+
+void clocktrace_enable(struct clocktrace *trace, bool enable) {
+  atomic_store(&trace->enabled, enable);
+  log_printf("Clock trace %s", enable ? "on" : "off");
+}
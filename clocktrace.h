@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Binary trace of the remote clock estimation, one record per timestamped
+// frame. The file is a header followed by a ring of records, mapped into
+// memory so that recording is a few stores. Convert with clocktrace2csv.
+
+#define CLOCKTRACE_MAGIC "OHMCLKTR"
+#define CLOCKTRACE_VERSION 1
+
+struct clocktrace_record {
+  uint64_t ts_local_usec;
+  double delta_local;
+  double delta_remote;
+  double ts_remote;
+  double filter_x;
+  double filter_v;
+  double filter_p;
+};
+
+struct clocktrace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t capacity;
+  _Atomic uint64_t written; // records, the newest is at (written - 1) % capacity
+};
+
+struct clocktrace {
+  struct clocktrace_header *header;
+  struct clocktrace_record *records;
+  size_t length;
+  atomic_bool enabled;
+};
+
+struct clocktrace *clocktrace_open(const char *path, uint64_t capacity);
+void clocktrace_close(struct clocktrace *trace);
+void clocktrace_enable(struct clocktrace *trace, bool enable);
+
+// Only called by a single thread.
+static inline void clocktrace_record(struct clocktrace *trace, const struct clocktrace_record *record) {
+  if (trace == NULL || !atomic_load_explicit(&trace->enabled, memory_order_relaxed))
+    return;
+
+  uint64_t written = atomic_load_explicit(&trace->header->written, memory_order_relaxed);
+
+  trace->records[written % trace->header->capacity] = *record;
+  atomic_store_explicit(&trace->header->written, written + 1, memory_order_release);
+}
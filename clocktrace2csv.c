@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <error.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "clocktrace.h"
+
+// Converts a clock trace written by songcast-receiver to CSV, oldest
+// record first.
+int main(int argc, char *argv[]) {
+  if (argc != 2)
+    error(1, 0, "Usage: %s <clocktrace>", argv[0]);
+
+  int fd = open(argv[1], O_RDONLY);
+
+  if (fd == -1)
+    error(1, errno, "%s", argv[1]);
+
+  struct stat st;
+
+  if (fstat(fd, &st) == -1)
+    error(1, errno, "fstat");
+
+  if ((size_t)st.st_size < sizeof(struct clocktrace_header))
+    error(1, 0, "%s: too short", argv[1]);
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+  if (map == MAP_FAILED)
+    error(1, errno, "mmap");
+
+  struct clocktrace_header *header = map;
+
+  if (memcmp(header->magic, CLOCKTRACE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != CLOCKTRACE_VERSION || header->record_size != sizeof(struct clocktrace_record))
+    error(1, 0, "%s: not a clock trace of version %d", argv[1], CLOCKTRACE_VERSION);
+
+  if (sizeof(*header) + header->capacity * header->record_size > (uint64_t)st.st_size)
+    error(1, 0, "%s: truncated", argv[1]);
+
+  struct clocktrace_record *records = (struct clocktrace_record *)(header + 1);
+  uint64_t written = atomic_load(&header->written);
+  uint64_t first = written > header->capacity ? written - header->capacity : 0;
+
+  printf("ts_local_usec,delta_local,delta_remote,ts_remote,filter_x,filter_v,filter_p\n");
+
+  for (uint64_t i = first; i < written; i++) {
+    struct clocktrace_record *r = &records[i % header->capacity];
+
+    printf("%" PRIu64 ",%f,%f,%f,%f,%.9f,%g\n", r->ts_local_usec, r->delta_local, r->delta_remote,
+           r->ts_remote, r->filter_x, r->filter_v, r->filter_p);
+  }
+
+  munmap(map, st.st_size);
+  close(fd);
+
+  return 0;
+}
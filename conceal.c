@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "conceal.h"
+
+#define CONCEAL_HISTORY 40e-3    // seconds of audio kept
+#define CONCEAL_TEMPLATE 5e-3    // seconds matched against earlier periods
+#define CONCEAL_PERIOD_MIN 2.5e-3 // seconds, 400 Hz
+#define CONCEAL_PERIOD_MAX 20e-3  // seconds, 50 Hz
+#define CONCEAL_COARSE_RATE 8000  // Hz, of the first period search pass
+#define CONCEAL_FADE 30e-3       // seconds of concealed audio until silence
+#define CONCEAL_CROSSFADE 2.5e-3 // seconds into the frame after the gap
+
+void concealer_reset(struct concealer *c, const pa_sample_spec *ss) {
+  size_t capacity = CONCEAL_HISTORY * ss->rate;
+
+  if (c->history == NULL || c->capacity != capacity || c->ss.channels != ss->channels) {
+    free(c->history);
+    free(c->mono);
+    free(c->coarse);
+    c->history = calloc(capacity * ss->channels, sizeof(float));
+    c->mono = calloc(capacity, sizeof(float));
+    c->coarse = calloc(capacity, sizeof(float));
+    assert(c->history != NULL && c->mono != NULL && c->coarse != NULL);
+  }
+
+  c->ss = *ss;
+  c->capacity = capacity;
+  c->filled = 0;
+  c->last = (struct audio_frame){0};
+  c->period = 0;
+  c->phase = 0;
+  c->concealed = 0;
+}
+
+// Keeps the audio of a frame about to be queued. The frame itself may be
+// released by the output at any time after that.
+void concealer_record(struct concealer *c, struct audio_frame *frame) {
+  int channels = c->ss.channels;
+  size_t n = frame->audio_length / pa_frame_size(&c->ss);
+  const float *audio = frame->audio;
+
+  c->last = *frame;
+
+  if (n >= c->capacity) {
+    memcpy(c->history, audio + (n - c->capacity) * channels, c->capacity * channels * sizeof(float));
+    c->filled = c->capacity;
+    return;
+  }
+
+  size_t keep = c->filled < c->capacity - n ? c->filled : c->capacity - n;
+
+  memmove(c->history, c->history + (c->filled - keep) * channels, keep * channels * sizeof(float));
+  memcpy(c->history + keep * channels, audio, n * channels * sizeof(float));
+  c->filled = keep + n;
+}
+
+// Lag in [min, max] at which x best matches its n samples from start, by
+// normalized cross-correlation.
+static size_t best_lag(const float *x, size_t start, size_t n, size_t min, size_t max) {
+  size_t best = min;
+  double best_score = -INFINITY;
+
+  for (size_t lag = min; lag <= max; lag++) {
+    double corr = 0, energy = 0;
+
+    for (size_t i = 0; i < n; i++) {
+      float y = x[start + i - lag];
+
+      corr += x[start + i] * y;
+      energy += y * y;
+    }
+
+    double score = energy > 0 ? corr / sqrt(energy) : 0;
+
+    if (score > best_score) {
+      best_score = score;
+      best = lag;
+    }
+  }
+
+  return best;
+}
+
+// Lag at which the history best matches its last CONCEAL_TEMPLATE. The
+// lags are searched on a decimated downmix first and the best one is
+// refined at full rate. Returns 0 if there is too little history.
+static size_t find_period(struct concealer *c) {
+  int channels = c->ss.channels;
+  size_t template = CONCEAL_TEMPLATE * c->ss.rate;
+  size_t min = CONCEAL_PERIOD_MIN * c->ss.rate;
+  size_t max = CONCEAL_PERIOD_MAX * c->ss.rate;
+  size_t factor = c->ss.rate > CONCEAL_COARSE_RATE ? c->ss.rate / CONCEAL_COARSE_RATE : 1;
+
+  if (c->filled < template + min)
+    return 0;
+
+  if (max > c->filled - template)
+    max = c->filled - template;
+
+  // The downmix covers the template and the longest lag before it.
+  size_t length = template + max;
+  const float *src = c->history + (c->filled - length) * channels;
+
+  for (size_t i = 0; i < length; i++) {
+    float sum = 0;
+
+    for (int k = 0; k < channels; k++)
+      sum += src[i * channels + k];
+
+    c->mono[i] = sum;
+  }
+
+  // Decimated by averaging, aligned to the most recent audio.
+  size_t coarse_length = length / factor;
+  size_t offset = length - coarse_length * factor;
+
+  for (size_t j = 0; j < coarse_length; j++) {
+    float sum = 0;
+
+    for (size_t i = 0; i < factor; i++)
+      sum += c->mono[offset + j * factor + i];
+
+    c->coarse[j] = sum / factor;
+  }
+
+  size_t coarse_template = template / factor;
+  size_t coarse_start = coarse_length - coarse_template;
+  size_t coarse_min = (min + factor - 1) / factor;
+  size_t coarse_max = max / factor < coarse_start ? max / factor : coarse_start;
+  size_t lag = max;
+
+  if (coarse_min <= coarse_max)
+    lag = best_lag(c->coarse, coarse_start, coarse_template, coarse_min, coarse_max) * factor;
+
+  size_t lo = lag > min + factor ? lag - factor : min;
+  size_t hi = lag + factor < max ? lag + factor : max;
+
+  return best_lag(c->mono, max, template, lo, hi);
+}
+
+static float gain(struct concealer *c, size_t concealed) {
+  float g = 1 - concealed / (CONCEAL_FADE * c->ss.rate);
+
+  return g > 0 ? g : 0;
+}
+
+// Next frame of the repetition, attenuated for the position in the run.
+static void extend(struct concealer *c, float *out) {
+  int channels = c->ss.channels;
+  const float *src = c->history + (c->filled - c->period + c->phase) * channels;
+  float g = gain(c, c->concealed);
+
+  for (int k = 0; k < channels; k++)
+    out[k] = src[k] * g;
+
+  c->phase = (c->phase + 1) % c->period;
+  c->concealed++;
+}
+
+// Synthesizes frames of audio following the recorded history or the
+// previous concealed frame. Returns false without enough history.
+bool concealer_fill(struct concealer *c, float *audio, size_t frames) {
+  if (c->period == 0) {
+    c->period = find_period(c);
+    c->phase = 0;
+    c->concealed = 0;
+
+    if (c->period == 0)
+      return false;
+  }
+
+  for (size_t i = 0; i < frames; i++)
+    extend(c, audio + i * c->ss.channels);
+
+  return true;
+}
+
+// Crossfades the start of the first real frame after concealed ones from
+// the repetition and ends the run.
+void concealer_blend(struct concealer *c, struct audio_frame *frame) {
+  if (c->period == 0)
+    return;
+
+  int channels = c->ss.channels;
+  size_t n = frame->audio_length / pa_frame_size(&c->ss);
+  size_t fade = CONCEAL_CROSSFADE * c->ss.rate;
+  float *audio = frame->audio;
+  float ext[channels];
+
+  if (fade > n)
+    fade = n;
+
+  for (size_t i = 0; i < fade; i++) {
+    float w = (i + 0.5f) / fade;
+
+    extend(c, ext);
+
+    for (int k = 0; k < channels; k++)
+      audio[i * channels + k] = audio[i * channels + k] * w + ext[k] * (1 - w);
+  }
+
+  c->period = 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pulse/sample.h>
+
+#include "audio_frame.h"
+
+// Packet loss concealment. A missing frame is replaced by repeating the
+// last pitch period of the audio before it, found by matching the most
+// recent audio against earlier periods. Longer gaps fade to silence and
+// the frame after the gap is crossfaded from the repetition.
+struct concealer {
+  pa_sample_spec ss;
+  float *history;  // interleaved, most recent audio at the end
+  size_t filled;   // frames
+  size_t capacity;
+  float *mono;     // downmixed history, scratch for the period search
+  float *coarse;   // the same, decimated
+  struct audio_frame last; // header of the last real frame
+
+  // Current run of concealed frames
+  size_t period;    // frames repeated, 0 outside a run
+  size_t phase;     // position within the period
+  size_t concealed; // frames synthesized in this run
+};
+
+void concealer_reset(struct concealer *c, const pa_sample_spec *ss);
+void concealer_record(struct concealer *c, struct audio_frame *frame);
+bool concealer_fill(struct concealer *c, float *audio, size_t frames);
+void concealer_blend(struct concealer *c, struct audio_frame *frame);
@@ -1,12 +1,246 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <error.h>
+#include <errno.h>
+
+#include "log.h"
+#include "spsc.h"
 
 #define log_lines 40
 #define log_offset 10
 
+#define LOG_RING_SIZE 256      // records per thread
+#define LOG_RECORD_TEXT 200    // longer messages are truncated
+#define LOG_RATE 200           // records per second and thread
+#define LOG_BURST 50
+#define LOG_WRITER_INTERVAL 20e6 // nsec
+
+// Callers never block: each thread formats its messages into a ring of
+// its own, which a background thread merges by timestamp and writes out.
+struct log_record {
+    uint64_t ts_usec;
+    enum log_level level;
+    char text[LOG_RECORD_TEXT];
+};
+
+enum log_ring_state {
+    LOG_RING_ACTIVE,
+    LOG_RING_EXITED, // owner gone, writer still draining
+    LOG_RING_FREE,   // may be taken by a new thread
+};
+
+struct log_ring {
+    struct spsc records;
+    atomic_ulong dropped;
+    atomic_int state;
+    struct log_ring *next;
+
+    // Token bucket, only touched by the owning thread.
+    double tokens;
+    uint64_t refilled_usec;
+};
+
+static const char *level_names[] = {
+    [LOG_LEVEL_ERROR] = "error",
+    [LOG_LEVEL_WARN] = "warn",
+    [LOG_LEVEL_INFO] = "info",
+    [LOG_LEVEL_DEBUG] = "debug",
+};
+
 FILE *log_file;
 
+static _Atomic(struct log_ring *) rings;
+static __thread struct log_ring *thread_ring;
+static atomic_int max_level = LOG_LEVEL_INFO;
+static atomic_uint rate = LOG_RATE;
+static unsigned long reported_dropped;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t writer;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t log_now_usec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Runs when a thread that has logged exits. The writer frees the ring
+// once it has drained it.
+static void log_ring_release(void *arg) {
+    struct log_ring *ring = arg;
+
+    atomic_store(&ring->state, LOG_RING_EXITED);
+}
+
+static void log_ring_key_init(void) {
+    pthread_key_create(&ring_key, log_ring_release);
+}
+
+// Takes a ring left by an exited thread.
+static struct log_ring *log_reuse_ring(void) {
+    for (struct log_ring *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        int expected = LOG_RING_FREE;
+
+        if (atomic_compare_exchange_strong(&ring->state, &expected, LOG_RING_ACTIVE))
+            return ring;
+    }
+
+    return NULL;
+}
+
+// A thread gets a ring on its first message. Rings are never unlinked as
+// the writer walks the list without a lock; the rings of exited threads
+// are reused instead, so the list only grows with the number of threads
+// logging at the same time.
+static struct log_ring *log_thread_ring(void) {
+    if (thread_ring != NULL)
+        return thread_ring;
+
+    pthread_once(&ring_key_once, log_ring_key_init);
+
+    struct log_ring *ring = log_reuse_ring();
+
+    if (ring != NULL) {
+        ring->tokens = LOG_BURST;
+        ring->refilled_usec = log_now_usec();
+        pthread_setspecific(ring_key, ring);
+        thread_ring = ring;
+
+        return ring;
+    }
+
+    ring = calloc(1, sizeof(struct log_ring));
+
+    if (ring == NULL || !spsc_init(&ring->records, LOG_RING_SIZE, sizeof(struct log_record))) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->tokens = LOG_BURST;
+    ring->refilled_usec = log_now_usec();
+    atomic_init(&ring->state, LOG_RING_ACTIVE);
+    ring->next = atomic_load(&rings);
+
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+
+    return ring;
+}
+
+static bool log_take_token(struct log_ring *ring, uint64_t now) {
+    unsigned int records_per_sec = atomic_load_explicit(&rate, memory_order_relaxed);
+
+    if (records_per_sec == 0)
+        return true;
+
+    ring->tokens += (now - ring->refilled_usec) * 1e-6 * records_per_sec;
+    ring->refilled_usec = now;
+
+    if (ring->tokens > LOG_BURST)
+        ring->tokens = LOG_BURST;
+
+    if (ring->tokens < 1)
+        return false;
+
+    ring->tokens--;
+
+    return true;
+}
+
+static void log_write_record(struct log_record *record) {
+    printf("\033[%d;%dr", log_offset, log_offset + log_lines);
+    printf("\033[%d;0H", log_offset + log_lines);
+    printf("\033[1S");
+    fputs(record->text, stdout);
+    printf("\033[K");
+
+    time_t sec = record->ts_usec / 1000000;
+    struct tm tm;
+    char timestamp[16];
+
+    localtime_r(&sec, &tm);
+    strftime(timestamp, sizeof(timestamp), "%H:%M:%S", &tm);
+    fprintf(log_file, "%s.%03u %s\n", timestamp, (unsigned int)(record->ts_usec % 1000000 / 1000), record->text);
+}
+
+// Writes all queued records in timestamp order. Returns the number written.
+static unsigned int log_drain(void) {
+    unsigned int written = 0;
+    unsigned long dropped = 0;
+
+    pthread_mutex_lock(&writer_mutex);
+    flockfile(stdout);
+
+    for (;;) {
+        struct log_ring *oldest = NULL;
+        struct log_record *oldest_record = NULL;
+
+        for (struct log_ring *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+            struct log_record *record = spsc_read_slot(&ring->records);
+
+            if (record != NULL && (oldest_record == NULL || record->ts_usec < oldest_record->ts_usec)) {
+                oldest = ring;
+                oldest_record = record;
+            }
+        }
+
+        if (oldest == NULL)
+            break;
+
+        log_write_record(oldest_record);
+        spsc_release(&oldest->records);
+        written++;
+    }
+
+    for (struct log_ring *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        dropped += atomic_load(&ring->dropped);
+
+        // Everything the exited owner wrote has been drained above.
+        if (atomic_load(&ring->state) == LOG_RING_EXITED && spsc_read_slot(&ring->records) == NULL)
+            atomic_store(&ring->state, LOG_RING_FREE);
+    }
+
+    if (dropped != reported_dropped) {
+        struct log_record record = { .ts_usec = log_now_usec(), .level = LOG_LEVEL_WARN };
+        snprintf(record.text, sizeof(record.text), "Log: %lu records dropped", dropped - reported_dropped);
+        log_write_record(&record);
+        reported_dropped = dropped;
+        written++;
+    }
+
+    if (written > 0) {
+        fflush(stdout);
+        fflush(log_file);
+    }
+
+    funlockfile(stdout);
+    pthread_mutex_unlock(&writer_mutex);
+
+    return written;
+}
+
+static void *log_writer(void *arg __attribute__((unused))) {
+    struct timespec interval = { .tv_nsec = LOG_WRITER_INTERVAL };
+
+    for (;;) {
+        log_drain();
+        nanosleep(&interval, NULL);
+    }
+
+    return NULL;
+}
+
 void log_init(void) {
     log_file = fopen("songcast-receiver.log", "a");
 
@@ -14,23 +248,65 @@ void log_init(void) {
         fprintf(stderr, "Could not open logfile\n");
         exit(1);
     }
+
+    int err = pthread_create(&writer, NULL, log_writer, NULL);
+
+    if (err != 0)
+        error(1, err, "Could not start log writer");
+
+    pthread_setname_np(writer, "log");
+
+    atexit(log_flush);
 }
 
-void log_printf(const char* format, ...) {
-    printf("\033[%d;%dr", log_offset, log_offset + log_lines);
-    printf("\033[%d;0H", log_offset + log_lines);
-    printf("\033[1S");
+void log_set_level(enum log_level level) {
+    atomic_store(&max_level, level);
+}
+
+bool log_parse_level(const char *name, enum log_level *level) {
+    for (size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++)
+        if (strcmp(name, level_names[i]) == 0) {
+            *level = i;
+            return true;
+        }
+
+    return false;
+}
 
-    va_list dup_args, args;
+// 0 disables rate limiting.
+void log_set_rate(unsigned int records_per_sec) {
+    atomic_store(&rate, records_per_sec);
+}
+
+// Writes out everything logged so far.
+void log_flush(void) {
+    log_drain();
+}
+
+void log_message(enum log_level level, const char* format, ...) {
+    if ((int)level > atomic_load_explicit(&max_level, memory_order_relaxed))
+        return;
+
+    struct log_ring *ring = log_thread_ring();
+
+    if (ring == NULL)
+        return;
+
+    uint64_t now = log_now_usec();
+    struct log_record *record = spsc_write_slot(&ring->records);
+
+    if (record == NULL || !log_take_token(ring, now)) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    record->ts_usec = now;
+    record->level = level;
+
+    va_list args;
     va_start(args, format);
-    va_copy(dup_args, args);
-    vfprintf(stdout, format, args);
-    printf("\033[K");
-    fflush(stdout);
+    vsnprintf(record->text, sizeof(record->text), format, args);
     va_end(args);
 
-    vfprintf(log_file, format, dup_args);
-    fprintf(log_file, "\n");
-    fflush(log_file);
-    va_end(dup_args);
+    spsc_commit(&ring->records);
 }
@@ -1,4 +1,21 @@
 #pragma once
 
+#include <stdbool.h>
+
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+};
+
 void log_init(void);
-void log_printf(const char* format, ...);
\ No newline at end of file
+void log_set_level(enum log_level level);
+bool log_parse_level(const char *name, enum log_level *level);
+void log_set_rate(unsigned int records_per_sec);
+void log_flush(void);
+void log_message(enum log_level level, const char* format, ...) __attribute__ ((format (printf, 2, 3)));
+
+#define log_printf(...) log_message(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_message(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_debug(...) log_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
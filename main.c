@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <error.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -15,23 +17,37 @@
 #include <time.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 
 #include "timespec.h"
 #include "ohz_v1.h"
 #include "ohm_v1.h"
 #include "player.h"
+#include "audio_frame.h"
 #include "uri.h"
 #include "log.h"
 #include "upnpdevice.h"
 #include "ipc.h"
+#include "spsc.h"
+#include "metrics.h"
 
 #define OHM_NULL_URI "ohm://0.0.0.0:0"
 
+#define OHM_BATCH_SIZE 32 // datagrams per recvmmsg()
+#define OHM_STATS_BUCKETS 7 // 1, 2, 4, ..., 64 packets per wakeup
+#define OHM_CONTROL_QUEUE 64 // control messages from the OHM thread
+#define RESEND_TICK 5e-3 // seconds between resend request checks
+#define STATUS_INTERVAL 100e6 // nsec, terminal status redraw at 10 Hz
+
 /*
   Commands
     preset <number>
     uri <uri>
     stop
+    stats
     quit
 */
 
@@ -41,6 +57,30 @@ struct handler {
   void *userdata;
 };
 
+// Preallocated receive slots for recvmmsg().
+struct ohm_batch {
+  struct mmsghdr msgs[OHM_BATCH_SIZE];
+  struct iovec iov[OHM_BATCH_SIZE];
+  struct sockaddr_storage src_addr[OHM_BATCH_SIZE];
+  char ctrl[OHM_BATCH_SIZE][CMSG_SPACE(sizeof(struct timeval))];
+  uint8_t buf[OHM_BATCH_SIZE][OHM1_MAX_PACKET];
+};
+
+// Written by the OHM thread only, read by the control loop and the
+// metrics endpoint with relaxed loads.
+struct ohm_stats {
+  atomic_ulong wakeups;
+  atomic_ulong packets;
+  atomic_uint max_batch;
+  atomic_ulong batch_histogram[OHM_STATS_BUCKETS];
+};
+
+// Scheduling of the OHM receive thread.
+struct ohm_thread_config {
+  int priority; // SCHED_FIFO priority, 0 to keep the default policy
+  int cpu;      // CPU to pin the thread to, -1 for no affinity
+};
+
 struct ReceiverData {
   int efd;
   int ohz_fd;
@@ -53,7 +93,17 @@ struct ReceiverData {
   bool unicast;
   int slave_count;
   struct sockaddr_in *my_slaves;
-  struct handler ohm_handler;
+  struct ohm_batch *ohm_batch;
+  struct ohm_stats ohm_stats;
+
+  // Audio is received on its own thread. Messages for the control loop
+  // are passed through ohm_control and signalled on ohm_control_fd.
+  struct ohm_thread_config ohm_thread_config;
+  pthread_t ohm_thread;
+  atomic_bool ohm_thread_stop;
+  int ohm_wake_fd;
+  struct spsc ohm_control;
+  int ohm_control_fd;
 
   player_t player;
 };
@@ -64,8 +114,13 @@ void inc_volume(struct ReceiverData *receiver);
 void dec_volume(struct ReceiverData *receiver);
 bool goto_uri(struct ReceiverData *receiver, const char *uri_string);
 bool goto_preset(struct ReceiverData *receiver, unsigned int preset);
-void receiver(const char *uri_string, unsigned int preset);
+void receiver(const char *uri_string, unsigned int preset, struct ohm_thread_config *thread_config, struct player_config *player_config, bool headless, int metrics_port);
 void handle_ohm(int fd, uint32_t events, void *userdata);
+void handle_ohm_packet(struct ReceiverData *receiver, uint8_t *buf, size_t n, struct timespec *ts_recv);
+void print_ohm_stats(struct ohm_stats *stats);
+void collect_receiver_metrics(FILE *out, void *userdata);
+void *ohm_thread(void *userdata);
+void *status_thread(void *userdata);
 int open_ohz_socket(void);
 
 char *parse_preset_metadata(char *data, size_t length) {
@@ -416,13 +471,28 @@ void stop_playback(struct ReceiverData *receiver) {
     return;
 
   log_printf("Stopping playback.");
+  print_ohm_stats(&receiver->ohm_stats);
+  print_frame_pool_stats();
+  print_resend_stats(&receiver->player.resend);
+  print_output_stats(&receiver->player);
 
   if (receiver->unicast)
     ohm_send_event(receiver->ohm_fd, receiver->uri, OHM1_LEAVE);
 
-  // This will remove the handler, too.
+  atomic_store(&receiver->ohm_thread_stop, true);
+
+  if (eventfd_write(receiver->ohm_wake_fd, 1) < 0)
+    error(1, errno, "eventfd_write");
+
+  pthread_join(receiver->ohm_thread, NULL);
+
   close(receiver->ohm_fd);
 
+  // Discard control messages of the old stream.
+  void *message;
+  while (spsc_pop(&receiver->ohm_control, &message))
+    free(message);
+
   free(receiver->my_slaves);
   receiver->slave_count = 0;
   receiver->my_slaves = NULL;
@@ -440,65 +510,275 @@ void play_uri(struct ReceiverData *receiver) {
   receiver->slave_count = 0;
   receiver->ohm_fd = open_ohm_socket(receiver->uri->host, receiver->uri->port, receiver->unicast);
 
-  receiver->ohm_handler = (struct handler) {
+  atomic_store(&receiver->ohm_thread_stop, false);
+
+  int err = pthread_create(&receiver->ohm_thread, NULL, ohm_thread, receiver);
+
+  if (err != 0)
+    error(1, err, "Could not start OHM thread");
+
+  ohm_send_event(receiver->ohm_fd, receiver->uri, OHM1_JOIN);
+  clock_gettime(CLOCK_MONOTONIC, &receiver->last_listen);
+}
+
+// Fills in the receive timestamp of a datagram from its control messages.
+// Returns false if the kernel did not attach a SO_TIMESTAMP.
+bool ohm_recv_timestamp(struct msghdr *msg, struct timespec *ts_recv) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(struct timeval))) {
+      struct timeval *tv_recv = (struct timeval *)CMSG_DATA(cmsg);
+      ts_recv->tv_sec = tv_recv->tv_sec;
+      ts_recv->tv_nsec = (long long int)tv_recv->tv_usec * 1000;
+
+      // TODO convert to monotonic here?
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void apply_ohm_thread_config(struct ohm_thread_config *config) {
+  if (config->cpu >= 0) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(config->cpu, &cpuset);
+
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (err != 0)
+      log_printf("Could not pin OHM thread to CPU %d: %s", config->cpu, strerror(err));
+  }
+
+  if (config->priority > 0) {
+    struct sched_param param = {
+      .sched_priority = config->priority
+    };
+
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0)
+      log_printf("Could not set SCHED_FIFO priority %d for OHM thread: %s", config->priority, strerror(err));
+  }
+}
+
+// Receives audio independently of the control loop, so that preset
+// parsing or stdin commands do not delay packet reception.
+void *ohm_thread(void *userdata) {
+  struct ReceiverData *receiver = userdata;
+
+  apply_ohm_thread_config(&receiver->ohm_thread_config);
+
+  int efd = epoll_create1(0);
+  if (efd == -1)
+    error(1, errno, "epoll_create");
+
+  struct handler ohm_handler = {
     .fd = receiver->ohm_fd,
     .func = handle_ohm,
     .userdata = receiver,
   };
 
-  add_fd(receiver->efd, &receiver->ohm_handler, EPOLLIN);
+  add_fd(efd, &ohm_handler, EPOLLIN);
 
-  ohm_send_event(receiver->ohm_fd, receiver->uri, OHM1_JOIN);
-  clock_gettime(CLOCK_MONOTONIC, &receiver->last_listen);
+  struct handler wake_handler = {
+    .fd = receiver->ohm_wake_fd,
+  };
+
+  add_fd(efd, &wake_handler, EPOLLIN);
+
+  struct timespec last_resend_tick;
+  clock_gettime(CLOCK_MONOTONIC, &last_resend_tick);
+
+  while (!atomic_load(&receiver->ohm_thread_stop)) {
+    struct epoll_event events[2];
+
+    // Missing frames are requested at most once per tick, with all due
+    // seqnums in one message.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (timespec_sub(&now, &last_resend_tick) >= RESEND_TICK) {
+      uint64_t now_usec = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+      struct missing_frames *missing = player_poll_resend(&receiver->player, now_usec);
+
+      if (missing)
+        ohm_send_resend_request(receiver->ohm_fd, receiver->uri, missing);
+
+      free(missing);
+      last_resend_tick = now;
+    }
+
+    int n = epoll_wait(efd, events, 2, RESEND_TICK * 1000);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      error(1, errno, "epoll_wait");
+    }
+
+    for (int i = 0; i < n; i++) {
+      struct handler *handler = events[i].data.ptr;
+
+      if (handler == &wake_handler) {
+        eventfd_t value;
+        eventfd_read(receiver->ohm_wake_fd, &value);
+        continue;
+      }
+
+      handler->func(handler->fd, events[i].events, handler->userdata);
+    }
+  }
+
+  close(efd);
+
+  return NULL;
+}
+
+// Hands a copy of an OHM message to the control loop.
+void post_ohm_control(struct ReceiverData *receiver, uint8_t *buf, size_t n) {
+  void *message = malloc(n);
+
+  if (message == NULL)
+    return;
+
+  memcpy(message, buf, n);
+
+  if (!spsc_push(&receiver->ohm_control, &message)) {
+    free(message);
+    return;
+  }
+
+  if (eventfd_write(receiver->ohm_control_fd, 1) < 0)
+    error(1, errno, "eventfd_write");
+}
+
+void handle_ohm_control(int fd, uint32_t events, void *userdata) {
+  struct ReceiverData *receiver = userdata;
+  eventfd_t value;
+
+  if (eventfd_read(fd, &value) < 0 && errno != EAGAIN)
+    error(1, errno, "eventfd_read");
+
+  void *message;
+  while (spsc_pop(&receiver->ohm_control, &message)) {
+    ohm1_header *hdr = message;
+
+    switch (hdr->type) {
+      case OHM1_LISTEN:
+        clock_gettime(CLOCK_MONOTONIC, &receiver->last_listen);
+        break;
+      case OHM1_TRACK:
+        dump_track(message);
+        break;
+      case OHM1_METATEXT:
+        dump_metatext(message);
+        break;
+      default:
+        break;
+    }
+
+    free(message);
+  }
 }
 
 void handle_ohm(int fd, uint32_t events, void *userdata) {
   struct ReceiverData *receiver = userdata;
-  struct sockaddr_storage src_addr;
-  uint8_t buf[8192];
+  struct ohm_batch *batch = receiver->ohm_batch;
+  unsigned int received = 0;
 
-  char ctrl[CMSG_SPACE(sizeof(struct timeval))];
-  struct cmsghdr *cmsg = (struct cmsghdr *)&ctrl;
+  // Drain the socket. Each recvmmsg() returns up to OHM_BATCH_SIZE datagrams;
+  // a short batch means the socket is empty.
+  while (1) {
+    for (int i = 0; i < OHM_BATCH_SIZE; i++) {
+      batch->iov[i] = (struct iovec) {
+        .iov_base = batch->buf[i],
+        .iov_len = sizeof(batch->buf[i])
+      };
+
+      batch->msgs[i].msg_hdr = (struct msghdr) {
+        .msg_name = &batch->src_addr[i],
+        .msg_namelen = sizeof(batch->src_addr[i]),
+        .msg_iov = &batch->iov[i],
+        .msg_iovlen = 1,
+        .msg_control = batch->ctrl[i],
+        .msg_controllen = sizeof(batch->ctrl[i])
+      };
+    }
 
-  struct iovec iov[1] = {
-    {
-      .iov_base = &buf,
-      .iov_len = sizeof(buf)
+    int n = recvmmsg(fd, batch->msgs, OHM_BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        break;
+
+      error(1, errno, "recvmmsg");
     }
-  };
 
-  struct msghdr msg = {
-    .msg_name = &src_addr,
-    .msg_namelen = sizeof(src_addr),
-    .msg_iov = iov,
-    .msg_iovlen = 1,
-    .msg_control = ctrl,
-    .msg_controllen = sizeof(ctrl)
-  };
+    for (int i = 0; i < n; i++) {
+      struct timespec ts_recv;
 
-  ssize_t n = recvmsg(fd, &msg, 0);
+      // We always require the timestamp for now.
+      if (!ohm_recv_timestamp(&batch->msgs[i].msg_hdr, &ts_recv))
+        assert(false);
 
-  struct timespec ts_recv;
+      handle_ohm_packet(receiver, batch->buf[i], batch->msgs[i].msg_len, &ts_recv);
+    }
 
-  if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP &&
-    cmsg->cmsg_len == CMSG_LEN(sizeof(struct timeval))) {
-    struct timeval *tv_recv = (struct timeval *)CMSG_DATA(cmsg);
-    ts_recv.tv_sec = tv_recv->tv_sec;
-    ts_recv.tv_nsec = (long long int)tv_recv->tv_usec * 1000;
+    received += n;
 
-    // TODO convert to monotonic here?
-  } else {
-    // We always require the timestamp for now.
-    assert(false);
+    if (n < OHM_BATCH_SIZE)
+      break;
   }
 
-  if (n < 0) {
-    if (errno == EAGAIN)
-      return;
+  struct ohm_stats *stats = &receiver->ohm_stats;
 
-    return;
+  atomic_fetch_add_explicit(&stats->wakeups, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->packets, received, memory_order_relaxed);
+
+  // No other writer, a plain store is enough.
+  if (received > atomic_load_explicit(&stats->max_batch, memory_order_relaxed))
+    atomic_store_explicit(&stats->max_batch, received, memory_order_relaxed);
+
+  int bucket = 0;
+  while (bucket < OHM_STATS_BUCKETS - 1 && (1U << bucket) < received)
+    bucket++;
+
+  atomic_fetch_add_explicit(&stats->batch_histogram[bucket], 1, memory_order_relaxed);
+}
+
+void print_ohm_stats(struct ohm_stats *stats) {
+  unsigned long packets = atomic_load_explicit(&stats->packets, memory_order_relaxed);
+  unsigned long wakeups = atomic_load_explicit(&stats->wakeups, memory_order_relaxed);
+
+  log_printf("OHM: %lu packets in %lu wakeups (%.2f packets/wakeup, max %u)",
+             packets, wakeups, wakeups > 0 ? (double)packets / wakeups : 0.0,
+             atomic_load_explicit(&stats->max_batch, memory_order_relaxed));
+
+  for (int i = 0; i < OHM_STATS_BUCKETS; i++) {
+    unsigned long count = atomic_load_explicit(&stats->batch_histogram[i], memory_order_relaxed);
+
+    if (count > 0)
+      log_printf("OHM:   <= %4u packets/wakeup: %lu", 1U << i, count);
   }
+}
+
+void collect_receiver_metrics(FILE *out, void *userdata) {
+  struct ReceiverData *receiver = userdata;
+  struct ohm_stats *stats = &receiver->ohm_stats;
+  struct frame_pool_stats pool;
+
+  metrics_print(out, "songcast_packets_total", "counter", "OHM packets received",
+                atomic_load_explicit(&stats->packets, memory_order_relaxed));
+  metrics_print(out, "songcast_wakeups_total", "counter", "OHM thread wakeups",
+                atomic_load_explicit(&stats->wakeups, memory_order_relaxed));
+
+  frame_pool_get_stats(&pool);
+  metrics_print(out, "songcast_frame_pool_in_use", "gauge", "Pooled audio frames in use", pool.in_use);
+  metrics_print(out, "songcast_frame_pool_exhausted_total", "counter", "Frames allocated outside the pool", pool.exhausted);
+}
 
+void handle_ohm_packet(struct ReceiverData *receiver, uint8_t *buf, size_t n, struct timespec *ts_recv) {
   if (n < sizeof(ohm1_header))
     return;
 
@@ -520,33 +800,24 @@ void handle_ohm(int fd, uint32_t events, void *userdata) {
         for (size_t i = 0; i < receiver->slave_count; i++) {
           // Ignore any errors when sending to slaves.
           // There is nothing we could do to help.
-          sendto(receiver->ohm_fd, &buf, n, 0, (const struct sockaddr*) &receiver->my_slaves[i], sizeof(struct sockaddr));
+          sendto(receiver->ohm_fd, buf, n, 0, (const struct sockaddr*) &receiver->my_slaves[i], sizeof(struct sockaddr));
         }
         break;
       default:
         break;
     }
 
-  struct missing_frames *missing;
-
   switch (hdr->type) {
     case OHM1_LISTEN:
       if (!receiver->unicast)
-        clock_gettime(CLOCK_MONOTONIC, &receiver->last_listen);
+        post_ohm_control(receiver, buf, n);
       break;
     case OHM1_AUDIO:
-      missing = handle_frame(&receiver->player, (void*)buf, &ts_recv);
-
-      if (missing)
-        ohm_send_resend_request(receiver->ohm_fd, receiver->uri, missing);
-
-      free(missing);
+      handle_frame(&receiver->player, (void*)buf, ts_recv);
       break;
     case OHM1_TRACK:
-      dump_track((void *)buf);
-      break;
     case OHM1_METATEXT:
-      dump_metatext((void *)buf);
+      post_ohm_control(receiver, buf, n);
       break;
     case OHM1_SLAVE:
       update_slaves(receiver, (void *)buf);
@@ -633,6 +904,16 @@ void handle_stdin(int fd, uint32_t events, void *userdata) {
   if (strcmp(cmd, "voldown") == 0)
     dec_volume(receiver);
 
+  if (strcmp(cmd, "stats") == 0) {
+    print_ohm_stats(&receiver->ohm_stats);
+    print_frame_pool_stats();
+    print_resend_stats(&receiver->player.resend);
+    print_output_stats(&receiver->player);
+  }
+
+  if (strcmp(cmd, "trace") == 0 && arg != NULL)
+    player_set_clocktrace(&receiver->player, strcmp(arg, "on") == 0);
+
   if (strcmp(cmd, "quit") == 0)
     exit(1);
 }
@@ -706,14 +987,45 @@ bool goto_uri(struct ReceiverData *receiver, const char *uri_string) {
   return false;
 }
 
-void receiver(const char *uri_string, unsigned int preset) {
+// Redraws the terminal status at a fixed rate, so that the packet and
+// audio paths only need to store their state.
+void *status_thread(void *userdata) {
+  player_t *player = userdata;
+  struct timespec interval = { .tv_nsec = STATUS_INTERVAL };
+
+  for (;;) {
+    flockfile(stdout);
+    print_player_status(player);
+    fflush(stdout);
+    funlockfile(stdout);
+
+    nanosleep(&interval, NULL);
+  }
+
+  return NULL;
+}
+
+void receiver(const char *uri_string, unsigned int preset, struct ohm_thread_config *thread_config, struct player_config *player_config, bool headless, int metrics_port) {
   struct ReceiverData receiver = {
     .preset = 0,
     .zone_id = NULL,
     .uri = NULL,
-    .my_slaves = NULL
+    .my_slaves = NULL,
+    .ohm_batch = calloc(1, sizeof(struct ohm_batch)),
+    .ohm_thread_config = *thread_config,
+    .ohm_wake_fd = eventfd(0, EFD_NONBLOCK),
+    .ohm_control_fd = eventfd(0, EFD_NONBLOCK)
   };
 
+  if (receiver.ohm_batch == NULL)
+    error(1, errno, "calloc");
+
+  if (receiver.ohm_wake_fd == -1 || receiver.ohm_control_fd == -1)
+    error(1, errno, "eventfd");
+
+  if (!spsc_init(&receiver.ohm_control, OHM_CONTROL_QUEUE, sizeof(void *)))
+    error(1, errno, "spsc_init");
+
   int ctrl_pipe[2];
 
   if (pipe (ctrl_pipe))
@@ -721,7 +1033,24 @@ void receiver(const char *uri_string, unsigned int preset) {
 
   upnpdevice(&receiver.player, &receiver.player.dctx, ctrl_pipe[1]);
 
-  player_init(&receiver.player);
+  player_init(&receiver.player, player_config);
+
+  metrics_collector(collect_receiver_metrics, &receiver);
+
+  if (metrics_port != 0 && !metrics_start(metrics_port))
+    error(1, 0, "Could not start metrics endpoint on port %d", metrics_port);
+
+  if (!headless) {
+    pthread_t status;
+
+    int err = pthread_create(&status, NULL, status_thread, &receiver.player);
+
+    if (err != 0)
+      error(1, err, "Could not start status thread");
+
+    pthread_setname_np(status, "status");
+    pthread_detach(status);
+  }
 
   device_enable(&receiver.player.dctx);
 
@@ -758,6 +1087,14 @@ void receiver(const char *uri_string, unsigned int preset) {
 
   add_fd(receiver.efd, &ohz_handler, EPOLLIN);
 
+  struct handler ohm_control_handler = {
+    .fd = receiver.ohm_control_fd,
+    .func = handle_ohm_control,
+    .userdata = &receiver,
+  };
+
+  add_fd(receiver.efd, &ohm_control_handler, EPOLLIN);
+
   if (preset != 0)
     goto_preset(&receiver, preset);
 
@@ -838,18 +1175,103 @@ void receiver(const char *uri_string, unsigned int preset) {
   }
 }
 
+// pulse, pipewire, alsa[:<device>], null or file:<path> (raw, or WAV if
+// the name ends in .wav). The null and file outputs play on the system
+// clock.
+struct output *parse_output(const char *arg) {
+  struct output *output;
+
+  if (strcmp(arg, "pulse") == 0)
+    return output_pulse_new();
+
+#ifdef HAVE_PIPEWIRE
+  if (strcmp(arg, "pipewire") == 0)
+    return output_pipewire_new();
+#endif
+
+#ifdef HAVE_ALSA
+  if (strcmp(arg, "alsa") == 0)
+    return output_alsa_new("default");
+
+  if (strncmp(arg, "alsa:", 5) == 0)
+    return output_alsa_new(arg + 5);
+#endif
+
+  if (strcmp(arg, "null") == 0)
+    output = output_null_new();
+  else if (strncmp(arg, "file:", 5) == 0)
+    output = output_file_new(arg + 5);
+  else
+    error(1, 0, "Unknown output %s (pulse, pipewire, alsa:<device>, null, file:<path>)", arg);
+
+  if (output == NULL)
+    error(1, errno, "Could not create output %s", arg);
+
+  if (!output_file_start_clock(output))
+    error(1, errno, "Could not start output clock");
+
+  return output;
+}
+
 int main(int argc, char *argv[]) {
   LIBXML_TEST_VERSION
 
   int preset = 0;
+  bool headless = false;
+  int metrics_port = 0;
   char *uri = NULL;
 
+  struct ohm_thread_config thread_config = {
+    .priority = 0,
+    .cpu = -1,
+  };
+
+  struct player_config player_config;
+  player_config_defaults(&player_config);
+
   log_init();
   log_printf("===== START =====");
 
+  enum log_level level;
   int c;
-  while ((c = getopt(argc, argv, "p:u:d")) != -1)
+  while ((c = getopt(argc, argv, "p:u:dP:A:w:e:R:l:L:Ht:m:o:")) != -1)
   switch (c) {
+    case 'P':
+      thread_config.priority = atoi(optarg);
+      break;
+    case 'A':
+      thread_config.cpu = atoi(optarg);
+      break;
+    case 'w':
+      player_config.resend.reorder_window_usec = atoi(optarg) * 1000;
+      break;
+    case 'e':
+      player_config.passthrough_epsilon = atof(optarg) * 1e-6;
+      break;
+    case 'R':
+      if (!resampler_parse_type(optarg, &player_config.resampler))
+        error(1, 0, "Unknown resampler %s (src, fast, medium, best)", optarg);
+      break;
+    case 'l':
+      if (!log_parse_level(optarg, &level))
+        error(1, 0, "Unknown log level %s (error, warn, info, debug)", optarg);
+      log_set_level(level);
+      break;
+    case 'L':
+      log_set_rate(atoi(optarg));
+      break;
+    case 't':
+      player_config.clocktrace_path = optarg;
+      break;
+    case 'm':
+      metrics_port = atoi(optarg);
+      break;
+    case 'o':
+      player_config.output = parse_output(optarg);
+      break;
+    case 'H':
+      headless = true;
+      break;
     case 'p':
       preset = atoi(optarg);
       break;
@@ -861,6 +1283,6 @@ int main(int argc, char *argv[]) {
   if (uri != NULL && preset != 0)
     error(1, 0, "Can not specify both preset and URI!");
 
-  receiver(uri, preset);
+  receiver(uri, preset, &thread_config, &player_config, headless, metrics_port);
   free(uri);
 }
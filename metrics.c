@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "log.h"
+
+#define METRICS_MAX 64
+#define METRICS_TIMEOUT 1 // seconds to wait for a request
+#define METRICS_BACKOFF 1 // seconds to wait when accept fails
+
+enum metric_type { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM, METRIC_COLLECTOR };
+
+struct metric {
+  enum metric_type type;
+  const char *name;
+  const char *help;
+  double scale; // counters, unit of the stored value
+  union {
+    atomic_ulong *counter;
+    _Atomic double *gauge;
+    struct histogram *histogram;
+    struct {
+      void (*collect)(FILE *out, void *ctx);
+      void *ctx;
+    } collector;
+  };
+};
+
+static struct metric metrics[METRICS_MAX];
+static size_t n_metrics;
+
+bool histogram_init(struct histogram *h, const double *bounds, size_t count) {
+  *h = (struct histogram){
+    .bounds = bounds,
+    .count = count,
+    .buckets = calloc(count + 1, sizeof(atomic_ulong)),
+  };
+
+  return h->buckets != NULL;
+}
+
+void histogram_observe(struct histogram *h, double value) {
+  size_t i = 0;
+
+  while (i < h->count && value > h->bounds[i])
+    i++;
+
+  atomic_fetch_add_explicit(&h->buckets[i], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->observations, 1, memory_order_relaxed);
+
+  double sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&h->sum, &sum, sum + value, memory_order_relaxed, memory_order_relaxed));
+}
+
+static struct metric *metrics_add(enum metric_type type, const char *name, const char *help) {
+  if (n_metrics == METRICS_MAX) {
+    log_printf("Metrics: too many metrics, dropping %s", name != NULL ? name : "collector");
+    return NULL;
+  }
+
+  struct metric *m = &metrics[n_metrics++];
+  m->type = type;
+  m->name = name;
+  m->help = help;
+
+  return m;
+}
+
+void metrics_counter(const char *name, const char *help, atomic_ulong *value) {
+  struct metric *m = metrics_add(METRIC_COUNTER, name, help);
+
+  if (m != NULL) {
+    m->counter = value;
+    m->scale = 1;
+  }
+}
+
+// A counter kept in smaller units, e.g. microseconds exported as seconds
+// with a scale of 1e-6.
+void metrics_counter_scaled(const char *name, const char *help, atomic_ulong *value, double scale) {
+  struct metric *m = metrics_add(METRIC_COUNTER, name, help);
+
+  if (m != NULL) {
+    m->counter = value;
+    m->scale = scale;
+  }
+}
+
+void metrics_gauge(const char *name, const char *help, _Atomic double *value) {
+  struct metric *m = metrics_add(METRIC_GAUGE, name, help);
+
+  if (m != NULL)
+    m->gauge = value;
+}
+
+void metrics_histogram(const char *name, const char *help, struct histogram *h) {
+  struct metric *m = metrics_add(METRIC_HISTOGRAM, name, help);
+
+  if (m != NULL)
+    m->histogram = h;
+}
+
+void metrics_collector(void (*collect)(FILE *out, void *ctx), void *ctx) {
+  struct metric *m = metrics_add(METRIC_COLLECTOR, NULL, NULL);
+
+  if (m != NULL) {
+    m->collector.collect = collect;
+    m->collector.ctx = ctx;
+  }
+}
+
+void metrics_print(FILE *out, const char *name, const char *type, const char *help, double value) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+static void print_histogram(FILE *out, const struct metric *m) {
+  struct histogram *h = m->histogram;
+  unsigned long cumulative = 0;
+
+  fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", m->name, m->help, m->name);
+
+  for (size_t i = 0; i < h->count; i++) {
+    cumulative += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", m->name, h->bounds[i], cumulative);
+  }
+
+  cumulative += atomic_load_explicit(&h->buckets[h->count], memory_order_relaxed);
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", m->name, cumulative);
+  fprintf(out, "%s_sum %.17g\n", m->name, atomic_load_explicit(&h->sum, memory_order_relaxed));
+  fprintf(out, "%s_count %lu\n", m->name, atomic_load_explicit(&h->observations, memory_order_relaxed));
+}
+
+static void metrics_render(FILE *out) {
+  for (size_t i = 0; i < n_metrics; i++) {
+    const struct metric *m = &metrics[i];
+
+    switch (m->type) {
+      case METRIC_COUNTER:
+        metrics_print(out, m->name, "counter", m->help, atomic_load_explicit(m->counter, memory_order_relaxed) * m->scale);
+        break;
+      case METRIC_GAUGE:
+        metrics_print(out, m->name, "gauge", m->help, atomic_load_explicit(m->gauge, memory_order_relaxed));
+        break;
+      case METRIC_HISTOGRAM:
+        print_histogram(out, m);
+        break;
+      case METRIC_COLLECTOR:
+        m->collector.collect(out, m->collector.ctx);
+        break;
+    }
+  }
+}
+
+// MSG_NOSIGNAL, a client closing early must not raise SIGPIPE.
+static bool send_all(int client, const char *data, size_t length) {
+  for (size_t sent = 0; sent < length;) {
+    ssize_t n = send(client, data + sent, length - sent, MSG_NOSIGNAL);
+
+    if (n <= 0)
+      return false;
+
+    sent += n;
+  }
+
+  return true;
+}
+
+static void metrics_serve(int client) {
+  char request[1024];
+
+  // Any request gets the metrics, the request itself is not parsed.
+  if (read(client, request, sizeof(request)) <= 0)
+    return;
+
+  char *body;
+  size_t length;
+  FILE *out = open_memstream(&body, &length);
+
+  if (out == NULL)
+    return;
+
+  metrics_render(out);
+  fclose(out);
+
+  char header[256];
+  int header_length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\n"
+                               "Connection: close\r\n\r\n", length);
+
+  if (send_all(client, header, header_length))
+    send_all(client, body, length);
+
+  free(body);
+}
+
+static void *metrics_thread(void *userdata) {
+  int fd = (intptr_t)userdata;
+  struct timeval timeout = { .tv_sec = METRICS_TIMEOUT };
+
+  for (;;) {
+    int client = accept(fd, NULL, NULL);
+
+    if (client == -1) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        // Out of descriptors or memory, retrying right away would spin.
+        log_printf("Metrics: accept: %s", strerror(errno));
+        sleep(METRICS_BACKOFF);
+      }
+
+      continue;
+    }
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    metrics_serve(client);
+    close(client);
+  }
+
+  return NULL;
+}
+
+// Serves the metrics on 127.0.0.1:port.
+bool metrics_start(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (fd == -1) {
+    log_printf("Metrics: socket: %s", strerror(errno));
+    return false;
+  }
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 4) == -1) {
+    log_printf("Metrics: could not listen on port %d: %s", port, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  pthread_t thread;
+
+  if (pthread_create(&thread, NULL, metrics_thread, (void *)(intptr_t)fd) != 0) {
+    close(fd);
+    return false;
+  }
+
+  pthread_setname_np(thread, "metrics");
+  pthread_detach(thread);
+
+  log_printf("Metrics: http://127.0.0.1:%d/metrics", port);
+
+  return true;
+}
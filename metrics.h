@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+// Metrics in the Prometheus text exposition format, served over HTTP on
+// localhost. Counters, gauges and histograms are updated lock-free by the
+// code they describe and only read by the server thread. Everything is
+// registered once at startup, before metrics_start().
+
+struct histogram {
+  const double *bounds; // ascending upper bounds, +Inf is implicit
+  size_t count;
+  atomic_ulong *buckets; // count + 1, not cumulative
+  _Atomic double sum;
+  atomic_ulong observations;
+};
+
+bool histogram_init(struct histogram *h, const double *bounds, size_t count);
+void histogram_observe(struct histogram *h, double value);
+
+static inline void gauge_set(_Atomic double *gauge, double value) {
+  atomic_store_explicit(gauge, value, memory_order_relaxed);
+}
+
+void metrics_counter(const char *name, const char *help, atomic_ulong *value);
+void metrics_counter_scaled(const char *name, const char *help, atomic_ulong *value, double scale);
+void metrics_gauge(const char *name, const char *help, _Atomic double *value);
+void metrics_histogram(const char *name, const char *help, struct histogram *h);
+
+// For values kept elsewhere, e.g. existing statistics. Called from the
+// server thread, so it must only read what is safe to read concurrently.
+void metrics_collector(void (*collect)(FILE *out, void *ctx), void *ctx);
+void metrics_print(FILE *out, const char *name, const char *type, const char *help, double value);
+
+bool metrics_start(int port);
@@ -13,6 +13,8 @@ enum {
   OHM1_RESEND_REQUEST,
 };
 
+#define OHM1_MAX_PACKET 8192
+
 #define OHM1_FLAG_HALT (1<<0)
 #define OHM1_FLAG_LOSSLESS (1<<1)
 #define OHM1_FLAG_TIMESTAMPED (1<<2)
@@ -1,22 +1,116 @@
 #pragma once
 
-#include <pulse/pulseaudio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pulse/sample.h>
 
-struct pulse {
-  pa_threaded_mainloop *mainloop;
-  pa_context *context;
-  pa_stream *stream;
-  int operation_success;
+// Audio output backends. A backend creates streams for one sample spec
+// at a time. It requests data through the write callback from a thread
+// of its own and reports timing comparable to the packet receive
+// timestamps.
+
+struct output;
+struct output_stream;
+
+struct output_timing {
+  uint64_t timestamp_usec; // when this was measured, CLOCK_REALTIME
+  int64_t write_index;     // bytes written to the stream
+  int64_t read_index;      // bytes played
+  uint64_t sink_usec;      // latency below the stream
+  uint64_t transport_usec;
+  bool playing;
+};
+
+struct output_callbacks {
+  void (*write)(struct output_stream *stream, size_t request, void *userdata);
+  void (*underflow)(struct output_stream *stream, void *userdata);
+  void (*latency)(struct output_stream *stream, void *userdata);
 };
 
-struct output_cb {
-  pa_stream_request_cb_t write;
-  pa_stream_notify_cb_t underflow;
-  pa_stream_notify_cb_t latency;
+struct output_ops {
+  const char *name;
+  bool concurrent_streams; // a second stream may be opened while one plays
+  struct output_stream *(*create_stream)(struct output *output, const pa_sample_spec *ss, size_t tlength,
+                                         const struct output_callbacks *callbacks, void *userdata,
+                                         int volume, int mute);
+  void (*stop_stream)(struct output_stream *stream);
+
+  // Only called from the write callback.
+  int (*begin_write)(struct output_stream *stream, void **data, size_t *nbytes);
+  int (*write)(struct output_stream *stream, const void *data, size_t nbytes);
+  bool (*get_timing)(struct output_stream *stream, struct output_timing *timing);
+  void (*update_timing)(struct output_stream *stream);
+
+  void (*set_volume)(struct output_stream *stream, int volume);
+  void (*set_mute)(struct output_stream *stream, int mute);
 };
 
-void output_init(struct pulse *pulse);
-void create_stream(struct pulse *pulse, pa_sample_spec *ss, const pa_buffer_attr *bufattr, void *userdata, struct output_cb *callbacks, int volume, int mute);
-void stop_stream(struct pulse *pulse);
-void output_set_mute(struct pulse *pulse, int mute);
-void output_set_volume(struct pulse *pulse, int volume);
+struct output {
+  const struct output_ops *ops;
+  atomic_ulong streams_created;
+  atomic_ulong streams_stopped;
+};
+
+struct output_stream {
+  struct output *output;
+  pa_sample_spec ss;
+};
+
+struct output *output_pulse_new(void);
+struct output *output_alsa_new(const char *device);
+struct output *output_pipewire_new(void);
+struct output *output_file_new(const char *path);
+struct output *output_null_new(void);
+bool output_file_start_clock(struct output *output);
+void output_file_advance(struct output *output, uint64_t now_usec);
+double output_file_played_usec(struct output *output);
+
+static inline struct output_stream *output_create_stream(struct output *output, const pa_sample_spec *ss, size_t tlength,
+                                                         const struct output_callbacks *callbacks, void *userdata,
+                                                         int volume, int mute) {
+  struct output_stream *stream = output->ops->create_stream(output, ss, tlength, callbacks, userdata, volume, mute);
+
+  if (stream != NULL)
+    atomic_fetch_add(&output->streams_created, 1);
+
+  return stream;
+}
+
+// No callbacks run once this returns. The stream is freed.
+static inline void output_stop_stream(struct output_stream *stream) {
+  struct output *output = stream->output;
+
+  output->ops->stop_stream(stream);
+  atomic_fetch_add(&output->streams_stopped, 1);
+}
+
+// Provides a buffer of up to *nbytes to fill and pass to output_write(),
+// saving a copy where the backend supports it.
+static inline int output_begin_write(struct output_stream *stream, void **data, size_t *nbytes) {
+  return stream->output->ops->begin_write(stream, data, nbytes);
+}
+
+static inline int output_write(struct output_stream *stream, const void *data, size_t nbytes) {
+  return stream->output->ops->write(stream, data, nbytes);
+}
+
+static inline bool output_get_timing(struct output_stream *stream, struct output_timing *timing) {
+  return stream->output->ops->get_timing(stream, timing);
+}
+
+static inline void output_update_timing(struct output_stream *stream) {
+  if (stream->output->ops->update_timing != NULL)
+    stream->output->ops->update_timing(stream);
+}
+
+static inline void output_set_volume(struct output_stream *stream, int volume) {
+  if (stream->output->ops->set_volume != NULL)
+    stream->output->ops->set_volume(stream, volume);
+}
+
+static inline void output_set_mute(struct output_stream *stream, int mute) {
+  if (stream->output->ops->set_mute != NULL)
+    stream->output->ops->set_mute(stream, mute);
+}
@@ -0,0 +1,589 @@
+#define _GNU_SOURCE
+#include <alsa/asoundlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "output.h"
+#include "log.h"
+
+// Plays directly to an ALSA device, usually hw:, without a sound server
+// in between. The player writes into the mmap'd DMA ring where the device
+// takes our sample format, otherwise samples are converted on the way.
+// A thread per stream waits for the device and runs the callbacks.
+// Volume and mute are set on the card's mixer, so samples stay untouched.
+
+#define ALSA_PERIODS 4
+#define ALSA_WAIT_TIMEOUT 100 // ms
+
+// Mixer controls tried for volume and mute, in order. Otherwise the first
+// control with a playback volume is used.
+static const char *const alsa_mixer_controls[] = { "Master", "PCM", "Digital", "Speaker", "Headphone" };
+
+struct alsa_output {
+  struct output base;
+  char *device;
+};
+
+struct alsa_stream {
+  struct output_stream base;
+  struct alsa_output *output;
+  const struct output_callbacks *callbacks;
+  void *userdata;
+
+  snd_pcm_t *pcm;
+  snd_pcm_format_t format;
+  bool convert;      // from float to format
+  size_t frame_size; // of the player's samples
+  snd_pcm_uframes_t buffer_size;
+  snd_pcm_uframes_t period_size;
+
+  pthread_t thread;
+  atomic_bool running;
+
+  // Only touched by the stream thread.
+  int64_t written;   // frames
+  struct output_timing timing;
+
+  // Pending mmap area handed out by begin_write
+  void *mmap_ptr;
+  snd_pcm_uframes_t mmap_offset;
+
+  void *buffer;
+  size_t buffer_size_bytes;
+
+  // Mixer of the card, NULL if it has no playback volume control.
+  snd_mixer_t *mixer;
+  snd_mixer_elem_t *mixer_elem;
+  int volume;
+  int mute;
+};
+
+static bool alsa_format(pa_sample_format_t format, snd_pcm_format_t *alsa) {
+  switch (format) {
+    case PA_SAMPLE_FLOAT32LE:
+      *alsa = SND_PCM_FORMAT_FLOAT_LE;
+      return true;
+    case PA_SAMPLE_S16LE:
+      *alsa = SND_PCM_FORMAT_S16_LE;
+      return true;
+    case PA_SAMPLE_S24LE:
+      *alsa = SND_PCM_FORMAT_S24_3LE;
+      return true;
+    case PA_SAMPLE_S32LE:
+      *alsa = SND_PCM_FORMAT_S32_LE;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Picks the sample format, preferring the player's own so it can write
+// into the ring directly. Float is converted to integers for devices
+// without float support, which includes most hw: devices.
+static bool alsa_set_format(struct alsa_stream *stream, snd_pcm_hw_params_t *hw) {
+  static const snd_pcm_format_t fallback[] = {SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S16_LE};
+  snd_pcm_format_t format;
+
+  if (alsa_format(stream->base.ss.format, &format) &&
+      snd_pcm_hw_params_test_format(stream->pcm, hw, format) == 0) {
+    stream->format = format;
+    return snd_pcm_hw_params_set_format(stream->pcm, hw, format) == 0;
+  }
+
+  if (stream->base.ss.format != PA_SAMPLE_FLOAT32LE)
+    return false;
+
+  for (size_t i = 0; i < sizeof(fallback) / sizeof(fallback[0]); i++)
+    if (snd_pcm_hw_params_test_format(stream->pcm, hw, fallback[i]) == 0) {
+      stream->format = fallback[i];
+      stream->convert = true;
+      return snd_pcm_hw_params_set_format(stream->pcm, hw, fallback[i]) == 0;
+    }
+
+  return false;
+}
+
+static bool alsa_configure(struct alsa_stream *stream, size_t tlength) {
+  const pa_sample_spec *ss = &stream->base.ss;
+  snd_pcm_hw_params_t *hw;
+  snd_pcm_sw_params_t *sw;
+  int err;
+
+  snd_pcm_hw_params_alloca(&hw);
+  snd_pcm_sw_params_alloca(&sw);
+
+  unsigned int buffer_time = pa_bytes_to_usec(tlength, ss);
+  unsigned int period_time = buffer_time / ALSA_PERIODS;
+
+  if ((err = snd_pcm_hw_params_any(stream->pcm, hw)) < 0 ||
+      (err = snd_pcm_hw_params_set_access(stream->pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0 ||
+      (err = snd_pcm_hw_params_set_rate_resample(stream->pcm, hw, 0)) < 0) {
+    log_printf("ALSA: no mmap access: %s", snd_strerror(err));
+    return false;
+  }
+
+  if (!alsa_set_format(stream, hw)) {
+    log_printf("ALSA: sample format %s not supported", pa_sample_format_to_string(ss->format));
+    return false;
+  }
+
+  if ((err = snd_pcm_hw_params_set_channels(stream->pcm, hw, ss->channels)) < 0 ||
+      (err = snd_pcm_hw_params_set_rate(stream->pcm, hw, ss->rate, 0)) < 0) {
+    log_printf("ALSA: %u channels at %u Hz not supported: %s", ss->channels, ss->rate, snd_strerror(err));
+    return false;
+  }
+
+  if ((err = snd_pcm_hw_params_set_buffer_time_near(stream->pcm, hw, &buffer_time, NULL)) < 0 ||
+      (err = snd_pcm_hw_params_set_period_time_near(stream->pcm, hw, &period_time, NULL)) < 0 ||
+      (err = snd_pcm_hw_params(stream->pcm, hw)) < 0) {
+    log_printf("ALSA: could not set buffer: %s", snd_strerror(err));
+    return false;
+  }
+
+  snd_pcm_hw_params_get_buffer_size(hw, &stream->buffer_size);
+  snd_pcm_hw_params_get_period_size(hw, &stream->period_size, NULL);
+
+  // Start once the buffer is full, like PulseAudio's prebuf. Timestamps
+  // are taken from CLOCK_REALTIME to compare with packet arrival.
+  if ((err = snd_pcm_sw_params_current(stream->pcm, sw)) < 0 ||
+      (err = snd_pcm_sw_params_set_start_threshold(stream->pcm, sw, stream->buffer_size)) < 0 ||
+      (err = snd_pcm_sw_params_set_avail_min(stream->pcm, sw, stream->period_size)) < 0 ||
+      (err = snd_pcm_sw_params_set_tstamp_mode(stream->pcm, sw, SND_PCM_TSTAMP_ENABLE)) < 0 ||
+      (err = snd_pcm_sw_params_set_tstamp_type(stream->pcm, sw, SND_PCM_TSTAMP_TYPE_GETTIMEOFDAY)) < 0 ||
+      (err = snd_pcm_sw_params(stream->pcm, sw)) < 0) {
+    log_printf("ALSA: could not set software parameters: %s", snd_strerror(err));
+    return false;
+  }
+
+  log_printf("ALSA: %s, buffer %lu frames, period %lu frames%s", snd_pcm_format_name(stream->format),
+             stream->buffer_size, stream->period_size, stream->convert ? ", converting" : ", mmap");
+
+  return true;
+}
+
+static void alsa_xrun(struct alsa_stream *stream, int err) {
+  if (err == -EPIPE)
+    stream->callbacks->underflow(&stream->base, stream->userdata);
+
+  stream->timing.playing = false;
+
+  if ((err = snd_pcm_recover(stream->pcm, err, 1)) < 0)
+    log_printf("ALSA: could not recover: %s", snd_strerror(err));
+}
+
+// Measures the playback position together with the time it was taken.
+static void alsa_update_timing(struct alsa_stream *stream) {
+  snd_pcm_uframes_t avail;
+  snd_htimestamp_t ts;
+
+  if (snd_pcm_htimestamp(stream->pcm, &avail, &ts) < 0)
+    return;
+
+  int64_t queued = avail < stream->buffer_size ? stream->buffer_size - avail : 0;
+
+  stream->timing = (struct output_timing){
+    .timestamp_usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+    .write_index = stream->written * stream->frame_size,
+    .read_index = (stream->written - queued) * stream->frame_size,
+    .playing = snd_pcm_state(stream->pcm) == SND_PCM_STATE_RUNNING,
+  };
+}
+
+static void *alsa_thread(void *arg) {
+  struct alsa_stream *stream = arg;
+  uint64_t period_usec = pa_bytes_to_usec(stream->period_size * stream->frame_size, &stream->base.ss);
+
+  while (atomic_load_explicit(&stream->running, memory_order_acquire)) {
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(stream->pcm);
+
+    if (avail < 0) {
+      alsa_xrun(stream, avail);
+      continue;
+    }
+
+    if ((snd_pcm_uframes_t)avail < stream->period_size) {
+      int err = snd_pcm_wait(stream->pcm, ALSA_WAIT_TIMEOUT);
+
+      if (err < 0)
+        alsa_xrun(stream, err);
+
+      continue;
+    }
+
+    int64_t written = stream->written;
+
+    stream->callbacks->write(&stream->base, avail * stream->frame_size, stream->userdata);
+
+    if (snd_pcm_state(stream->pcm) == SND_PCM_STATE_PREPARED &&
+        snd_pcm_avail_update(stream->pcm) == 0) {
+      int err = snd_pcm_start(stream->pcm);
+
+      if (err < 0)
+        log_printf("ALSA: could not start: %s", snd_strerror(err));
+    }
+
+    alsa_update_timing(stream);
+
+    if (stream->timing.playing)
+      stream->callbacks->latency(&stream->base, stream->userdata);
+
+    // Nothing to play, e.g. while halted. Don't spin on an empty ring.
+    if (stream->written == written) {
+      struct timespec interval = { .tv_nsec = period_usec * 1000 };
+      nanosleep(&interval, NULL);
+    }
+  }
+
+  return NULL;
+}
+
+static void alsa_set_volume(struct output_stream *base, int volume);
+
+static snd_mixer_elem_t *alsa_find_control(snd_mixer_t *mixer) {
+  snd_mixer_selem_id_t *id;
+  snd_mixer_selem_id_alloca(&id);
+
+  for (size_t i = 0; i < sizeof(alsa_mixer_controls) / sizeof(alsa_mixer_controls[0]); i++) {
+    snd_mixer_selem_id_set_name(id, alsa_mixer_controls[i]);
+    snd_mixer_selem_id_set_index(id, 0);
+
+    snd_mixer_elem_t *elem = snd_mixer_find_selem(mixer, id);
+
+    if (elem != NULL && snd_mixer_selem_has_playback_volume(elem))
+      return elem;
+  }
+
+  for (snd_mixer_elem_t *elem = snd_mixer_first_elem(mixer); elem != NULL; elem = snd_mixer_elem_next(elem))
+    if (snd_mixer_selem_is_active(elem) && snd_mixer_selem_has_playback_volume(elem))
+      return elem;
+
+  return NULL;
+}
+
+// Opens the mixer of the card the stream plays on. Without a volume
+// control volume and mute are ignored, which is logged once per stream.
+static void alsa_open_mixer(struct alsa_stream *stream) {
+  snd_pcm_info_t *info;
+  snd_pcm_info_alloca(&info);
+  char card[32];
+  int err;
+
+  if (snd_pcm_info(stream->pcm, info) < 0 || snd_pcm_info_get_card(info) < 0) {
+    log_printf("ALSA: %s is not a card, volume and mute are ignored", stream->output->device);
+    return;
+  }
+
+  snprintf(card, sizeof(card), "hw:%d", snd_pcm_info_get_card(info));
+
+  if ((err = snd_mixer_open(&stream->mixer, 0)) < 0 ||
+      (err = snd_mixer_attach(stream->mixer, card)) < 0 ||
+      (err = snd_mixer_selem_register(stream->mixer, NULL, NULL)) < 0 ||
+      (err = snd_mixer_load(stream->mixer)) < 0) {
+    log_printf("ALSA: could not open mixer of %s, volume and mute are ignored: %s", card, snd_strerror(err));
+
+    if (stream->mixer != NULL)
+      snd_mixer_close(stream->mixer);
+
+    stream->mixer = NULL;
+    return;
+  }
+
+  stream->mixer_elem = alsa_find_control(stream->mixer);
+
+  if (stream->mixer_elem == NULL) {
+    log_printf("ALSA: %s has no playback volume control, volume and mute are ignored", card);
+    snd_mixer_close(stream->mixer);
+    stream->mixer = NULL;
+    return;
+  }
+
+  log_printf("ALSA: volume on control '%s' of %s", snd_mixer_selem_get_name(stream->mixer_elem), card);
+}
+
+// Sets the control to volume, or to its minimum when muted and it has no
+// switch. Uses the same cubic curve as PulseAudio's software volume where
+// the control has a dB scale.
+static void alsa_apply_volume(struct alsa_stream *stream) {
+  snd_mixer_elem_t *elem = stream->mixer_elem;
+  long min, max;
+  int volume = stream->volume;
+
+  if (elem == NULL)
+    return;
+
+  if (snd_mixer_selem_has_playback_switch(elem))
+    snd_mixer_selem_set_playback_switch_all(elem, !stream->mute);
+  else if (stream->mute)
+    volume = 0;
+
+  if (snd_mixer_selem_get_playback_dB_range(elem, &min, &max) == 0 && min < max) {
+    // In 1/100 dB, 60 dB per decade for the cube of the volume.
+    long db = volume > 0 ? 6000.0 * log10(volume / 100.0) : min;
+
+    snd_mixer_selem_set_playback_dB_all(elem, db < min ? min : db, -1);
+  } else if (snd_mixer_selem_get_playback_volume_range(elem, &min, &max) == 0) {
+    snd_mixer_selem_set_playback_volume_all(elem, min + (max - min) * volume / 100);
+  }
+}
+
+static struct output_stream *alsa_create_stream(struct output *base, const pa_sample_spec *ss, size_t tlength,
+                                                const struct output_callbacks *callbacks, void *userdata,
+                                                int volume, int mute) {
+  struct alsa_output *output = (struct alsa_output *)base;
+  struct alsa_stream *stream = calloc(1, sizeof(struct alsa_stream));
+  int err;
+
+  if (stream == NULL)
+    return NULL;
+
+  stream->base = (struct output_stream){ .output = base, .ss = *ss };
+  stream->output = output;
+  stream->callbacks = callbacks;
+  stream->userdata = userdata;
+  stream->frame_size = pa_frame_size(ss);
+
+  if ((err = snd_pcm_open(&stream->pcm, output->device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK)) < 0) {
+    log_printf("ALSA: could not open %s: %s", output->device, snd_strerror(err));
+    free(stream);
+    return NULL;
+  }
+
+  if (!alsa_configure(stream, tlength)) {
+    snd_pcm_close(stream->pcm);
+    free(stream);
+    return NULL;
+  }
+
+  char format[PA_SAMPLE_SPEC_SNPRINT_MAX];
+  pa_sample_spec_snprint(format, sizeof(format), ss);
+  log_printf("Stream created (%s)", format);
+
+  stream->mute = mute;
+  alsa_open_mixer(stream);
+  alsa_set_volume(&stream->base, volume);
+
+  atomic_store(&stream->running, true);
+
+  if (pthread_create(&stream->thread, NULL, alsa_thread, stream) != 0) {
+    log_printf("ALSA: could not start thread");
+
+    if (stream->mixer != NULL)
+      snd_mixer_close(stream->mixer);
+
+    snd_pcm_close(stream->pcm);
+    free(stream);
+    return NULL;
+  }
+
+  pthread_setname_np(stream->thread, "alsa");
+
+  return &stream->base;
+}
+
+static void alsa_stop_stream(struct output_stream *base) {
+  struct alsa_stream *stream = (struct alsa_stream *)base;
+
+  log_printf("Disconnecting stream.");
+
+  atomic_store_explicit(&stream->running, false, memory_order_release);
+  pthread_join(stream->thread, NULL);
+
+  snd_pcm_drop(stream->pcm);
+  snd_pcm_close(stream->pcm);
+
+  if (stream->mixer != NULL)
+    snd_mixer_close(stream->mixer);
+
+  free(stream->buffer);
+  free(stream);
+
+  log_printf("Stream disconnected.");
+}
+
+static void convert_samples(void *dst, snd_pcm_format_t format, const float *src, size_t samples) {
+  for (size_t i = 0; i < samples; i++) {
+    float v = src[i];
+
+    if (v > 1.0f)
+      v = 1.0f;
+
+    if (v < -1.0f)
+      v = -1.0f;
+
+    if (format == SND_PCM_FORMAT_S32_LE)
+      ((int32_t *)dst)[i] = htole32((int32_t)(v * 2147483392.0f));
+    else
+      ((int16_t *)dst)[i] = htole16((int16_t)(v * 32767.0f));
+  }
+}
+
+static void *mmap_address(const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset) {
+  return (uint8_t *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+}
+
+// Copies (or converts) frames into the ring.
+static int alsa_copy(struct alsa_stream *stream, const uint8_t *data, snd_pcm_uframes_t frames) {
+  size_t device_frame_size = snd_pcm_frames_to_bytes(stream->pcm, 1);
+
+  while (frames > 0) {
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, n = frames;
+    int err;
+
+    if ((err = snd_pcm_mmap_begin(stream->pcm, &areas, &offset, &n)) < 0)
+      return err;
+
+    if (n == 0)
+      return -EAGAIN;
+
+    void *dst = mmap_address(areas, offset);
+
+    if (stream->convert)
+      convert_samples(dst, stream->format, (const float *)data, n * stream->base.ss.channels);
+    else
+      memcpy(dst, data, n * device_frame_size);
+
+    snd_pcm_sframes_t committed = snd_pcm_mmap_commit(stream->pcm, offset, n);
+
+    if (committed < 0)
+      return committed;
+
+    stream->written += committed;
+    data += committed * stream->frame_size;
+    frames -= committed;
+  }
+
+  return 0;
+}
+
+static int alsa_begin_write(struct output_stream *base, void **data, size_t *nbytes) {
+  struct alsa_stream *stream = (struct alsa_stream *)base;
+
+  if (!stream->convert) {
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames = *nbytes / stream->frame_size;
+    int err;
+
+    if ((err = snd_pcm_mmap_begin(stream->pcm, &areas, &offset, &frames)) < 0)
+      return err;
+
+    stream->mmap_ptr = mmap_address(areas, offset);
+    stream->mmap_offset = offset;
+
+    *data = stream->mmap_ptr;
+    *nbytes = frames * stream->frame_size;
+
+    return 0;
+  }
+
+  if (*nbytes > stream->buffer_size_bytes) {
+    void *buffer = realloc(stream->buffer, *nbytes);
+
+    if (buffer == NULL)
+      return -ENOMEM;
+
+    stream->buffer = buffer;
+    stream->buffer_size_bytes = *nbytes;
+  }
+
+  *data = stream->buffer;
+
+  return 0;
+}
+
+static int alsa_write(struct output_stream *base, const void *data, size_t nbytes) {
+  struct alsa_stream *stream = (struct alsa_stream *)base;
+  snd_pcm_uframes_t frames = nbytes / stream->frame_size;
+  int err;
+
+  if (data == stream->mmap_ptr && data != NULL) {
+    // Written in place
+    stream->mmap_ptr = NULL;
+
+    snd_pcm_sframes_t committed = snd_pcm_mmap_commit(stream->pcm, stream->mmap_offset, frames);
+
+    if (committed < 0) {
+      alsa_xrun(stream, committed);
+      return committed;
+    }
+
+    stream->written += committed;
+
+    return 0;
+  }
+
+  if ((err = alsa_copy(stream, data, frames)) < 0 && err != -EAGAIN)
+    alsa_xrun(stream, err);
+
+  return err;
+}
+
+static bool alsa_get_timing(struct output_stream *base, struct output_timing *timing) {
+  struct alsa_stream *stream = (struct alsa_stream *)base;
+
+  if (stream->timing.timestamp_usec == 0) {
+    // Not started yet
+    *timing = (struct output_timing){
+      .write_index = stream->written * stream->frame_size,
+      .read_index = 0,
+    };
+
+    return true;
+  }
+
+  *timing = stream->timing;
+  timing->write_index = stream->written * stream->frame_size;
+
+  return true;
+}
+
+static void alsa_set_volume(struct output_stream *base, int volume) {
+  struct alsa_stream *stream = (struct alsa_stream *)base;
+
+  if (volume > 100)
+    volume = 100;
+
+  if (volume < 0)
+    volume = 0;
+
+  stream->volume = volume;
+  alsa_apply_volume(stream);
+}
+
+static void alsa_set_mute(struct output_stream *base, int mute) {
+  struct alsa_stream *stream = (struct alsa_stream *)base;
+
+  stream->mute = mute;
+  alsa_apply_volume(stream);
+}
+
+static const struct output_ops alsa_ops = {
+  .name = "alsa",
+  .create_stream = alsa_create_stream,
+  .stop_stream = alsa_stop_stream,
+  .begin_write = alsa_begin_write,
+  .write = alsa_write,
+  .get_timing = alsa_get_timing,
+  .set_volume = alsa_set_volume,
+  .set_mute = alsa_set_mute,
+};
+
+struct output *output_alsa_new(const char *device) {
+  struct alsa_output *output = calloc(1, sizeof(struct alsa_output));
+
+  if (output == NULL)
+    return NULL;
+
+  output->base.ops = &alsa_ops;
+  output->device = strdup(device);
+
+  log_printf("ALSA output on %s", output->device);
+
+  return &output->base;
+}
@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <endian.h>
+
+#include "output.h"
+#include "log.h"
+
+// Writes the audio to a file, or nowhere, instead of a sound card. The
+// sink plays at exactly the nominal rate of a clock that is either
+// advanced by the caller, which makes runs reproducible, or by a thread
+// following the real time. Like PulseAudio, a stream starts playing once
+// tlength bytes are buffered and stops on underrun until refilled.
+
+#define FILE_CLOCK_INTERVAL 5e3 // usec
+
+#define WAV_HEADER_SIZE 44
+#define WAV_UPDATE_INTERVAL 1e6 // usec of audio between header updates
+
+struct file_output {
+  struct output base;
+  pthread_mutex_t mutex; // held while the clock advances
+  FILE *file;
+  bool wav;
+  bool wav_header;     // written, for wav_ss
+  pa_sample_spec wav_ss;
+  uint64_t wav_data;   // bytes
+  uint64_t wav_synced; // bytes in the header
+  struct file_stream *stream;
+  uint64_t now_usec;
+  double played_usec; // all streams
+};
+
+struct file_stream {
+  struct output_stream base;
+  struct file_output *output;
+  const struct output_callbacks *callbacks;
+  void *userdata;
+  size_t tlength;
+  size_t frame_size;
+
+  int64_t write_index;
+  int64_t read_index;
+  bool playing;
+  uint64_t play_start_usec;
+  int64_t play_start_index;
+
+  bool discard; // not written to the file
+
+  void *buffer;
+  size_t buffer_size;
+};
+
+static void put_le16(uint8_t *p, uint16_t v) {
+  v = htole16(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  v = htole32(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static bool wav_format(const pa_sample_spec *ss, uint16_t *tag, uint16_t *bits) {
+  switch (ss->format) {
+    case PA_SAMPLE_FLOAT32LE:
+      *tag = 3; // IEEE float
+      *bits = 32;
+      return true;
+    case PA_SAMPLE_S16LE:
+      *tag = 1; // PCM
+      *bits = 16;
+      return true;
+    case PA_SAMPLE_S24LE:
+      *tag = 1;
+      *bits = 24;
+      return true;
+    case PA_SAMPLE_S32LE:
+      *tag = 1;
+      *bits = 32;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Writes the RIFF header for the data written so far at the start of the file.
+static void wav_sync(struct file_output *output) {
+  uint8_t header[WAV_HEADER_SIZE];
+  uint16_t tag, bits;
+  const pa_sample_spec *ss = &output->wav_ss;
+
+  assert(wav_format(ss, &tag, &bits));
+
+  uint32_t data = output->wav_data > UINT32_MAX - WAV_HEADER_SIZE ? UINT32_MAX - WAV_HEADER_SIZE : output->wav_data;
+
+  memcpy(header, "RIFF", 4);
+  put_le32(header + 4, WAV_HEADER_SIZE - 8 + data);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put_le32(header + 16, 16);
+  put_le16(header + 20, tag);
+  put_le16(header + 22, ss->channels);
+  put_le32(header + 24, ss->rate);
+  put_le32(header + 28, pa_frame_size(ss) * ss->rate);
+  put_le16(header + 32, pa_frame_size(ss));
+  put_le16(header + 34, bits);
+  memcpy(header + 36, "data", 4);
+  put_le32(header + 40, data);
+
+  long pos = ftell(output->file);
+
+  if (fseek(output->file, 0, SEEK_SET) != 0 ||
+      fwrite(header, sizeof(header), 1, output->file) != 1 ||
+      fseek(output->file, pos > WAV_HEADER_SIZE ? pos : WAV_HEADER_SIZE, SEEK_SET) != 0)
+    log_printf("Could not write WAV header: %s", strerror(errno));
+
+  fflush(output->file);
+  output->wav_synced = output->wav_data;
+}
+
+// A WAV file holds a single format. Returns whether ss can be written.
+static bool wav_accepts(struct file_output *output, const pa_sample_spec *ss) {
+  uint16_t tag, bits;
+
+  if (!output->wav_header) {
+    if (!wav_format(ss, &tag, &bits)) {
+      log_printf("Sample format %s can not be written to WAV", pa_sample_format_to_string(ss->format));
+      return false;
+    }
+
+    output->wav_ss = *ss;
+    output->wav_header = true;
+    wav_sync(output);
+
+    return true;
+  }
+
+  return pa_sample_spec_equal(ss, &output->wav_ss);
+}
+
+static struct output_stream *file_create_stream(struct output *base, const pa_sample_spec *ss, size_t tlength,
+                                                const struct output_callbacks *callbacks, void *userdata,
+                                                int volume, int mute) {
+  struct file_output *output = (struct file_output *)base;
+  struct file_stream *stream = calloc(1, sizeof(struct file_stream));
+
+  if (stream == NULL)
+    return NULL;
+
+  stream->base = (struct output_stream){ .output = base, .ss = *ss };
+  stream->output = output;
+  stream->callbacks = callbacks;
+  stream->userdata = userdata;
+  stream->frame_size = pa_frame_size(ss);
+  stream->tlength = tlength / stream->frame_size * stream->frame_size;
+
+  pthread_mutex_lock(&output->mutex);
+
+  assert(output->stream == NULL);
+
+  char format[PA_SAMPLE_SPEC_SNPRINT_MAX];
+  pa_sample_spec_snprint(format, sizeof(format), ss);
+  log_printf("Stream created (%s)", format);
+
+  stream->discard = output->wav && !wav_accepts(output, ss);
+
+  if (stream->discard)
+    log_printf("Format differs from the WAV file, discarding this stream.");
+
+  output->stream = stream;
+
+  pthread_mutex_unlock(&output->mutex);
+
+  return &stream->base;
+}
+
+static void file_stop_stream(struct output_stream *base) {
+  struct file_stream *stream = (struct file_stream *)base;
+  struct file_output *output = stream->output;
+
+  pthread_mutex_lock(&output->mutex);
+
+  output->stream = NULL;
+
+  if (output->wav_header && output->wav_synced != output->wav_data)
+    wav_sync(output);
+
+  pthread_mutex_unlock(&output->mutex);
+
+  free(stream->buffer);
+  free(stream);
+
+  log_printf("Stream disconnected.");
+}
+
+static int file_begin_write(struct output_stream *base, void **data, size_t *nbytes) {
+  struct file_stream *stream = (struct file_stream *)base;
+
+  if (*nbytes > stream->buffer_size) {
+    void *buffer = realloc(stream->buffer, *nbytes);
+
+    if (buffer == NULL)
+      return -1;
+
+    stream->buffer = buffer;
+    stream->buffer_size = *nbytes;
+  }
+
+  *data = stream->buffer;
+
+  return 0;
+}
+
+static int file_write(struct output_stream *base, const void *data, size_t nbytes) {
+  struct file_stream *stream = (struct file_stream *)base;
+  struct file_output *output = stream->output;
+
+  stream->write_index += nbytes;
+
+  if (output->file == NULL || stream->discard)
+    return 0;
+
+  if (fwrite(data, 1, nbytes, output->file) != nbytes)
+    log_printf("Could not write output: %s", strerror(errno));
+
+  if (output->wav) {
+    output->wav_data += nbytes;
+
+    if (output->wav_data - output->wav_synced >= pa_usec_to_bytes(WAV_UPDATE_INTERVAL, &base->ss))
+      wav_sync(output);
+  }
+
+  return 0;
+}
+
+static bool file_get_timing(struct output_stream *base, struct output_timing *timing) {
+  struct file_stream *stream = (struct file_stream *)base;
+
+  *timing = (struct output_timing){
+    .timestamp_usec = stream->output->now_usec,
+    .write_index = stream->write_index,
+    .read_index = stream->read_index,
+    .playing = stream->playing,
+  };
+
+  return true;
+}
+
+static const struct output_ops file_ops = {
+  .name = "file",
+  .create_stream = file_create_stream,
+  .stop_stream = file_stop_stream,
+  .begin_write = file_begin_write,
+  .write = file_write,
+  .get_timing = file_get_timing,
+};
+
+static struct file_output *file_output_new(void) {
+  struct file_output *output = calloc(1, sizeof(struct file_output));
+
+  if (output == NULL)
+    return NULL;
+
+  output->base.ops = &file_ops;
+  pthread_mutex_init(&output->mutex, NULL);
+
+  return output;
+}
+
+// Writes interleaved samples to path, as WAV if it ends in .wav and raw
+// otherwise. A WAV file takes the format of the first stream.
+struct output *output_file_new(const char *path) {
+  struct file_output *output = file_output_new();
+
+  if (output == NULL)
+    return NULL;
+
+  size_t len = strlen(path);
+  output->wav = len >= 4 && strcasecmp(path + len - 4, ".wav") == 0;
+  output->file = fopen(path, "wb");
+
+  if (output->file == NULL) {
+    log_printf("Could not open %s: %s", path, strerror(errno));
+    free(output);
+    return NULL;
+  }
+
+  return &output->base;
+}
+
+// Discards the samples.
+struct output *output_null_new(void) {
+  struct file_output *output = file_output_new();
+
+  if (output == NULL)
+    return NULL;
+
+  return &output->base;
+}
+
+static void *file_clock_thread(void *arg) {
+  struct output *output = arg;
+
+  while (true) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    output_file_advance(output, (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+
+    struct timespec interval = { .tv_nsec = FILE_CLOCK_INTERVAL * 1000 };
+    nanosleep(&interval, NULL);
+  }
+
+  return NULL;
+}
+
+// Lets a thread advance the clock in real time, for use in the receiver.
+bool output_file_start_clock(struct output *output) {
+  pthread_t thread;
+
+  if (pthread_create(&thread, NULL, file_clock_thread, output) != 0)
+    return false;
+
+  pthread_setname_np(thread, "output");
+  pthread_detach(thread);
+
+  return true;
+}
+
+// Called with the mutex held, so the stream can not be stopped meanwhile.
+static void file_play(struct file_output *output, struct file_stream *stream, uint64_t now_usec) {
+  size_t bytes_per_sec = stream->frame_size * stream->base.ss.rate;
+
+  if (stream->playing) {
+    int64_t due = stream->play_start_index +
+                  (int64_t)((now_usec - stream->play_start_usec) * 1e-6 * bytes_per_sec) / stream->frame_size * stream->frame_size;
+    int64_t played = stream->read_index;
+
+    stream->read_index = due < stream->write_index ? due : stream->write_index;
+    output->played_usec += (stream->read_index - played) * 1e6 / bytes_per_sec;
+
+    if (due > stream->write_index) {
+      stream->playing = false;
+      stream->callbacks->underflow(&stream->base, stream->userdata);
+    } else {
+      stream->callbacks->latency(&stream->base, stream->userdata);
+    }
+  }
+
+  while (true) {
+    size_t queued = stream->write_index - stream->read_index;
+
+    if (queued >= stream->tlength)
+      break;
+
+    int64_t written = stream->write_index;
+
+    stream->callbacks->write(&stream->base, stream->tlength - queued, stream->userdata);
+
+    if (stream->write_index == written)
+      break;
+  }
+
+  if (!stream->playing &&
+      stream->write_index - stream->read_index >= (int64_t)stream->tlength) {
+    stream->playing = true;
+    stream->play_start_usec = now_usec;
+    stream->play_start_index = stream->read_index;
+  }
+}
+
+// Plays the current stream up to now_usec and lets the player refill it.
+void output_file_advance(struct output *base, uint64_t now_usec) {
+  struct file_output *output = (struct file_output *)base;
+
+  pthread_mutex_lock(&output->mutex);
+
+  struct file_stream *stream = output->stream;
+
+  output->now_usec = now_usec;
+
+  if (stream != NULL)
+    file_play(output, stream, now_usec);
+
+  pthread_mutex_unlock(&output->mutex);
+}
+
+// Audio played so far, in all streams.
+double output_file_played_usec(struct output *base) {
+  struct file_output *output = (struct file_output *)base;
+
+  pthread_mutex_lock(&output->mutex);
+  double played_usec = output->played_usec;
+  pthread_mutex_unlock(&output->mutex);
+
+  return played_usec;
+}
@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+#include <spa/param/props.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <assert.h>
+
+#include "output.h"
+#include "log.h"
+
+// Plays through a native PipeWire stream instead of the pulse
+// compatibility layer. The graph pulls one quantum per cycle: the process
+// callback hands the dequeued buffer to the player, which writes into it
+// directly. The quantum is requested from the stream's buffer length so
+// the graph does not run with a much longer one than we need.
+
+#define PW_QUANTUM_DIVISOR 4  // quanta per tlength
+#define PW_QUANTUM_MIN 64     // frames
+#define PW_QUANTUM_MAX 8192
+
+struct pipewire {
+  struct output base;
+  struct pw_thread_loop *loop;
+};
+
+struct pw_output_stream {
+  struct output_stream base;
+  struct pipewire *pipewire;
+  const struct output_callbacks *callbacks;
+  void *userdata;
+  struct pw_stream *stream;
+  struct spa_hook listener;
+  enum pw_stream_state state;
+  size_t frame_size;
+  uint32_t quantum;
+
+  // Only touched by the process callback.
+  uint8_t *dst;       // buffer being filled
+  size_t dst_size;
+  size_t dst_filled;
+  int64_t written;    // bytes
+  bool underrun;
+  struct output_timing timing;
+};
+
+static void on_state_changed(void *data, enum pw_stream_state old, enum pw_stream_state state, const char *error) {
+  struct pw_output_stream *stream = data;
+
+  stream->state = state;
+
+  if (state == PW_STREAM_STATE_ERROR)
+    log_printf("PipeWire stream error: %s", error != NULL ? error : "unknown");
+
+  pw_thread_loop_signal(stream->pipewire->loop, false);
+}
+
+// Converts the graph's monotonic time into CLOCK_REALTIME to compare
+// with packet arrival.
+static uint64_t realtime_usec(int64_t monotonic_nsec) {
+  struct timespec mono, real;
+
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &real);
+
+  int64_t offset = (real.tv_sec - mono.tv_sec) * 1000000000LL + (real.tv_nsec - mono.tv_nsec);
+
+  return (monotonic_nsec + offset) / 1000;
+}
+
+static void update_timing(struct pw_output_stream *stream) {
+  struct pw_time time;
+
+  if (pw_stream_get_time_n(stream->stream, &time, sizeof(time)) < 0 || time.now == 0 || time.rate.denom == 0)
+    return;
+
+  uint64_t delay_usec = time.delay > 0 ? time.delay * 1000000 * time.rate.num / time.rate.denom : 0;
+  int64_t queued = time.queued + time.buffered * stream->frame_size;
+
+  stream->timing = (struct output_timing){
+    .timestamp_usec = realtime_usec(time.now),
+    .write_index = stream->written,
+    .read_index = stream->written - queued,
+    .sink_usec = delay_usec,
+    .playing = stream->state == PW_STREAM_STATE_STREAMING,
+  };
+}
+
+static void on_process(void *data) {
+  struct pw_output_stream *stream = data;
+  struct pw_buffer *b = pw_stream_dequeue_buffer(stream->stream);
+
+  if (b == NULL)
+    return;
+
+  struct spa_data *d = &b->buffer->datas[0];
+
+  if (d->data == NULL) {
+    pw_stream_queue_buffer(stream->stream, b);
+    return;
+  }
+
+  size_t frames = d->maxsize / stream->frame_size;
+
+  if (b->requested > 0 && b->requested < frames)
+    frames = b->requested;
+
+  update_timing(stream);
+
+  stream->dst = d->data;
+  stream->dst_size = frames * stream->frame_size;
+  stream->dst_filled = 0;
+
+  stream->callbacks->write(&stream->base, stream->dst_size, stream->userdata);
+
+  // The graph plays silence for whatever is missing.
+  bool short_write = stream->dst_filled < stream->dst_size;
+
+  if (short_write && stream->timing.playing && !stream->underrun)
+    stream->callbacks->underflow(&stream->base, stream->userdata);
+
+  stream->underrun = short_write;
+
+  d->chunk->offset = 0;
+  d->chunk->stride = stream->frame_size;
+  d->chunk->size = stream->dst_filled;
+
+  stream->dst = NULL;
+
+  pw_stream_queue_buffer(stream->stream, b);
+
+  if (stream->timing.playing)
+    stream->callbacks->latency(&stream->base, stream->userdata);
+}
+
+static const struct pw_stream_events stream_events = {
+  PW_VERSION_STREAM_EVENTS,
+  .state_changed = on_state_changed,
+  .process = on_process,
+};
+
+static bool spa_format(pa_sample_format_t format, enum spa_audio_format *spa) {
+  switch (format) {
+    case PA_SAMPLE_FLOAT32LE:
+      *spa = SPA_AUDIO_FORMAT_F32_LE;
+      return true;
+    case PA_SAMPLE_S16LE:
+      *spa = SPA_AUDIO_FORMAT_S16_LE;
+      return true;
+    case PA_SAMPLE_S24LE:
+      *spa = SPA_AUDIO_FORMAT_S24_LE;
+      return true;
+    case PA_SAMPLE_S32LE:
+      *spa = SPA_AUDIO_FORMAT_S32_LE;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Largest power of two up to a quarter of tlength.
+static uint32_t quantum_for(size_t tlength, size_t frame_size) {
+  size_t frames = tlength / frame_size / PW_QUANTUM_DIVISOR;
+  uint32_t quantum = PW_QUANTUM_MIN;
+
+  while (quantum * 2 <= frames && quantum * 2 <= PW_QUANTUM_MAX)
+    quantum *= 2;
+
+  return quantum;
+}
+
+static void pipewire_set_volume(struct output_stream *base, int volume);
+static void pipewire_set_mute(struct output_stream *base, int mute);
+
+static struct output_stream *pipewire_create_stream(struct output *output, const pa_sample_spec *ss, size_t tlength,
+                                                    const struct output_callbacks *callbacks, void *userdata,
+                                                    int volume, int mute) {
+  struct pipewire *pipewire = (struct pipewire *)output;
+  enum spa_audio_format format;
+
+  if (!spa_format(ss->format, &format)) {
+    log_printf("PipeWire: sample format %s not supported", pa_sample_format_to_string(ss->format));
+    return NULL;
+  }
+
+  struct pw_output_stream *stream = calloc(1, sizeof(struct pw_output_stream));
+
+  if (stream == NULL)
+    return NULL;
+
+  stream->base = (struct output_stream){ .output = output, .ss = *ss };
+  stream->pipewire = pipewire;
+  stream->callbacks = callbacks;
+  stream->userdata = userdata;
+  stream->frame_size = pa_frame_size(ss);
+  stream->quantum = quantum_for(tlength, stream->frame_size);
+
+  struct pw_properties *props = pw_properties_new(PW_KEY_MEDIA_TYPE, "Audio",
+                                                  PW_KEY_MEDIA_CATEGORY, "Playback",
+                                                  PW_KEY_MEDIA_ROLE, "Music",
+                                                  NULL);
+  pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%u/%u", stream->quantum, ss->rate);
+
+  struct spa_audio_info_raw info = SPA_AUDIO_INFO_RAW_INIT(.format = format, .channels = ss->channels, .rate = ss->rate);
+
+  if (ss->channels == 1) {
+    info.position[0] = SPA_AUDIO_CHANNEL_MONO;
+  } else if (ss->channels == 2) {
+    info.position[0] = SPA_AUDIO_CHANNEL_FL;
+    info.position[1] = SPA_AUDIO_CHANNEL_FR;
+  } else {
+    info.flags |= SPA_AUDIO_FLAG_UNPOSITIONED;
+  }
+
+  uint8_t buffer[1024];
+  struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+  const struct spa_pod *params[1];
+  params[0] = spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &info);
+
+  char spec[PA_SAMPLE_SPEC_SNPRINT_MAX];
+  pa_sample_spec_snprint(spec, sizeof(spec), ss);
+
+  pw_thread_loop_lock(pipewire->loop);
+
+  stream->stream = pw_stream_new_simple(pw_thread_loop_get_loop(pipewire->loop), "Songcast Receiver",
+                                        props, &stream_events, stream);
+
+  if (stream->stream == NULL) {
+    pw_thread_loop_unlock(pipewire->loop);
+    log_printf("PipeWire: could not create stream");
+    free(stream);
+    return NULL;
+  }
+
+  log_printf("Stream created (%s, quantum %u)", spec, stream->quantum);
+
+  int err = pw_stream_connect(stream->stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+                              PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_RT_PROCESS,
+                              params, 1);
+
+  while (err == 0 && stream->state != PW_STREAM_STATE_PAUSED &&
+         stream->state != PW_STREAM_STATE_STREAMING && stream->state != PW_STREAM_STATE_ERROR)
+    pw_thread_loop_wait(pipewire->loop);
+
+  if (err < 0 || stream->state == PW_STREAM_STATE_ERROR) {
+    pw_stream_destroy(stream->stream);
+    pw_thread_loop_unlock(pipewire->loop);
+    log_printf("PipeWire: could not connect stream");
+    free(stream);
+    return NULL;
+  }
+
+  pw_thread_loop_unlock(pipewire->loop);
+
+  pipewire_set_volume(&stream->base, volume);
+  pipewire_set_mute(&stream->base, mute);
+
+  return &stream->base;
+}
+
+static void pipewire_stop_stream(struct output_stream *base) {
+  struct pw_output_stream *stream = (struct pw_output_stream *)base;
+  struct pipewire *pipewire = stream->pipewire;
+
+  log_printf("Disconnecting stream.");
+
+  pw_thread_loop_lock(pipewire->loop);
+  pw_stream_disconnect(stream->stream);
+  pw_stream_destroy(stream->stream);
+  pw_thread_loop_unlock(pipewire->loop);
+
+  free(stream);
+
+  log_printf("Stream disconnected.");
+}
+
+static int pipewire_begin_write(struct output_stream *base, void **data, size_t *nbytes) {
+  struct pw_output_stream *stream = (struct pw_output_stream *)base;
+  size_t free_bytes = stream->dst_size - stream->dst_filled;
+
+  assert(stream->dst != NULL);
+
+  *data = stream->dst + stream->dst_filled;
+
+  if (*nbytes > free_bytes)
+    *nbytes = free_bytes;
+
+  return 0;
+}
+
+static int pipewire_write(struct output_stream *base, const void *data, size_t nbytes) {
+  struct pw_output_stream *stream = (struct pw_output_stream *)base;
+  uint8_t *dst = stream->dst + stream->dst_filled;
+
+  assert(stream->dst != NULL);
+
+  if (nbytes > stream->dst_size - stream->dst_filled) {
+    log_warn("PipeWire: dropping %zu bytes beyond the request", nbytes - (stream->dst_size - stream->dst_filled));
+    nbytes = stream->dst_size - stream->dst_filled;
+  }
+
+  // Written in place unless it came from elsewhere.
+  if (data != dst)
+    memcpy(dst, data, nbytes);
+
+  stream->dst_filled += nbytes;
+  stream->written += nbytes;
+
+  return 0;
+}
+
+static bool pipewire_get_timing(struct output_stream *base, struct output_timing *timing) {
+  struct pw_output_stream *stream = (struct pw_output_stream *)base;
+
+  if (stream->timing.timestamp_usec == 0)
+    return false;
+
+  *timing = stream->timing;
+  timing->write_index = stream->written;
+
+  return true;
+}
+
+static void pipewire_set_volume(struct output_stream *base, int volume) {
+  struct pw_output_stream *stream = (struct pw_output_stream *)base;
+  float volumes[SPA_AUDIO_MAX_CHANNELS];
+
+  if (volume > 100)
+    volume = 100;
+
+  if (volume < 0)
+    volume = 0;
+
+  // Same curve as PulseAudio's software volume.
+  float v = powf(volume / 100.0f, 3);
+
+  for (int i = 0; i < base->ss.channels; i++)
+    volumes[i] = v;
+
+  pw_thread_loop_lock(stream->pipewire->loop);
+  pw_stream_set_control(stream->stream, SPA_PROP_channelVolumes, base->ss.channels, volumes, 0);
+  pw_thread_loop_unlock(stream->pipewire->loop);
+}
+
+static void pipewire_set_mute(struct output_stream *base, int mute) {
+  struct pw_output_stream *stream = (struct pw_output_stream *)base;
+  float value = mute ? 1.0f : 0.0f;
+
+  pw_thread_loop_lock(stream->pipewire->loop);
+  pw_stream_set_control(stream->stream, SPA_PROP_mute, 1, &value, 0);
+  pw_thread_loop_unlock(stream->pipewire->loop);
+}
+
+static const struct output_ops pipewire_ops = {
+  .name = "pipewire",
+  .concurrent_streams = true,
+  .create_stream = pipewire_create_stream,
+  .stop_stream = pipewire_stop_stream,
+  .begin_write = pipewire_begin_write,
+  .write = pipewire_write,
+  .get_timing = pipewire_get_timing,
+  .set_volume = pipewire_set_volume,
+  .set_mute = pipewire_set_mute,
+};
+
+struct output *output_pipewire_new(void) {
+  struct pipewire *pipewire = calloc(1, sizeof(struct pipewire));
+
+  if (pipewire == NULL)
+    return NULL;
+
+  pw_init(NULL, NULL);
+
+  pipewire->base.ops = &pipewire_ops;
+  pipewire->loop = pw_thread_loop_new("pipewire", NULL);
+  assert(pipewire->loop);
+
+  assert(pw_thread_loop_start(pipewire->loop) == 0);
+
+  log_printf("PipeWire ready.");
+
+  return &pipewire->base;
+}
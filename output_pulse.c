@@ -1,6 +1,8 @@
 #include <pulse/pulseaudio.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
 
 #include "output.h"
 #include "log.h"
@@ -29,7 +31,22 @@
         }                                                               \
     } while(false);
 
-void volume_to_cvolume(struct pulse *pulse, pa_cvolume *cvolume, int volume);
+struct pulse {
+  struct output base;
+  pa_threaded_mainloop *mainloop;
+  pa_context *context;
+  int operation_success;
+};
+
+struct pulse_stream {
+  struct output_stream base;
+  struct pulse *pulse;
+  pa_stream *stream;
+  const struct output_callbacks *callbacks;
+  void *userdata;
+};
+
+static void volume_to_cvolume(const pa_sample_spec *ss, pa_cvolume *cvolume, int volume);
 
 void context_state_cb(pa_context *context, void *mainloop) {
   pa_threaded_mainloop_signal(mainloop, 0);
@@ -71,17 +88,63 @@ void stream_state_cb(pa_stream *s, void *mainloop) {
   pa_threaded_mainloop_signal(mainloop, 0);
 }
 
-void create_stream(struct pulse *pulse, pa_sample_spec *ss, const pa_buffer_attr *bufattr, void *userdata, struct output_cb *callbacks, int volume, int mute) {
+static void stream_write_cb(pa_stream *s, size_t request, void *userdata) {
+  struct pulse_stream *stream = userdata;
+
+  assert(s == stream->stream);
+
+  stream->callbacks->write(&stream->base, request, stream->userdata);
+}
+
+static void stream_underflow_cb(pa_stream *s, void *userdata) {
+  struct pulse_stream *stream = userdata;
+
+  assert(s == stream->stream);
+
+  stream->callbacks->underflow(&stream->base, stream->userdata);
+}
+
+static void stream_latency_cb(pa_stream *s, void *userdata) {
+  struct pulse_stream *stream = userdata;
+
+  assert(s == stream->stream);
+
+  stream->callbacks->latency(&stream->base, stream->userdata);
+}
+
+static void pulse_set_mute(struct output_stream *base, int mute);
+
+static struct output_stream *pulse_create_stream(struct output *output, const pa_sample_spec *ss, size_t tlength,
+                                                 const struct output_callbacks *callbacks, void *userdata,
+                                                 int volume, int mute) {
+  struct pulse *pulse = (struct pulse *)output;
+  struct pulse_stream *stream = calloc(1, sizeof(struct pulse_stream));
+
+  if (stream == NULL)
+    return NULL;
+
+  stream->base = (struct output_stream){ .output = output, .ss = *ss };
+  stream->pulse = pulse;
+  stream->callbacks = callbacks;
+  stream->userdata = userdata;
+
   pa_channel_map map;
   assert(pa_channel_map_init_auto(&map, ss->channels, PA_CHANNEL_MAP_DEFAULT));
 
+  pa_buffer_attr bufattr = {
+    .maxlength = -1,
+    .minreq = -1,
+    .prebuf = -1,
+    .tlength = tlength,
+  };
+
   pa_threaded_mainloop_lock(pulse->mainloop);
 
-  pulse->stream = pa_stream_new(pulse->context, "Songcast Receiver", ss, &map);
-  pa_stream_set_state_callback(pulse->stream, stream_state_cb, pulse->mainloop);
-  pa_stream_set_write_callback(pulse->stream, callbacks->write, userdata);
-  pa_stream_set_underflow_callback(pulse->stream, callbacks->underflow, userdata);
-  pa_stream_set_latency_update_callback(pulse->stream, callbacks->latency, userdata);
+  stream->stream = pa_stream_new(pulse->context, "Songcast Receiver", ss, &map);
+  pa_stream_set_state_callback(stream->stream, stream_state_cb, pulse->mainloop);
+  pa_stream_set_write_callback(stream->stream, stream_write_cb, stream);
+  pa_stream_set_underflow_callback(stream->stream, stream_underflow_cb, stream);
+  pa_stream_set_latency_update_callback(stream->stream, stream_latency_cb, stream);
 
   char format[PA_SAMPLE_SPEC_SNPRINT_MAX];
   pa_sample_spec_snprint(format, sizeof(format), ss);
@@ -92,15 +155,15 @@ void create_stream(struct pulse *pulse, pa_sample_spec *ss, const pa_buffer_attr
                   PA_STREAM_AUTO_TIMING_UPDATE | PA_STREAM_ADJUST_LATENCY;
 
   pa_cvolume cvolume;
-  volume_to_cvolume(pulse, &cvolume, volume);
+  volume_to_cvolume(ss, &cvolume, volume);
 
   // Connect stream to the default audio output sink
-  assert(pa_stream_connect_playback(pulse->stream, NULL, bufattr, stream_flags, &cvolume, NULL) == 0);
+  assert(pa_stream_connect_playback(stream->stream, NULL, &bufattr, stream_flags, &cvolume, NULL) == 0);
 
   for (;;) {
     pa_stream_state_t state;
 
-    state = pa_stream_get_state(pulse->stream);
+    state = pa_stream_get_state(stream->stream);
 
     if (state == PA_STREAM_READY)
       break;
@@ -109,54 +172,29 @@ void create_stream(struct pulse *pulse, pa_sample_spec *ss, const pa_buffer_attr
     pa_threaded_mainloop_wait(pulse->mainloop);
   }
 
-  output_set_mute(pulse, mute);
-
   pa_threaded_mainloop_unlock(pulse->mainloop);
-}
-
-void output_init(struct pulse *pulse) {
-  pulse->mainloop = pa_threaded_mainloop_new();
-  pulse->context = pa_context_new(pa_threaded_mainloop_get_api(pulse->mainloop), "Songcast Receiver");
-  assert(pulse->context);
-
-  pa_context_set_state_callback(pulse->context, &context_state_cb, pulse->mainloop);
-
-  pa_threaded_mainloop_lock(pulse->mainloop);
-
-  // Start the mainloop
-  assert(pa_threaded_mainloop_start(pulse->mainloop) == 0);
-  assert(pa_context_connect(pulse->context, NULL, PA_CONTEXT_NOAUTOSPAWN, NULL) == 0);
-
-  // Wait for the context to be ready
-  while (true) {
-      pa_context_state_t context_state = pa_context_get_state(pulse->context);
-
-      if (context_state == PA_CONTEXT_READY)
-        break;
-
-      assert(PA_CONTEXT_IS_GOOD(context_state));
 
-      pa_threaded_mainloop_wait(pulse->mainloop);
-  }
-
-  pa_threaded_mainloop_unlock(pulse->mainloop);
+  pulse_set_mute(&stream->base, mute);
 
-  log_printf("Pulseaudio ready.");
+  return &stream->base;
 }
 
-void stop_stream(struct pulse *pulse) {
+static void pulse_stop_stream(struct output_stream *base) {
+  struct pulse_stream *stream = (struct pulse_stream *)base;
+  struct pulse *pulse = stream->pulse;
+
   log_printf("Disconnecting stream.");
 
   // TODO drain stream. this seems to cause deadlocks.
 
   pa_threaded_mainloop_lock(pulse->mainloop);
   
-  pa_stream_disconnect(pulse->stream);
+  pa_stream_disconnect(stream->stream);
 
   for (;;) {
     pa_stream_state_t state;
 
-    state = pa_stream_get_state(pulse->stream);
+    state = pa_stream_get_state(stream->stream);
 
     if (state == PA_STREAM_TERMINATED)
       break;
@@ -165,22 +203,64 @@ void stop_stream(struct pulse *pulse) {
     pa_threaded_mainloop_wait(pulse->mainloop);
   }
 
-  pa_stream_unref(pulse->stream);
+  pa_stream_unref(stream->stream);
   pa_threaded_mainloop_unlock(pulse->mainloop);
 
-  pulse->stream = NULL;
+  free(stream);
 
   log_printf("Stream disconnected.");
 }
 
-void output_set_mute(struct pulse *pulse, int mute) {
+static int pulse_begin_write(struct output_stream *base, void **data, size_t *nbytes) {
+  struct pulse_stream *stream = (struct pulse_stream *)base;
+
+  return pa_stream_begin_write(stream->stream, data, nbytes);
+}
+
+static int pulse_write(struct output_stream *base, const void *data, size_t nbytes) {
+  struct pulse_stream *stream = (struct pulse_stream *)base;
+
+  return pa_stream_write(stream->stream, data, nbytes, NULL, 0LL, PA_SEEK_RELATIVE);
+}
+
+static bool pulse_get_timing(struct output_stream *base, struct output_timing *timing) {
+  struct pulse_stream *stream = (struct pulse_stream *)base;
+  const pa_timing_info *ti = pa_stream_get_timing_info(stream->stream);
+
+  if (ti == NULL)
+    return false;
+
+  *timing = (struct output_timing){
+    .timestamp_usec = (uint64_t)ti->timestamp.tv_sec * 1000000 + ti->timestamp.tv_usec,
+    .write_index = ti->write_index,
+    .read_index = ti->read_index,
+    .sink_usec = ti->sink_usec,
+    .transport_usec = ti->transport_usec,
+    .playing = ti->playing == 1,
+  };
+
+  return true;
+}
+
+static void pulse_update_timing(struct output_stream *base) {
+  struct pulse_stream *stream = (struct pulse_stream *)base;
+  pa_operation *o = pa_stream_update_timing_info(stream->stream, NULL, NULL);
+
+  if (o != NULL)
+    pa_operation_unref(o);
+}
+
+static void pulse_set_mute(struct output_stream *base, int mute) {
+  struct pulse_stream *stream = (struct pulse_stream *)base;
+  struct pulse *pulse = stream->pulse;
+
   pa_threaded_mainloop_lock(pulse->mainloop);
-  uint32_t idx = pa_stream_get_index(pulse->stream);
+  uint32_t idx = pa_stream_get_index(stream->stream);
   pa_context_set_sink_input_mute(pulse->context, idx, mute, NULL, NULL);
   pa_threaded_mainloop_unlock(pulse->mainloop);
 }
 
-void volume_to_cvolume(struct pulse *pulse, pa_cvolume *cvolume, int volume) {
+static void volume_to_cvolume(const pa_sample_spec *ss, pa_cvolume *cvolume, int volume) {
   pa_cvolume_init(cvolume);
 
    if (volume > 100)
@@ -191,17 +271,69 @@ void volume_to_cvolume(struct pulse *pulse, pa_cvolume *cvolume, int volume) {
 
   pa_volume_t volume_t = PA_VOLUME_NORM / 100.0 * volume + 0.5;
 
-  const pa_sample_spec *ss = pa_stream_get_sample_spec(pulse->stream);
-
   pa_cvolume_set(cvolume, ss->channels, volume_t);
 }
 
-void output_set_volume(struct pulse *pulse, int volume) {
+static void pulse_set_volume(struct output_stream *base, int volume) {
+  struct pulse_stream *stream = (struct pulse_stream *)base;
+  struct pulse *pulse = stream->pulse;
+
   pa_threaded_mainloop_lock(pulse->mainloop);
-  uint32_t idx = pa_stream_get_index(pulse->stream);
+  uint32_t idx = pa_stream_get_index(stream->stream);
   pa_cvolume cvolume;
-  volume_to_cvolume(pulse, &cvolume, volume);
+  volume_to_cvolume(&base->ss, &cvolume, volume);
 
   pa_context_set_sink_input_volume(pulse->context, idx, &cvolume, NULL, NULL);
   pa_threaded_mainloop_unlock(pulse->mainloop);
 }
+
+static const struct output_ops pulse_ops = {
+  .name = "pulse",
+  .concurrent_streams = true,
+  .create_stream = pulse_create_stream,
+  .stop_stream = pulse_stop_stream,
+  .begin_write = pulse_begin_write,
+  .write = pulse_write,
+  .get_timing = pulse_get_timing,
+  .update_timing = pulse_update_timing,
+  .set_volume = pulse_set_volume,
+  .set_mute = pulse_set_mute,
+};
+
+struct output *output_pulse_new(void) {
+  struct pulse *pulse = calloc(1, sizeof(struct pulse));
+
+  if (pulse == NULL)
+    return NULL;
+
+  pulse->base.ops = &pulse_ops;
+  pulse->mainloop = pa_threaded_mainloop_new();
+  pulse->context = pa_context_new(pa_threaded_mainloop_get_api(pulse->mainloop), "Songcast Receiver");
+  assert(pulse->context);
+
+  pa_context_set_state_callback(pulse->context, &context_state_cb, pulse->mainloop);
+
+  pa_threaded_mainloop_lock(pulse->mainloop);
+
+  // Start the mainloop
+  assert(pa_threaded_mainloop_start(pulse->mainloop) == 0);
+  assert(pa_context_connect(pulse->context, NULL, PA_CONTEXT_NOAUTOSPAWN, NULL) == 0);
+
+  // Wait for the context to be ready
+  while (true) {
+      pa_context_state_t context_state = pa_context_get_state(pulse->context);
+
+      if (context_state == PA_CONTEXT_READY)
+        break;
+
+      assert(PA_CONTEXT_IS_GOOD(context_state));
+
+      pa_threaded_mainloop_wait(pulse->mainloop);
+  }
+
+  pa_threaded_mainloop_unlock(pulse->mainloop);
+
+  log_printf("Pulseaudio ready.");
+
+  return &pulse->base;
+}
@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <error.h>
+#include <time.h>
+
+#include "pcm.h"
+#include "log.h"
+
+// Runs every PCM conversion kernel this CPU supports on random input,
+// checks that the output is bit-identical to the scalar kernels and
+// reports the throughput of each on the frame sizes of common rates.
+// Sample counts that are not a multiple of the vector width exercise the
+// scalar tails.
+
+#define CHECK_SAMPLES 4099     // per conversion, odd on purpose
+#define CHECK_ROUNDS 100       // random buffers per kernel
+#define BENCH_SAMPLES_MAX 1920
+#define BENCH_DURATION 0.1     // seconds per kernel, format and size
+
+// Samples in a 5 ms stereo frame at 44.1, 48, 96 and 192 kHz.
+static const size_t bench_samples[] = { 441, 480, 960, BENCH_SAMPLES_MAX };
+
+typedef void (*convert_fn)(float *dst, const uint8_t *src, size_t count);
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Compares fn with the scalar kernel on random input and all lengths up
+// to a few vector widths. Returns false on the first mismatch.
+static bool check(const char *name, convert_fn fn, convert_fn scalar, size_t width) {
+  static uint8_t src[CHECK_SAMPLES * 3];
+  static float expected[CHECK_SAMPLES], got[CHECK_SAMPLES];
+
+  for (int round = 0; round < CHECK_ROUNDS; round++) {
+    for (size_t i = 0; i < sizeof(src); i++)
+      src[i] = rand();
+
+    // Extremes must convert exactly as well.
+    src[0] = 0x80;
+    src[1] = 0;
+    src[width] = 0x7f;
+    src[width + 1] = 0xff;
+
+    size_t count = round < 64 ? (size_t)round : CHECK_SAMPLES;
+
+    scalar(expected, src, count);
+    fn(got, src, count);
+
+    if (memcmp(expected, got, count * sizeof(float)) != 0) {
+      for (size_t i = 0; i < count; i++)
+        if (memcmp(&expected[i], &got[i], sizeof(float)) != 0) {
+          fprintf(stderr, "%s: sample %zu of %zu is %a, expected %a\n", name, i, count, got[i], expected[i]);
+          break;
+        }
+
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Samples converted per second, one frame of samples per call.
+static double bench(convert_fn fn, size_t width, size_t samples) {
+  static uint8_t src[BENCH_SAMPLES_MAX * 3];
+  static float dst[BENCH_SAMPLES_MAX];
+  unsigned long rounds = 0;
+
+  for (size_t i = 0; i < sizeof(src); i++)
+    src[i] = rand();
+
+  double start = now_sec(), elapsed;
+
+  do {
+    for (int i = 0; i < 100; i++)
+      fn(dst, src, samples);
+
+    rounds += 100;
+    elapsed = now_sec() - start;
+  } while (elapsed < BENCH_DURATION);
+
+  // Keep the conversions from being optimized away.
+  if (dst[width] == 2.0f)
+    printf(" ");
+
+  return rounds * samples / elapsed;
+}
+
+static void print_bench(const char *name, const char *format, convert_fn fn, size_t width, bool ok) {
+  printf("%-12s %-6s", name, format);
+
+  for (size_t i = 0; i < sizeof(bench_samples) / sizeof(bench_samples[0]); i++)
+    printf(" %8.1f", bench(fn, width, bench_samples[i]) / 1e6);
+
+  printf("%s\n", ok ? "" : "  MISMATCH");
+}
+
+int main(void) {
+  size_t count;
+  const struct pcm_kernel *kernels = pcm_get_kernels(&count);
+  const struct pcm_kernel *scalar = &kernels[0];
+  bool ok = true;
+
+  log_init();
+  srand(time(NULL));
+
+  printf("Msamples/s per frame size\n%-12s %-6s %8s %8s %8s %8s\n",
+         "kernel", "format", "44.1k", "48k", "96k", "192k");
+
+  for (size_t i = 0; i < count; i++) {
+    const struct pcm_kernel *k = &kernels[i];
+
+    if (k->supported != NULL && !k->supported()) {
+      printf("%-12s not supported by this CPU\n", k->name);
+      continue;
+    }
+
+    bool ok16 = check(k->name, k->s16be_to_float, scalar->s16be_to_float, 2);
+    bool ok24 = check(k->name, k->s24be_to_float, scalar->s24be_to_float, 3);
+
+    print_bench(k->name, "s16be", k->s16be_to_float, 2, ok16);
+    print_bench(k->name, "s24be", k->s24be_to_float, 3, ok24);
+
+    ok = ok && ok16 && ok24;
+  }
+
+  pcm_init();
+  log_flush();
+
+  if (!ok)
+    error(1, 0, "Kernels differ from the scalar conversion");
+
+  return 0;
+}
@@ -0,0 +1,215 @@
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PCM_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PCM_NEON
+#endif
+
+#include "pcm.h"
+#include "log.h"
+
+// All kernels place the sample in the upper bits of an int32_t and scale by
+// 2^-31. Both steps are exact in single precision, so every kernel produces
+// bit-identical output.
+#define PCM_SCALE (1.0f / (1U << 31))
+
+pcm_convert_fn pcm_s16be_to_float = pcm_s16be_to_float_scalar;
+pcm_convert_fn pcm_s24be_to_float = pcm_s24be_to_float_scalar;
+
+static const char *kernel_name = "scalar";
+
+void pcm_s16be_to_float_scalar(float *dst, const uint8_t *src, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    int32_t s = src[2 * i + 0] << 24 | src[2 * i + 1] << 16;
+    dst[i] = s * PCM_SCALE;
+  }
+}
+
+void pcm_s24be_to_float_scalar(float *dst, const uint8_t *src, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    int32_t s = src[3 * i + 0] << 24 | src[3 * i + 1] << 16 | src[3 * i + 2] << 8;
+    dst[i] = s * PCM_SCALE;
+  }
+}
+
+#ifdef PCM_X86
+// 8 samples per iteration. SSE2 has no byte shuffle, so the byte swap is
+// done with 16 bit shifts and the result is moved into the upper half of
+// each 32 bit lane by interleaving with zero.
+__attribute__((target("sse2")))
+static void pcm_s16be_to_float_sse2(float *dst, const uint8_t *src, size_t count) {
+  const __m128 scale = _mm_set1_ps(PCM_SCALE);
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+    __m128i lo = _mm_unpacklo_epi16(zero, v);
+    __m128i hi = _mm_unpackhi_epi16(zero, v);
+
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+
+  pcm_s16be_to_float_scalar(dst + i, src + 2 * i, count - i);
+}
+
+// 4 samples (12 bytes) per shuffle. The 16 byte load reads 4 bytes past
+// the samples being converted, so the loop stops one group early.
+__attribute__((target("ssse3")))
+static void pcm_s24be_to_float_ssse3(float *dst, const uint8_t *src, size_t count) {
+  const __m128 scale = _mm_set1_ps(PCM_SCALE);
+  const __m128i shuffle = _mm_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+  size_t i = 0;
+
+  for (; i + 6 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + 3 * i));
+    v = _mm_shuffle_epi8(v, shuffle);
+
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+  }
+
+  pcm_s24be_to_float_scalar(dst + i, src + 3 * i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void pcm_s16be_to_float_avx2(float *dst, const uint8_t *src, size_t count) {
+  const __m256 scale = _mm256_set1_ps(PCM_SCALE);
+  const __m256i shuffle = _mm256_setr_epi8(-1, -1, 1, 0, -1, -1, 3, 2, -1, -1, 5, 4, -1, -1, 7, 6,
+                                           -1, -1, 1, 0, -1, -1, 3, 2, -1, -1, 5, 4, -1, -1, 7, 6);
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    __m128i lo = _mm_loadl_epi64((const __m128i *)(src + 2 * i));
+    __m128i hi = _mm_loadl_epi64((const __m128i *)(src + 2 * i + 8));
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    v = _mm256_shuffle_epi8(v, shuffle);
+
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+  }
+
+  pcm_s16be_to_float_scalar(dst + i, src + 2 * i, count - i);
+}
+
+// 8 samples per iteration, each 128 bit lane holds 4 samples (12 bytes).
+// The second load ends 4 bytes past the converted samples.
+__attribute__((target("avx2")))
+static void pcm_s24be_to_float_avx2(float *dst, const uint8_t *src, size_t count) {
+  const __m256 scale = _mm256_set1_ps(PCM_SCALE);
+  const __m256i shuffle = _mm256_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9,
+                                           -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+  size_t i = 0;
+
+  for (; i + 10 <= count; i += 8) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)(src + 3 * i));
+    __m128i hi = _mm_loadu_si128((const __m128i *)(src + 3 * i + 12));
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    v = _mm256_shuffle_epi8(v, shuffle);
+
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+  }
+
+  pcm_s24be_to_float_scalar(dst + i, src + 3 * i, count - i);
+}
+#endif
+
+#ifdef PCM_NEON
+static void pcm_s16be_to_float_neon(float *dst, const uint8_t *src, size_t count) {
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    int16x8_t v = vreinterpretq_s16_u8(vrev16q_u8(vld1q_u8(src + 2 * i)));
+
+    int32x4_t lo = vshll_n_s16(vget_low_s16(v), 16);
+    int32x4_t hi = vshll_n_s16(vget_high_s16(v), 16);
+
+    vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(lo), PCM_SCALE));
+    vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(hi), PCM_SCALE));
+  }
+
+  pcm_s16be_to_float_scalar(dst + i, src + 2 * i, count - i);
+}
+
+// vld3 splits 8 samples into their most, middle and least significant bytes.
+static void pcm_s24be_to_float_neon(float *dst, const uint8_t *src, size_t count) {
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    uint8x8x3_t b = vld3_u8(src + 3 * i);
+
+    uint16x8_t hi = vorrq_u16(vshll_n_u8(b.val[0], 8), vmovl_u8(b.val[1]));
+    uint16x8_t lo = vshll_n_u8(b.val[2], 8);
+
+    int32x4_t s0 = vreinterpretq_s32_u32(vorrq_u32(vshll_n_u16(vget_low_u16(hi), 16), vmovl_u16(vget_low_u16(lo))));
+    int32x4_t s1 = vreinterpretq_s32_u32(vorrq_u32(vshll_n_u16(vget_high_u16(hi), 16), vmovl_u16(vget_high_u16(lo))));
+
+    vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(s0), PCM_SCALE));
+    vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(s1), PCM_SCALE));
+  }
+
+  pcm_s24be_to_float_scalar(dst + i, src + 3 * i, count - i);
+}
+#endif
+
+#ifdef PCM_X86
+static bool cpu_sse2(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+}
+
+static bool cpu_ssse3(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("ssse3");
+}
+
+static bool cpu_avx2(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// Slowest first.
+static const struct pcm_kernel kernels[] = {
+  { "scalar", NULL, pcm_s16be_to_float_scalar, pcm_s24be_to_float_scalar },
+#ifdef PCM_X86
+  { "sse2", cpu_sse2, pcm_s16be_to_float_sse2, pcm_s24be_to_float_scalar },
+  { "sse2/ssse3", cpu_ssse3, pcm_s16be_to_float_sse2, pcm_s24be_to_float_ssse3 },
+  { "avx2", cpu_avx2, pcm_s16be_to_float_avx2, pcm_s24be_to_float_avx2 },
+#endif
+#ifdef PCM_NEON
+  { "neon", NULL, pcm_s16be_to_float_neon, pcm_s24be_to_float_neon },
+#endif
+};
+
+// Selects the fastest kernels supported by the CPU we are running on.
+void pcm_init(void) {
+  for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    const struct pcm_kernel *k = &kernels[i];
+
+    if (k->supported != NULL && !k->supported())
+      continue;
+
+    pcm_s16be_to_float = k->s16be_to_float;
+    pcm_s24be_to_float = k->s24be_to_float;
+    kernel_name = k->name;
+  }
+
+  log_printf("PCM conversion: %s", kernel_name);
+}
+
+// All kernels built in, including those this CPU does not support.
+const struct pcm_kernel *pcm_get_kernels(size_t *count) {
+  *count = sizeof(kernels) / sizeof(kernels[0]);
+  return kernels;
+}
+
+const char *pcm_kernel_name(void) {
+  return kernel_name;
+}
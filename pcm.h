@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Converts count big-endian samples to float in [-1, 1). Samples are
+// converted independently, so the channel layout does not matter.
+typedef void (*pcm_convert_fn)(float *dst, const uint8_t *src, size_t count);
+
+extern pcm_convert_fn pcm_s16be_to_float;
+extern pcm_convert_fn pcm_s24be_to_float;
+
+// A set of conversion kernels for one instruction set.
+struct pcm_kernel {
+  const char *name;
+  bool (*supported)(void); // by this CPU, NULL if always
+  pcm_convert_fn s16be_to_float;
+  pcm_convert_fn s24be_to_float;
+};
+
+void pcm_init(void);
+const char *pcm_kernel_name(void);
+const struct pcm_kernel *pcm_get_kernels(size_t *count);
+
+void pcm_s16be_to_float_scalar(float *dst, const uint8_t *src, size_t count);
+void pcm_s24be_to_float_scalar(float *dst, const uint8_t *src, size_t count);
@@ -0,0 +1,223 @@
+#include <assert.h>
+
+#include "play_queue.h"
+#include "log.h"
+
+static void run_reset(struct play_run *run) {
+  *run = (struct play_run){
+    .frames = 0,
+  };
+}
+
+static double run_bytes_to_usec(struct play_run *run, size_t bytes) {
+  return (double)bytes / pa_frame_size(&run->ss) * 1e6 / run->ss.rate;
+}
+
+// Frames contributing to the start time estimate.
+static bool run_frame_is_timed(struct audio_frame *frame) {
+  return !frame->resent && !frame->concealed && frame->audio == frame->readptr && frame->audio_length > 0 &&
+         (!frame->timestamped || frame->timestamp_is_good);
+}
+
+static int64_t run_frame_due(struct audio_frame *frame) {
+  return frame->timestamped ? frame->ts_due_usec : frame->ts_recv_usec;
+}
+
+// Adds the frame following the run. Returns false if the run has ended.
+static bool run_append(struct play_run *run, struct audio_frame *frame) {
+  if (run->halt || run->format_change)
+    return false;
+
+  if (run->frames == 0) {
+    run->ss = frame->ss;
+    run->latency = frame->latency;
+    run->ts_base = run_frame_due(frame);
+  } else if (!pa_sample_spec_equal(&run->ss, &frame->ss) || run->latency != frame->latency) {
+    run->format_change = true;
+    return false;
+  }
+
+  run->frames++;
+  run->available += frame->audio_length;
+
+  if (!frame->timestamped)
+    run->untimestamped++;
+
+  if (run_frame_is_timed(frame)) {
+    // Start time implied by this frame: its due time minus everything
+    // played before and including it.
+    // TODO use Kalman Filter + RTS to estimate start?
+    run->ts_sum += run_frame_due(frame) - run->ts_base - run_bytes_to_usec(run, run->available);
+    run->n_timed++;
+  }
+
+  if (frame->halt)
+    run->halt = true;
+
+  return true;
+}
+
+// Removes bytes from the first frame of the run. Must be called before
+// the frame itself is modified.
+static void run_consume(struct play_run *run, struct audio_frame *head, size_t bytes) {
+  if (run->frames == 0)
+    return;
+
+  // A partially played frame no longer contributes timing, and every
+  // later frame now starts bytes earlier.
+  if (run_frame_is_timed(head)) {
+    run->ts_sum -= run_frame_due(head) - run->ts_base - run_bytes_to_usec(run, head->audio_length);
+    run->n_timed--;
+  }
+
+  run->available -= bytes;
+  run->ts_sum += run->n_timed * run_bytes_to_usec(run, bytes);
+
+  if (bytes < head->audio_length)
+    return;
+
+  run->frames--;
+
+  if (!head->timestamped)
+    run->untimestamped--;
+
+  if (run->frames == 0)
+    run_reset(run);
+}
+
+bool play_queue_init(struct play_queue *q, size_t capacity) {
+  run_reset(&q->run);
+  atomic_init(&q->produced, 0);
+  atomic_init(&q->consumed, 0);
+
+  return spsc_init(&q->ring, capacity, sizeof(struct audio_frame *));
+}
+
+// Producer side. Ownership of the frame passes to the queue. Returns false
+// if the queue is full.
+bool play_queue_push(struct play_queue *q, struct audio_frame *frame) {
+  size_t length = frame->audio_length;
+
+  if (!spsc_push(&q->ring, &frame))
+    return false;
+
+  atomic_fetch_add_explicit(&q->produced, length, memory_order_relaxed);
+
+  return true;
+}
+
+// Extends the run over the frames the producer has pushed so far.
+static void play_queue_extend_run(struct play_queue *q) {
+  struct audio_frame **slot;
+
+  while ((slot = spsc_peek(&q->ring, q->run.frames)) != NULL)
+    if (!run_append(&q->run, *slot))
+      break;
+}
+
+// Describes the playable audio at the start of the queue. Amortized O(1):
+// each frame is only looked at once when it joins the run. Consumer only.
+struct play_queue_info play_queue_info(struct play_queue *q) {
+  play_queue_extend_run(q);
+
+  struct play_run *run = &q->run;
+
+  struct play_queue_info info = {
+    .available = run->available,
+    .halt = run->halt,
+    .format_change = run->format_change,
+    .start = 0,
+    .halt_index = run->halt ? (int)run->frames - 1 : -1,
+    .format_change_index = run->format_change ? (int)run->frames : -1,
+    .latency_usec = run->frames > 0 ? latency_to_usec(run->ss.rate, run->latency) : 0,
+    .timestamped = run->untimestamped == 0,
+    .has_timing = false,
+  };
+
+  if (run->n_timed < 2)
+    return info;
+
+  info.has_timing = true;
+  info.start = run->ts_base + run->ts_sum / run->n_timed + 0.5;
+
+  return info;
+}
+
+// Returns the first frame or NULL if the queue is empty. Consumer only.
+struct audio_frame *play_queue_head(struct play_queue *q) {
+  struct audio_frame **slot = spsc_peek(&q->ring, 0);
+
+  return slot != NULL ? *slot : NULL;
+}
+
+// Marks bytes of the first frame as played. The frame is removed from the
+// queue and freed once all of it has been played. Consumer only.
+void play_queue_consume(struct play_queue *q, size_t bytes) {
+  struct audio_frame *frame = play_queue_head(q);
+
+  assert(frame != NULL && bytes <= frame->audio_length);
+
+  if (bytes == 0 && frame->audio_length > 0)
+    return;
+
+  run_consume(&q->run, frame, bytes);
+  atomic_fetch_add_explicit(&q->consumed, bytes, memory_order_relaxed);
+
+  if (bytes == frame->audio_length) {
+    spsc_release(&q->ring);
+    free_frame(frame);
+    return;
+  }
+
+  frame->readptr = (uint8_t*)frame->readptr + bytes;
+  frame->audio_length -= bytes;
+}
+
+// Remove trim amount of bytes from the start of the queue.
+// Returns true on success; false if there is not enough data to trim.
+bool play_queue_trim(struct play_queue *q, size_t trim) {
+  if (trim == 0)
+    return true;
+
+  log_printf("Trimming %zd bytes", trim);
+
+  while (trim > 0) {
+    struct audio_frame *frame = play_queue_head(q);
+
+    if (frame == NULL)
+      break;
+
+    size_t bytes = frame->audio_length < trim ? frame->audio_length : trim;
+
+    trim -= bytes;
+    play_queue_consume(q, bytes);
+  }
+
+  assert(trim == 0);
+
+  if (trim != 0)
+    return false;
+
+  return true;
+}
+
+// Frees all queued frames. Only safe while no consumer is running, i.e.
+// after the stream has been stopped.
+void play_queue_flush(struct play_queue *q) {
+  struct audio_frame *frame;
+
+  while (spsc_pop(&q->ring, &frame)) {
+    atomic_fetch_add_explicit(&q->consumed, frame->audio_length, memory_order_relaxed);
+    free_frame(frame);
+  }
+
+  run_reset(&q->run);
+}
+
+// Bytes queued and not yet played. Safe to call from either side.
+size_t play_queue_level(struct play_queue *q) {
+  size_t consumed = atomic_load_explicit(&q->consumed, memory_order_relaxed);
+  size_t produced = atomic_load_explicit(&q->produced, memory_order_relaxed);
+
+  return produced > consumed ? produced - consumed : 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pulse/sample.h>
+
+#include "audio_frame.h"
+#include "spsc.h"
+
+struct play_queue_info {
+  size_t available;
+  int64_t start;
+  int halt_index;
+  int format_change_index;
+  bool halt;
+  bool format_change;
+  bool timestamped;
+  bool has_timing;
+  double latency_usec;
+};
+
+// Summary of the contiguous frames at the start of the queue, maintained
+// as frames are appended to and consumed from the run.
+struct play_run {
+  unsigned int frames;     // the first frames of the queue form the run
+  size_t available;
+  pa_sample_spec ss;
+  int latency;
+  unsigned int untimestamped;
+
+  // Mean of the start times implied by each frame's due time.
+  unsigned int n_timed;
+  int64_t ts_base;
+  double ts_sum;
+
+  // The run ends with a HALT frame or before a frame of another format.
+  bool halt;
+  bool format_change;
+};
+
+// Frames ready for playback, in order. The network side pushes frames
+// once they are complete and their timing is known; the output callbacks
+// consume them without taking a lock.
+struct play_queue {
+  struct spsc ring; // struct audio_frame *
+
+  // Bytes pushed and played, readable from either side.
+  atomic_size_t produced;
+  atomic_size_t consumed;
+
+  // Consumer side
+  struct play_run run;
+};
+
+bool play_queue_init(struct play_queue *q, size_t capacity);
+bool play_queue_push(struct play_queue *q, struct audio_frame *frame);
+struct play_queue_info play_queue_info(struct play_queue *q);
+struct audio_frame *play_queue_head(struct play_queue *q);
+void play_queue_consume(struct play_queue *q, size_t bytes);
+bool play_queue_trim(struct play_queue *q, size_t trim);
+void play_queue_flush(struct play_queue *q);
+size_t play_queue_level(struct play_queue *q);
@@ -1,5 +1,6 @@
-#include <pulse/pulseaudio.h>
+#include <pulse/sample.h>
 #include <error.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -9,18 +10,52 @@
 #include <pthread.h>
 #include <math.h>
 #include <complex.h>
-#include <samplerate.h>
+#include <inttypes.h>
 
 #include "player.h"
 #include "upnpdevice.h"
 #include "output.h"
 #include "cache.h"
+#include "play_queue.h"
+#include "pcm.h"
 #include "log.h"
 
-// TODO determine CACHE_SIZE dynamically based on latency? 192/24 needs a larger cache
-// TODO determine BUFFER_LATENCY automagically
-#define CACHE_SIZE 500 // frames
-#define BUFFER_LATENCY 80e3 // 50ms buffer latency
+// The cache holds the sender's media latency with some headroom. The
+// output buffer starts at BUFFER_LATENCY and is adjusted per stream, see
+// size_buffers().
+#define CACHE_SIZE 500 // frames, until the first stream is sized
+#define CACHE_SIZE_MIN 100
+#define CACHE_SIZE_MAX 4096 // frames allocated
+#define CACHE_HEADROOM 2.0 // times the media latency
+#define FRAME_POOL_SLACK 32 // frames being parsed or played outside the cache
+
+#define BUFFER_LATENCY 80e3 // usec, initial output buffer
+#define BUFFER_LATENCY_MIN 20e3
+#define BUFFER_LATENCY_MAX 500e3
+#define BUFFER_JITTER_FACTOR 4 // buffer at least this many jitter peaks
+#define BUFFER_GROWTH 1.5 // after an underflow
+#define BUFFER_SHRINK 0.8 // after a clean period
+#define BUFFER_CLEAN_PERIOD 60e6 // usec without change before shrinking
+#define JITTER_DECAY 0.999 // per frame, forgets a peak in some thousand frames
+
+#define RESEND_REORDER_WINDOW 5e3 // wait for out-of-order frames before requesting
+#define RESEND_RETRY_INTERVAL 20e3 // doubled with every request
+#define RESEND_MAX_REQUESTS 4
+
+#define HALT_BRIDGE_TIMEOUT 2e6 // usec of silence after a HALT before the stream stops
+
+#define CONCEAL_LEAD 10e3 // usec, conceal a missing frame once the queue runs this low
+
+#define GAIN_LOW 20e3 // usec queued and buffered, fade out below
+#define GAIN_HIGH 30e3 // fade back in above
+#define GAIN_RAMP 5e3 // usec
+#define REBUFFER_LEVEL 40e3 // usec queued before playing again
+
+#define PASSTHROUGH_EPSILON 10e-6 // bypass the resampler within 10 ppm of unity
+#define PASSTHROUGH_CROSSFADE 5e3 // usec, at most one frame
+
+#define CLOCKTRACE_PATH "clocktrace"
+#define CLOCKTRACE_CAPACITY (1 << 18) // records, about 20 minutes at 5 ms per frame
 
 #define PLAYER_VOLUME_MAX 100
 #define PLAYER_VOLUME_LIMIT 60
@@ -29,57 +64,78 @@
 #define PA_CLAMP(x, low, high) (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))  
 
 
-FILE *logfile, *clockfile;
+FILE *logfile;
 
 // prototypes
 bool process_frame(player_t *player, struct audio_frame *frame);
-void play_audio(player_t *player, pa_stream *s, size_t writable, size_t *written_pre, size_t *written_post);
-void write_data(player_t *player, pa_stream *s, size_t request);
+void play_audio(player_t *player, struct output_stream *s, size_t writable, size_t *written_pre, size_t *written_post);
+void write_data(player_t *player, struct output_stream *s, size_t request);
 void set_state(player_t *player, enum PlayerState new_state);
-void update_pa_filter(player_t *player);
-void print_cache_fixed(player_t *player);
+void update_pa_filter(player_t *player, struct output_stream *s);
+static void discard_next_stream(player_t *player);
+uint64_t monotonic_usec(void);
+
+// seconds
+static const double jitter_buckets[] = {50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 5e-3, 10e-3, 25e-3, 50e-3};
+static const double write_cb_buckets[] = {10e-6, 25e-6, 50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 5e-3};
+
+// A pre-opened stream differs in format from the one playing, which
+// tells their callbacks apart before the stream pointer is known.
+static bool is_standby(player_t *player, struct output_stream *s) {
+  return atomic_load(&player->standby) && pa_sample_spec_equal(&s->ss, &player->next.ss);
+}
+
+static void write_silence(struct output_stream *s, size_t request) {
+  uint8_t *silence = calloc(1, request);
+  output_write(s, silence, request);
+  free(silence);
+}
 
 // callbacks
-void write_cb(pa_stream *s, size_t request, void *userdata) {
+// Callbacks may run before output_create_stream() has returned, so they
+// use the stream they are given rather than player->stream.
+void write_cb(struct output_stream *s, size_t request, void *userdata) {
   player_t *player = userdata;
+  uint64_t start = monotonic_usec();
 
-  assert(s == player->pulse.stream);
-
-  pthread_mutex_lock(&player->mutex);
+  if (is_standby(player, s)) {
+    write_silence(s, request);
+    return;
+  }
 
   write_data(player, s, request);
 
-  pa_operation *o = pa_stream_update_timing_info(s, NULL, NULL);
-
-  if (o != NULL)
-    pa_operation_unref(o);
+  output_update_timing(s);
 
-  pthread_mutex_unlock(&player->mutex);
+  histogram_observe(&player->metrics.write_cb, (monotonic_usec() - start) / 1e6);
 }
 
-void underflow_cb(pa_stream *s, void *userdata) {
+void underflow_cb(struct output_stream *s, void *userdata) {
   player_t *player = userdata;
 
-  assert(s == player->pulse.stream);
+  if (is_standby(player, s))
+    return;
+
+  log_warn("Underflow!");
+  atomic_fetch_add(&player->metrics.underflows, 1);
 
-  log_printf("Underflow!");
+  // Draining after a HALT is expected.
+  if (player->state == PLAYING)
+    atomic_fetch_add(&player->sizing.underruns, 1);
 
-  pthread_mutex_lock(&player->mutex);
   set_state(player, HALT);
-  pthread_mutex_unlock(&player->mutex);
 }
 
-void latency_cb(pa_stream *s, void *userdata) {
+void latency_cb(struct output_stream *s, void *userdata) {
   player_t *player = userdata;
 
-  assert(s == player->pulse.stream);
+  if (is_standby(player, s))
+    return;
 
-  pthread_mutex_lock(&player->mutex);
-  update_pa_filter(player);
-  pthread_mutex_unlock(&player->mutex);
+  update_pa_filter(player, s);
 }
 
-struct output_cb callbacks = {
+struct output_callbacks callbacks = {
   .write = write_cb,
   .underflow = underflow_cb,
   .latency = latency_cb,
@@ -93,6 +149,13 @@ uint64_t now_usec(void) {
   return (long long)now.tv_sec * 1000000 + (now.tv_nsec + 500) / 1000;
 }
 
+uint64_t monotonic_usec(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (long long)now.tv_sec * 1000000 + (now.tv_nsec + 500) / 1000;
+}
+
 char *print_state(enum PlayerState state) {
   switch (state) {
     case STOPPED:
@@ -133,6 +196,11 @@ void set_state(player_t *player, enum PlayerState new_state) {
 
   player->state = new_state;
 
+  gauge_set(&player->metrics.state, new_state);
+
+  if (new_state == HALT)
+    atomic_fetch_add(&player->metrics.halts, 1);
+
   char *transport_state;
 
   transport_state = "Stopped";
@@ -163,25 +231,119 @@ void reset_remote_clock(struct remote_clock *clock) {
 
 void stop(player_t *player) {
   log_printf("Stopping stream.");
-  stop_stream(&player->pulse);
-  src_delete(player->src);
+  pthread_mutex_lock(&player->stream_mutex);
+  struct output_stream *stream = player->stream;
+  player->stream = NULL;
+  pthread_mutex_unlock(&player->stream_mutex);
+  output_stop_stream(stream);
+  // No callbacks run once the stream is gone.
+  play_queue_flush(&player->queue);
+  resampler_pool_put(&player->resamplers, player->resampler);
+  player->resampler = NULL;
+  atomic_store(&player->bridging, false);
   set_state(player, STOPPED);
 }
 
-void player_init(player_t *player) {
+void player_config_defaults(struct player_config *config) {
+  *config = (struct player_config){
+    .resend = {
+      .reorder_window_usec = RESEND_REORDER_WINDOW,
+      .retry_interval_usec = RESEND_RETRY_INTERVAL,
+      .max_requests = RESEND_MAX_REQUESTS,
+    },
+    .passthrough_epsilon = PASSTHROUGH_EPSILON,
+    .resampler = RESAMPLER_SRC,
+  };
+}
+
+static void register_metrics(player_t *player) {
+  struct player_metrics *m = &player->metrics;
+
+  histogram_init(&m->jitter, jitter_buckets, sizeof(jitter_buckets) / sizeof(jitter_buckets[0]));
+  histogram_init(&m->write_cb, write_cb_buckets, sizeof(write_cb_buckets) / sizeof(write_cb_buckets[0]));
+
+  metrics_counter("songcast_frames_total", "Audio frames received", &m->frames);
+  metrics_counter("songcast_underflows_total", "Output underflows", &m->underflows);
+  metrics_counter("songcast_halts_total", "Streams halted", &m->halts);
+  metrics_gauge("songcast_state", "Player state (0 stopped, 1 starting, 2 playing, 3 halt)", &m->state);
+  metrics_gauge("songcast_cache_frames", "Frames in the reorder cache", &m->cache_frames);
+  metrics_gauge("songcast_cache_holes", "Missing frames in the reorder cache", &m->cache_holes);
+  metrics_gauge("songcast_queue_bytes", "Playable audio queued for the output", &m->queue_bytes);
+  metrics_gauge("songcast_clock_variance", "Variance of the remote clock estimate", &m->clock_variance);
+  metrics_gauge("songcast_effective_rate_hz", "Sample rate after drift correction", &m->effective_rate);
+  metrics_gauge("songcast_playback_latency_seconds", "Output latency reported by PulseAudio", &m->playback_latency);
+  metrics_gauge("songcast_cache_size_frames", "Reorder cache size chosen for the stream", &m->cache_size);
+  metrics_gauge("songcast_buffer_latency_seconds", "Output buffer requested for the stream", &m->buffer_latency);
+  metrics_histogram("songcast_packet_jitter_seconds", "Deviation of packet inter-arrival times from the frame duration", &m->jitter);
+  metrics_histogram("songcast_write_callback_seconds", "Write callback service time", &m->write_cb);
+
+  struct resend_stats *r = &player->resend.stats;
+  metrics_counter("songcast_resend_requested_total", "Missing frames requested", &r->requested);
+  metrics_counter("songcast_resend_retried_total", "Repeated resend requests", &r->retried);
+  metrics_counter("songcast_resend_satisfied_total", "Requested frames that arrived in time", &r->satisfied);
+  metrics_counter("songcast_resend_late_total", "Requested frames that arrived too late", &r->late);
+  metrics_counter("songcast_resend_abandoned_total", "Requested frames given up on", &r->abandoned);
+
+  metrics_counter("songcast_streams_created_total", "Output streams created", &player->output->streams_created);
+  metrics_counter("songcast_streams_stopped_total", "Output streams stopped", &player->output->streams_stopped);
+  metrics_counter("songcast_streams_preopened_total", "Format changes played on a pre-opened stream", &m->preopened);
+  metrics_counter("songcast_rebuffers_total", "Output faded out to rebuffer", &m->rebuffers);
+  metrics_counter("songcast_concealed_frames_total", "Missing frames replaced by concealment", &m->concealed);
+  metrics_counter_scaled("songcast_concealed_seconds_total", "Audio synthesized by concealment", &m->concealed_usec, 1e-6);
+  metrics_counter("songcast_resampler_created_total", "Resamplers allocated", &player->resamplers.created);
+  metrics_counter("songcast_resampler_reused_total", "Stream starts that reused an idle resampler", &player->resamplers.reused);
+  metrics_counter_scaled("songcast_resampler_saved_seconds_total", "Resampler setup time avoided by reuse",
+                         &player->resamplers.saved_usec, 1e-6);
+
+  struct output_stats *o = &player->output_stats;
+  metrics_counter("songcast_passthrough_frames_total", "Output frames written without resampling", &o->passthrough_frames);
+  metrics_counter("songcast_resampled_frames_total", "Output frames written by the resampler", &o->resampled_frames);
+}
+
+void player_init(player_t *player, const struct player_config *config) {
   logfile = fopen("logfile", "w");
-  clockfile = fopen("clockfile", "w");
 
   pthread_mutex_init(&player->mutex, NULL);
+  pthread_mutex_init(&player->stream_mutex, NULL);
+
+  player->config = *config;
+
+  if (config->clocktrace_path != NULL)
+    player_set_clocktrace(player, true);
+
+  log_printf("Resampler: %s", resampler_type_name(config->resampler));
+
+  // Most streams are stereo, so the first one finds its resampler ready.
+  resampler_pool_init(&player->resamplers);
+  resampler_pool_put(&player->resamplers, resampler_pool_get(&player->resamplers, config->resampler, 2));
+
+  pcm_init();
 
   reset_remote_clock(&player->remote_clock);
   set_state(player, STOPPED);
   // Set volume limit first, set_volume depends on it!
   set_volume_limit(player, PLAYER_VOLUME_LIMIT);
   player_set_volume(player, PLAYER_VOLUME_START);
-  player->cache = cache_init(CACHE_SIZE);
+  // Covers the largest cache a stream may be given. Pages of blocks that
+  // are never used are not touched.
+  frame_pool_init(CACHE_SIZE_MAX + FRAME_POOL_SLACK);
+  player->cache = cache_init(CACHE_SIZE_MAX, CACHE_SIZE);
+
+  if (!play_queue_init(&player->queue, CACHE_SIZE_MAX))
+    error(1, errno, "Could not allocate play queue");
+
+  resend_init(&player->resend, CACHE_SIZE_MAX, &config->resend);
+
+  player->sizing = (struct buffer_sizing){
+    .cache_frames = CACHE_SIZE,
+    .tlength_usec = BUFFER_LATENCY,
+    .tlength_reason = "default",
+  };
+
   player->mute = 0;
-  output_init(&player->pulse);
+  player->output = config->output != NULL ? config->output : output_pulse_new();
+  assert(player->output != NULL);
+  register_metrics(player);
 }
 
 // Stop playback
@@ -193,20 +355,25 @@ void player_stop(player_t *player) {
     set_state(player, STOPPED);
   }
 
+  discard_next_stream(player);
+
   cache_reset(player->cache);
+  resend_reset(&player->resend);
 
   pthread_mutex_unlock(&player->mutex);
 }
 
 void player_set_mute(player_t *player, int mute) {
+  pthread_mutex_lock(&player->stream_mutex);
+
   player->mute = mute;
 
-  device_set_mute(&player->dctx, mute);
+  if (player->stream != NULL)
+    output_set_mute(player->stream, mute);
 
-  if (player->state != PLAYING)
-    return;
-  
-  output_set_mute(&player->pulse, mute);
+  pthread_mutex_unlock(&player->stream_mutex);
+
+  device_set_mute(&player->dctx, mute);
 }
 
 int player_get_mute(player_t *player) {
@@ -220,12 +387,16 @@ void player_set_volume(player_t *player, int volume) {
   if (volume < 0)
     volume = 0;
 
-  player->volume = volume; 
+  pthread_mutex_lock(&player->stream_mutex);
 
-  if (player->state == PLAYING)
-    output_set_volume(&player->pulse, player->volume);
+  player->volume = volume;
+
+  if (player->stream != NULL)
+    output_set_volume(player->stream, volume);
+
+  pthread_mutex_unlock(&player->stream_mutex);
 
-  log_printf("Volume: %i", player->volume);
+  log_printf("Volume: %i", volume);
 
   device_set_volume(&player->dctx, player->volume);
 }
@@ -250,6 +421,144 @@ int player_get_volume_limit(player_t *player) {
   return player->volume_limit;
 }
 
+// Sizes the cache and the output buffer for a stream starting with frame
+// start. The cache holds the media latency with headroom. The output
+// buffer grows after an underflow, follows the packet jitter and shrinks
+// again while neither happens for a while.
+static void size_buffers(player_t *player, struct audio_frame *start) {
+  struct buffer_sizing *s = &player->sizing;
+  uint64_t now = start->ts_recv_usec;
+  double frame_usec = 1e6 * start->samplecount / start->ss.rate;
+  double latency_usec = latency_to_usec(start->ss.rate, start->latency);
+
+  unsigned int cache_frames = CACHE_SIZE;
+
+  if (latency_usec > 0 && frame_usec > 0)
+    cache_frames = PA_CLAMP(ceil(latency_usec * CACHE_HEADROOM / frame_usec), CACHE_SIZE_MIN, CACHE_SIZE_MAX);
+
+  if (cache_frames != s->cache_frames) {
+    log_printf("Cache: %u frames for %.0f ms latency at %.2f ms per frame", cache_frames,
+               latency_usec / 1e3, frame_usec / 1e3);
+    s->cache_frames = cache_frames;
+  }
+
+  cache_resize(player->cache, s->cache_frames);
+
+  if (s->tlength_changed_usec == 0)
+    s->tlength_changed_usec = now;
+
+  unsigned long underruns = atomic_load(&s->underruns);
+  double jitter_floor = s->jitter_peak_usec * BUFFER_JITTER_FACTOR;
+  double tlength = s->tlength_usec;
+  const char *reason = NULL;
+
+  if (underruns != s->underruns_seen) {
+    tlength *= BUFFER_GROWTH;
+    reason = "underflow";
+  } else if (jitter_floor > tlength) {
+    tlength = jitter_floor;
+    reason = "jitter";
+  } else if (now - s->tlength_changed_usec > BUFFER_CLEAN_PERIOD) {
+    tlength = fmax(tlength * BUFFER_SHRINK, jitter_floor);
+    reason = "clean network";
+  }
+
+  s->underruns_seen = underruns;
+  tlength = PA_CLAMP(tlength, BUFFER_LATENCY_MIN, BUFFER_LATENCY_MAX);
+
+  if (reason != NULL && tlength != s->tlength_usec) {
+    log_printf("Output buffer: %.0f -> %.0f ms (%s, jitter peak %.1f ms)", s->tlength_usec / 1e3,
+               tlength / 1e3, reason, s->jitter_peak_usec / 1e3);
+    s->tlength_usec = tlength;
+    s->tlength_reason = reason;
+    s->tlength_changed_usec = now;
+  }
+
+  gauge_set(&player->metrics.cache_size, s->cache_frames);
+  gauge_set(&player->metrics.buffer_latency, s->tlength_usec / 1e6);
+}
+
+static void *preopen_thread(void *arg) {
+  player_t *player = arg;
+  struct next_stream *next = &player->next;
+
+  next->resampler = resampler_pool_get(&player->resamplers, player->config.resampler, next->ss.channels);
+  next->stream = output_create_stream(player->output, &next->ss, next->tlength, &callbacks, player,
+                                      player->volume, player->mute);
+
+  return NULL;
+}
+
+// Opens a stream for the format waiting behind the current stream, so it
+// is ready when the current one ends. Called with the mutex held.
+static void preopen_stream(player_t *player, struct audio_frame *frame) {
+  struct next_stream *next = &player->next;
+
+  if (next->active || !player->output->ops->concurrent_streams)
+    return;
+
+  *next = (struct next_stream){
+    .active = true,
+    .ss = frame->ss,
+    .tlength = pa_usec_to_bytes(player->sizing.tlength_usec, &frame->ss),
+  };
+
+  atomic_store(&player->standby, true);
+
+  int err = pthread_create(&next->thread, NULL, preopen_thread, player);
+
+  if (err != 0) {
+    log_printf("Could not pre-open stream: %s", strerror(err));
+    next->active = false;
+    atomic_store(&player->standby, false);
+    return;
+  }
+
+  log_printf("Pre-opening stream for the next format.");
+}
+
+static void discard_next_stream(player_t *player) {
+  struct next_stream *next = &player->next;
+
+  if (next->active) {
+    pthread_join(next->thread, NULL);
+    next->active = false;
+  }
+
+  if (next->stream != NULL)
+    output_stop_stream(next->stream);
+
+  resampler_pool_put(&player->resamplers, next->resampler);
+
+  next->stream = NULL;
+  next->resampler = NULL;
+  atomic_store(&player->standby, false);
+}
+
+// Waits for the pre-opened stream and returns it if it plays ss.
+static struct output_stream *take_next_stream(player_t *player, const pa_sample_spec *ss) {
+  struct next_stream *next = &player->next;
+
+  if (!next->active)
+    return NULL;
+
+  pthread_join(next->thread, NULL);
+  next->active = false;
+
+  if (next->stream == NULL || !pa_sample_spec_equal(&next->ss, ss)) {
+    discard_next_stream(player);
+    return NULL;
+  }
+
+  struct output_stream *stream = next->stream;
+  player->resampler = next->resampler;
+  next->stream = NULL;
+  next->resampler = NULL;
+  atomic_fetch_add(&player->metrics.preopened, 1);
+
+  return stream;
+}
+
 void try_prepare(player_t *player) {
   if (player->state != STOPPED)
     return;
@@ -265,55 +574,78 @@ void try_prepare(player_t *player) {
 
   set_state(player, STARTING);
 
+  player->queue_ss = start->ss;
+  player->queue_latency = start->latency;
+  player->queue_closed = false;
+  concealer_reset(&player->concealer, &start->ss);
+  atomic_store(&player->format_change_pending, false);
+
   player->timing = (struct timing){
     .ss = start->ss,
     .estimated_rate = start->ss.rate,
     .avg_estimated_rate = start->ss.rate,
     .ratio = 1,
+    .gain = 1,
+    .gain_target = 1,
+    // The resampler starts out empty, there is nothing to crossfade from.
+    .passthrough = player->config.passthrough_epsilon > 0,
   };
 
   reset_remote_clock(&player->remote_clock);
   kalman2d_init(&player->timing.pa_filter, (mat2d){0, 0, 1, 0}, (mat2d){1000, 0, 0, 0.0001}, 10);
 
-  pa_buffer_attr bufattr = {
-    .maxlength = -1,
-    .minreq = -1,
-    .prebuf = -1,
-    .tlength = pa_usec_to_bytes(BUFFER_LATENCY, &start->ss),
-  };
+  size_buffers(player, start);
+
+  size_t tlength = pa_usec_to_bytes(player->sizing.tlength_usec, &start->ss);
 
   pthread_mutex_unlock(&player->mutex);
 
-  int error;
-  player->src = src_new(SRC_SINC_MEDIUM_QUALITY, start->ss.channels, &error);
-  assert(player->src != NULL);
+  struct output_stream *stream = take_next_stream(player, &start->ss);
 
-  SRC_STATE* src_new (int converter_type, int channels, int *error) ;
+  if (stream != NULL) {
+    log_printf("Switching to pre-opened stream.");
+  } else {
+    player->resampler = resampler_pool_get(&player->resamplers, player->config.resampler, start->ss.channels);
+    assert(player->resampler != NULL);
 
-  create_stream(&player->pulse, &start->ss, &bufattr, player, &callbacks, player->volume, player->mute);
+    stream = output_create_stream(player->output, &start->ss, tlength, &callbacks, player,
+                                  player->volume, player->mute);
+    assert(stream != NULL);
+  }
 
   pthread_mutex_lock(&player->mutex);
 
+  // The stream was opened with the volume and mute of that moment, which
+  // for a pre-opened stream may be long ago.
+  pthread_mutex_lock(&player->stream_mutex);
+  player->stream = stream;
+  output_set_volume(stream, player->volume);
+  output_set_mute(stream, player->mute);
+  pthread_mutex_unlock(&player->stream_mutex);
+
+  // From here on the pre-opened stream plays like any other.
+  atomic_store(&player->standby, false);
+
   log_printf("Stream prepared");
 }
 
-static bool prepare_for_start(player_t *player, size_t request) {
-  const pa_sample_spec *ss = pa_stream_get_sample_spec(player->pulse.stream);
-  const pa_timing_info *ti = pa_stream_get_timing_info(player->pulse.stream);
+static bool prepare_for_start(player_t *player, struct output_stream *s, size_t request) {
+  const pa_sample_spec *ss = &s->ss;
+  struct output_timing ti;
 
-  if (ti == NULL || ti->playing != 1)
+  if (!output_get_timing(s, &ti) || !ti.playing)
     return false;
 
-  struct cache_info info = cache_continuous_size(player->cache);
+  struct play_queue_info info = play_queue_info(&player->queue);
 
   if (!info.has_timing)
     return false;
 
   // TODO how many frames are in the cache that could be used for clock smoothing?
 
-  uint64_t ts = (uint64_t)ti->timestamp.tv_sec * 1000000 + ti->timestamp.tv_usec;
-  int playback_latency = ti->sink_usec + ti->transport_usec +
-                         pa_bytes_to_usec(ti->write_index - ti->read_index, ss);
+  uint64_t ts = ti.timestamp_usec;
+  int playback_latency = ti.sink_usec + ti.transport_usec +
+                         pa_bytes_to_usec(ti.write_index - ti.read_index, ss);
 
   // TODO remote_clock.filter might be invalid. can we ensure v = 1 in case if a non timestamped stream?
   uint64_t start_at;
@@ -326,21 +658,21 @@ static bool prepare_for_start(player_t *player, size_t request) {
 
   int delta = play_at - start_at;
 
-  log_printf("Request for %zd bytes, can start at %ld, would play at %ld, in %d usec", request, start_at, play_at, delta);
+  log_debug("Request for %zd bytes, can start at %ld, would play at %ld, in %d usec", request, start_at, play_at, delta);
 
   if (delta < 0) {
     if (info.halt) {
-      log_printf("halt frame in cache at %i", info.halt_index);
+      log_debug("halt frame in queue at %i", info.halt_index);
     }
     return false;
   }
 
   size_t skip = pa_usec_to_bytes(delta, ss);
 
-  log_printf("Need to skip %zd bytes, have %zd bytes", skip, info.available);
+  log_debug("Need to skip %zd bytes, have %zd bytes", skip, info.available);
 
   if (info.available < request + skip) {
-    log_printf("Not enough data in buffer to start (missing %zd bytes)", request - skip - info.available);
+    log_debug("Not enough data in buffer to start (missing %zd bytes)", request - skip - info.available);
     return false;
   }
 
@@ -351,15 +683,24 @@ static bool prepare_for_start(player_t *player, size_t request) {
   player->timing.avg_play_at = play_at;
   player->timing.avg_start_at_j = 1;
 
-  trim_cache(player->cache, skip);
-  print_cache_fixed(player);
+  // The offset between written and played audio starts over with each
+  // run, also when a HALT was bridged on the same stream.
+  player->timing.written_pre = 0;
+  player->timing.written_post = 0;
+  player->timing.n_delta = 0;
+
+  player->timing.gain = 1;
+  player->timing.gain_target = 1;
+  player->timing.rebuffering = false;
+
+  play_queue_trim(&player->queue, skip);
 
   return true;
 }
 
 // TODO wants player. is it really needed? cache is used. timing is used.
 // TODO what pre-conditions need to be met? cache must be present, stream is required
-void write_data(player_t *player, pa_stream *s, size_t request) {
+void write_data(player_t *player, struct output_stream *s, size_t request) {
   if (player->state == STOPPED)
     return;
 
@@ -368,7 +709,7 @@ void write_data(player_t *player, pa_stream *s, size_t request) {
       goto play;
       break;
     case STARTING:
-      if (prepare_for_start(player, request)) {
+      if (prepare_for_start(player, s, request)) {
         set_state(player, PLAYING);
         goto play;
       }
@@ -378,26 +719,45 @@ void write_data(player_t *player, pa_stream *s, size_t request) {
     case STOPPED:
     case HALT:
     default:
-      pthread_mutex_unlock(&player->mutex);
       return;
       break;
   }
 
   return;
 
-uint8_t *silence;
 size_t written_pre, written_post;
 
 play:
+  atomic_store(&player->bridging, false);
   play_audio(player, s, request, &written_pre, &written_post);
   player->timing.written_pre += written_pre;
   player->timing.written_post += written_post;
-  return;
+
+  // A HALT within the stream or rebuffering, the rest of the request is
+  // silence.
+  if (written_post >= request || (player->state != STARTING && !player->timing.rebuffering))
+    return;
+
+  request -= written_post;
+
+  if (player->timing.rebuffering) {
+    player->timing.rebuffer_bytes += request;
+    player->timing.written_post += request;
+  }
 
 silence:
-  silence = calloc(1, request);
-  pa_stream_write(s, silence, request, NULL, 0, PA_SEEK_RELATIVE);
-  free(silence);
+  if (atomic_load(&player->bridging)) {
+    player->bridged_bytes += request;
+
+    if (player->bridged_bytes > pa_usec_to_bytes(HALT_BRIDGE_TIMEOUT, &s->ss)) {
+      log_printf("No audio after HALT.");
+      atomic_store(&player->bridging, false);
+      set_state(player, HALT);
+      return;
+    }
+  }
+
+  write_silence(s, request);
   return;
 }
 
@@ -405,7 +765,134 @@ int min(int a, int b) {
   return a < b ? a : b;
 }
 
-void play_audio(player_t *player, pa_stream *s, size_t writable, size_t *written_pre, size_t *written_post) {
+// Blends from resampled to direct audio in place, or the other way round.
+static void crossfade(float *resampled, const float *direct, size_t frames, int channels, bool to_direct) {
+  for (size_t i = 0; i < frames; i++) {
+    float g = (float)(i + 1) / (frames + 1);
+
+    if (!to_direct)
+      g = 1 - g;
+
+    for (int c = 0; c < channels; c++) {
+      size_t k = i * channels + c;
+      resampled[k] = (1 - g) * resampled[k] + g * direct[k];
+    }
+  }
+}
+
+static void start_rebuffering(player_t *player) {
+  log_warn("Buffer ran low, rebuffering.");
+
+  player->timing.gain = 0;
+  player->timing.rebuffering = true;
+  player->timing.rebuffer_bytes = 0;
+
+  atomic_fetch_add(&player->metrics.rebuffers, 1);
+  atomic_fetch_add(&player->sizing.underruns, 1);
+}
+
+// Sets the gain target from the audio left to play, queued and in the
+// output buffer. Below GAIN_LOW the output fades out, and once silent
+// writes silence until the queue holds REBUFFER_LEVEL again. Audio that
+// was due during the silence is skipped as far as the queue allows, then
+// the output fades back in. The end of a run drains at full gain. Returns
+// false while rebuffering.
+static bool update_gain(player_t *player, struct output_stream *s) {
+  struct timing *t = &player->timing;
+  const pa_sample_spec *ss = &t->ss;
+  struct play_queue_info info = play_queue_info(&player->queue);
+  struct output_timing ti;
+  int64_t buffered = output_get_timing(s, &ti) ? ti.write_index - ti.read_index : 0;
+  double level = pa_bytes_to_usec(info.available + (buffered > 0 ? buffered : 0), ss);
+  bool ending = info.halt || info.format_change;
+
+  if (t->rebuffering) {
+    size_t refill = pa_usec_to_bytes(REBUFFER_LEVEL, ss);
+
+    if (info.available < refill && !ending) {
+      gauge_set(&player->metrics.queue_bytes, info.available);
+      return false;
+    }
+
+    size_t trim = 0;
+
+    if (!ending) {
+      trim = info.available - refill < t->rebuffer_bytes ? info.available - refill : t->rebuffer_bytes;
+      trim -= trim % pa_frame_size(ss);
+      play_queue_trim(&player->queue, trim);
+      t->written_pre += trim;
+    }
+
+    log_printf("Rebuffered after %.0f ms of silence, skipped %.0f ms.",
+               pa_bytes_to_usec(t->rebuffer_bytes, ss) / 1e3, pa_bytes_to_usec(trim, ss) / 1e3);
+
+    t->rebuffering = false;
+    t->gain_target = 1;
+  } else if (level < GAIN_LOW && !ending) {
+    t->gain_target = 0;
+  } else if (level > GAIN_HIGH || ending) {
+    t->gain_target = 1;
+  }
+
+  if (t->gain_target == 0 && info.available == 0) {
+    start_rebuffering(player);
+    gauge_set(&player->metrics.queue_bytes, 0);
+    return false;
+  }
+
+  t->gain_step = 1 / (ss->rate * GAIN_RAMP / 1e6);
+
+  // Reach silence before the queued audio runs out.
+  size_t frames = info.available / pa_frame_size(ss);
+
+  if (t->gain_target == 0 && frames > 0 && t->gain / frames > t->gain_step)
+    t->gain_step = t->gain / frames;
+
+  return true;
+}
+
+static bool ramping(struct timing *t) {
+  return t->gain != 1 || t->gain_target != 1;
+}
+
+// Copies frames from src to dst while ramping the gain towards its
+// target. src may equal dst.
+static void apply_gain(struct timing *t, float *dst, const float *src, size_t frames, int channels) {
+  for (size_t i = 0; i < frames; i++) {
+    if (t->gain < t->gain_target)
+      t->gain = fminf(t->gain + t->gain_step, t->gain_target);
+    else if (t->gain > t->gain_target)
+      t->gain = fmaxf(t->gain - t->gain_step, t->gain_target);
+
+    for (int c = 0; c < channels; c++)
+      dst[i * channels + c] = src[i * channels + c] * t->gain;
+  }
+}
+
+// Seqlock writer, only the output callback publishes.
+static void publish_output_status(struct player_status *status, const struct output_status *output) {
+  unsigned int seq = atomic_load_explicit(&status->seq, memory_order_relaxed);
+
+  atomic_store_explicit(&status->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  status->output = *output;
+  atomic_store_explicit(&status->seq, seq + 2, memory_order_release);
+}
+
+static struct output_status read_output_status(struct player_status *status) {
+  struct output_status output;
+  unsigned int seq;
+
+  do {
+    seq = atomic_load_explicit(&status->seq, memory_order_acquire);
+    output = status->output;
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) || seq != atomic_load_explicit(&status->seq, memory_order_relaxed));
+
+  return output;
+}
+
+void play_audio(player_t *player, struct output_stream *s, size_t writable, size_t *written_pre, size_t *written_post) {
   *written_pre = 0;
   *written_post = 0;
 
@@ -456,84 +943,165 @@ void play_audio(player_t *player, pa_stream *s, size_t writable, size_t *written
   double ratio = latency_ratio * clock_ratio;
   double effective_rate = ratio * player->timing.ss.rate;
 
-  printf("\033[8;0H");
-  printf("pre %f post %f avg_delta %5.0f cratio %f lratio %f est_rate %.2f eff_rate %.2f", time_remote, time_pulseaudio, avg_delta, clock_ratio, latency_ratio, player->timing.avg_estimated_rate, effective_rate);
-  printf("\033[K");
+  publish_output_status(&player->status, &(struct output_status){
+    .time_remote = time_remote,
+    .time_pulseaudio = time_pulseaudio,
+    .avg_delta = avg_delta,
+    .clock_ratio = clock_ratio,
+    .latency_ratio = latency_ratio,
+    .estimated_rate = player->timing.avg_estimated_rate,
+    .effective_rate = effective_rate,
+    .passthrough = player->timing.passthrough,
+  });
+  gauge_set(&player->metrics.effective_rate, effective_rate);
+
+  // Skip the resampler while the ratio is close enough to 1. The band for
+  // leaving passthrough is wider so a ratio hovering around epsilon does
+  // not toggle the mode on every request.
+  double epsilon = player->config.passthrough_epsilon;
+  double deviation = fabs(ratio - 1);
+  bool want_passthrough = player->timing.passthrough ? deviation < 2 * epsilon : deviation < epsilon;
+
+  if (!update_gain(player, s))
+    return;
+
+  int channels = player->timing.ss.channels;
 
   while (writable > 0) {
-    int pos = cache_pos(player->cache, 0);
-    struct audio_frame *frame = player->cache->frames[pos];
+    struct audio_frame *frame = play_queue_head(&player->queue);
+
+    if (player->timing.gain == 0 && player->timing.gain_target == 0) {
+      start_rebuffering(player);
+      break;
+    }
 
     if (frame == NULL) {
-      log_printf("Missing frame.");
+      log_debug("Missing frame.");
       break;
     }
 
     if (!pa_sample_spec_equal(&player->timing.ss, &frame->ss)) {
-      log_printf("Sample spec mismatch.");
+      log_warn("Sample spec mismatch.");
       break;
     }
 
-    SRC_DATA src_data = {
-      .data_in = frame->readptr,
-      .input_frames = frame->audio_length / frame_size,
-      .src_ratio = ratio,
-      .end_of_input = frame->halt,
-    };
+    size_t input_frames = frame->audio_length / frame_size;
+    size_t frames_used, frames_gen;
+    bool switching = want_passthrough != player->timing.passthrough;
+
+    if (player->timing.passthrough && !switching) {
+      frames_used = frames_gen = input_frames < writable / frame_size ? input_frames : writable / frame_size;
+
+      if (ramping(&player->timing)) {
+        // Apply the gain while copying into the output buffer.
+        void *data;
+        size_t size = frames_used * frame_size;
+
+        if (output_begin_write(s, &data, &size) < 0 || size < frame_size)
+          break;
+
+        if (frames_used > size / frame_size)
+          frames_used = frames_gen = size / frame_size;
 
-    size_t out_size = writable;
+        apply_gain(&player->timing, data, frame->readptr, frames_used, channels);
+        output_write(s, data, frames_used * frame_size);
+      } else {
+        output_write(s, frame->readptr, frames_used * frame_size);
+      }
+
+      atomic_fetch_add(&player->output_stats.passthrough_frames, frames_gen);
+    } else {
+      SRC_DATA src_data = {
+        .data_in = frame->readptr,
+        .input_frames = input_frames,
+        .src_ratio = ratio,
+        .end_of_input = frame->halt,
+      };
+
+      size_t out_size = writable;
+
+      // Backends writing into a ring may provide less at its end.
+      if (output_begin_write(s, (void**)&src_data.data_out, &out_size) < 0 || out_size < frame_size)
+        break;
+
+      src_data.output_frames = out_size / frame_size;
+
+      // A mode switch crossfades between the resampled and the direct
+      // signal, limited to what this frame provides.
+      if (switching) {
+        size_t fade = player->timing.ss.rate * PASSTHROUGH_CROSSFADE / 1e6;
+
+        if (fade > input_frames)
+          fade = input_frames;
+
+        if (src_data.output_frames > fade)
+          src_data.output_frames = fade;
+      }
 
-    src_set_ratio(player->src, ratio);
+      resampler_process(player->resampler, &src_data);
 
-    pa_stream_begin_write(s, (void**)&src_data.data_out, &out_size);
+      frames_used = src_data.input_frames_used;
+      frames_gen = src_data.output_frames_gen;
 
-    src_data.output_frames = out_size / frame_size;
+      if (switching) {
+        crossfade(src_data.data_out, frame->readptr, frames_gen, channels, want_passthrough);
 
-    assert(out_size == writable);
+        // Entering passthrough the direct signal continues right after
+        // the crossfaded part. Whatever the resampler still buffers is
+        // dropped.
+        if (want_passthrough) {
+          frames_used = frames_gen;
+          resampler_reset(player->resampler);
+        }
 
-    src_process(player->src, &src_data);
+        player->timing.passthrough = want_passthrough;
+        atomic_fetch_add(&player->output_stats.mode_switches, 1);
+      }
 
-    //printf("in %d used %d. out %d gen %d\n", src_data.input_frames, src_data.input_frames_used,
-  //         src_data.output_frames, src_data.output_frames_gen);
+      // The resampled audio is still in cache, scale it in place.
+      if (ramping(&player->timing))
+        apply_gain(&player->timing, src_data.data_out, src_data.data_out, frames_gen, channels);
 
-    pa_stream_write(s, src_data.data_out, src_data.output_frames_gen * frame_size, NULL, 0LL, PA_SEEK_RELATIVE);
+      output_write(s, src_data.data_out, frames_gen * frame_size);
 
-    // TODO check how much src actually consumed
+      atomic_fetch_add(&player->output_stats.resampled_frames, frames_gen);
+    }
 
-    size_t bytes_consumed = src_data.input_frames_used * frame_size;
+    size_t bytes_consumed = frames_used * frame_size;
     size_t leftover = frame->audio_length - bytes_consumed;
 
     bool consumed = leftover == 0;
+    bool halt = frame->halt;
 
-    if (!consumed) {
-      frame->readptr = (uint8_t*)frame->readptr + bytes_consumed;
-      frame->audio_length -= bytes_consumed;
-    }
+    play_queue_consume(&player->queue, bytes_consumed);
 
-    *written_pre += src_data.input_frames_used * frame_size;
-    *written_post += src_data.output_frames_gen * frame_size;
-    writable -= src_data.output_frames_gen * frame_size;
+    *written_pre += frames_used * frame_size;
+    *written_post += frames_gen * frame_size;
+    writable -= frames_gen * frame_size;
 
     assert(writable >= 0);
 
-    if (consumed) {
-      bool halt = frame->halt;
+    if (consumed && halt) {
+      log_printf("HALT received.");
 
-      free_frame(frame);
-      player->cache->frames[pos] = NULL;
-      player->cache->offset++;
-      player->cache->start_seqnum++;
-      if (player->cache->latest_index > 0)
-        player->cache->latest_index--;
-
-      if (halt) {
-        log_printf("HALT received.");
+      if (atomic_load(&player->format_change_pending)) {
         set_state(player, HALT);
         return;
       }
+
+      // Audio of the same format may follow. Keep the stream and start the
+      // next run at its due time, like a new stream but without
+      // re-creating it or losing the output clock estimate.
+      resampler_reset(player->resampler);
+      player->bridged_bytes = 0;
+      atomic_store(&player->bridging, true);
+      set_state(player, STARTING);
+      return;
     }
   }
 
+  gauge_set(&player->metrics.queue_bytes, player->queue.run.available);
+
   if (writable > 0) {
    // log_printf("Not enough data. Stopping.");
    // set_state(player, HALT);
@@ -541,47 +1109,271 @@ void play_audio(player_t *player, pa_stream *s, size_t writable, size_t *written
   }
 }
 
-void print_cache_fixed(player_t *player) {
-	return;
+// Redraws the status lines above the log. Called by the status renderer,
+// never from the packet or audio path. Only copies are taken under the
+// mutex, the terminal is written after releasing it.
+void print_player_status(player_t *player) {
+  static char cache[CACHE_RENDER_SIZE];
+
+  pthread_mutex_lock(&player->mutex);
+  cache_render(player->cache, cache, sizeof(cache));
+  struct frame_status status = player->status.frame;
+  struct buffer_sizing sizing = player->sizing;
+  pthread_mutex_unlock(&player->mutex);
+
+  struct output_status output = read_output_status(&player->status);
+
   printf("\033[0;0H");
-  print_cache(player->cache);
+  fputs(cache, stdout);
+
+  printf("\033[7;0H");
+  printf("Handling frame %u %s %s media %" PRIu64 " network %" PRIu64 " ", status.seqnum, status.resent ? "(resent)" : "",
+         status.timestamped ? "timestamped" : "no_timestamp", status.ts_media, status.ts_network);
+  printf("latency: %.0fms", status.latency_usec / 1e3);
+  printf("\033[K");
+
+  printf("\033[8;0H");
+  printf("pre %f post %f avg_delta %5.0f cratio %f lratio %f est_rate %.2f eff_rate %.2f %s", output.time_remote,
+         output.time_pulseaudio, output.avg_delta, output.clock_ratio, output.latency_ratio, output.estimated_rate,
+         output.effective_rate, output.passthrough ? "direct" : resampler_type_name(player->config.resampler));
+  printf("\033[K");
+
+  printf("\033[9;0H");
+  printf("cache %u frames, buffer %.0f ms (%s), jitter peak %.1f ms", sizing.cache_frames,
+         sizing.tlength_usec / 1e3, sizing.tlength_reason, sizing.jitter_peak_usec / 1e3);
+  printf("\033[K");
 }
 
-struct missing_frames *handle_frame(player_t *player, ohm1_audio *frame, struct timespec *ts) {
-  struct missing_frames *missing = NULL;
+// A missing frame is due once later frames have arrived and the output
+// is about to play the last audio before it.
+static bool conceal_due(player_t *player) {
+  return player->state == PLAYING && !player->queue_closed && player->cache->latest_index >= 1 &&
+         play_queue_level(&player->queue) < pa_usec_to_bytes(CONCEAL_LEAD, &player->queue_ss);
+}
+
+// Synthesizes the frame at the head of the cache. Its resend, if it still
+// arrives, finds the slot gone and is dropped as late.
+static struct audio_frame *conceal_frame(player_t *player) {
+  struct concealer *c = &player->concealer;
+  struct audio_frame *last = &c->last;
+
+  if (last->samplecount == 0)
+    return NULL;
+
+  struct audio_frame *frame = alloc_frame(last->samplecount * pa_frame_size(&player->queue_ss));
+
+  if (frame == NULL)
+    return NULL;
+
+  if (!concealer_fill(c, frame->audio, last->samplecount)) {
+    free_frame(frame);
+    return NULL;
+  }
+
+  uint64_t duration = 1e6 * last->samplecount / last->ss.rate;
+
+  frame->ss = player->queue_ss;
+  frame->latency = player->queue_latency;
+  frame->samplecount = last->samplecount;
+  frame->bitdepth = last->bitdepth;
+  frame->seqnum = player->cache->start_seqnum;
+  frame->timestamped = last->timestamped;
+  frame->ts_recv_usec = last->ts_recv_usec + duration;
+  frame->ts_due_usec = last->ts_due_usec + duration;
+  frame->concealed = true;
+
+  // The next concealed frame continues from this one.
+  last->ts_recv_usec = frame->ts_recv_usec;
+  last->ts_due_usec = frame->ts_due_usec;
+
+  atomic_fetch_add(&player->metrics.concealed, 1);
+  atomic_fetch_add(&player->metrics.concealed_usec, duration);
+
+  log_debug("Concealed missing frame %u.", frame->seqnum);
+
+  return frame;
+}
+
+// Hands frames from the start of the cache over to the output. A frame is
+// only passed on once its successor is present, as its due time is
+// estimated when the successor arrives. HALT frames are passed on right
+// away and close the queue. Audio of the same format and latency reopens
+// it and continues the stream, anything else waits for the next stream.
+static void feed_queue(player_t *player) {
+  enum PlayerState state = player->state;
+
+  if (state != STARTING && state != PLAYING)
+    return;
+
+  struct cache *cache = player->cache;
+
+  while (true) {
+    struct audio_frame *frame = cache->frames[cache_pos(cache, 0)];
+    bool conceal = conceal_due(player);
+
+    if (frame == NULL) {
+      if (!conceal || (frame = conceal_frame(player)) == NULL)
+        break;
+
+      cache_insert(cache, 0, frame);
+    }
+
+    if (!pa_sample_spec_equal(&player->queue_ss, &frame->ss) ||
+        (player->queue_closed && frame->latency != player->queue_latency)) {
+      atomic_store(&player->format_change_pending, true);
+
+      if (!pa_sample_spec_equal(&player->queue_ss, &frame->ss))
+        preopen_stream(player, frame);
+
+      break;
+    }
+
+    if (player->queue_closed) {
+      log_printf("Continuing stream after HALT.");
+      player->queue_closed = false;
+    }
+
+    bool halt = frame->halt;
+
+    // Without its successor the frame has no due time yet. Once the
+    // missing successor is due it will be concealed, so go ahead.
+    if (!halt && !conceal && (cache->latest_index < 1 || cache->frames[cache_pos(cache, 1)] == NULL))
+      break;
+
+    if (!frame->concealed) {
+      concealer_blend(&player->concealer, frame);
+      concealer_record(&player->concealer, frame);
+    }
+
+    // TODO count frames the output could not take
+    if (!play_queue_push(&player->queue, frame))
+      break;
+
+    // The consumer may already be playing the frame, don't touch it.
+    cache_pop(cache);
+
+    if (halt)
+      player->queue_closed = true;
+  }
+}
+
+// Records how far the gap to the previous packet deviates from the frame
+// duration. Only consecutive, first-time frames are compared.
+static void observe_arrival(player_t *player, struct audio_frame *frame) {
+  struct player_metrics *m = &player->metrics;
+
+  atomic_fetch_add_explicit(&m->frames, 1, memory_order_relaxed);
+
+  if (frame->resent)
+    return;
+
+  if (m->last_arrival_usec != 0 && frame->seqnum == m->last_seqnum + 1) {
+    double interval = (double)frame->ts_recv_usec - m->last_arrival_usec;
+    double duration = 1e6 * frame->samplecount / frame->ss.rate;
+
+    double jitter = fabs(interval - duration);
+
+    histogram_observe(&m->jitter, jitter / 1e6);
+
+    // Gaps in the stream are not jitter.
+    struct buffer_sizing *s = &player->sizing;
+
+    if (jitter < BUFFER_LATENCY_MAX)
+      s->jitter_peak_usec = fmax(jitter, s->jitter_peak_usec * JITTER_DECAY);
+  }
+
+  m->last_arrival_usec = frame->ts_recv_usec;
+  m->last_seqnum = frame->seqnum;
+}
+
+void handle_frame(player_t *player, ohm1_audio *frame, struct timespec *ts) {
   struct audio_frame *aframe = parse_frame(frame);
 
   if (aframe == NULL)
-    return NULL;
+    return;
 
   // TODO incorporate any network latencies and such into ts_due_usec
   aframe->ts_recv_usec = (long long)ts->tv_sec * 1000000 + (ts->tv_nsec + 500) / 1000;
 
-  if (player->state == HALT)
+  // The output may already be bridging a HALT when the new format shows up.
+  if (player->state == HALT ||
+      (atomic_load(&player->bridging) && atomic_load(&player->format_change_pending)))
     stop(player);
 
   pthread_mutex_lock(&player->mutex);
 
-  bool consumed = process_frame(player, aframe);
+  // Updates the jitter peak, which the buffer sizing reads under the mutex.
+  observe_arrival(player, aframe);
 
-  print_cache_fixed(player);
+  unsigned int seqnum = aframe->seqnum;
+  bool resent = aframe->resent;
+  bool consumed = process_frame(player, aframe);
 
-  if (consumed) {
-    // Don't send resend requests when the frame was an answer.
-    if (!aframe->resent)
-      missing = request_frames(player->cache);
+  resend_frame_arrived(&player->resend, seqnum, resent, consumed);
 
+  if (consumed)
     try_prepare(player);
-  } else {
+  else
     free_frame(aframe);
+
+  feed_queue(player);
+
+  gauge_set(&player->metrics.cache_frames, player->cache->count);
+  gauge_set(&player->metrics.cache_holes, cache_holes(player->cache));
+
+  pthread_mutex_unlock(&player->mutex);
+}
+
+void print_output_stats(player_t *player) {
+  unsigned long passthrough = atomic_load(&player->output_stats.passthrough_frames);
+  unsigned long resampled = atomic_load(&player->output_stats.resampled_frames);
+  unsigned long total = passthrough + resampled;
+
+  log_printf("Output: %.1f%% passthrough, %.1f%% resampled, %lu mode switches",
+             total > 0 ? 100.0 * passthrough / total : 0.0,
+             total > 0 ? 100.0 * resampled / total : 0.0,
+             atomic_load(&player->output_stats.mode_switches));
+  log_printf("Concealed: %lu frames, %.1f ms",
+             atomic_load(&player->metrics.concealed), atomic_load(&player->metrics.concealed_usec) / 1e3);
+  log_printf("Resampler: %lu created, %lu reused, %.3f ms setup saved",
+             atomic_load(&player->resamplers.created), atomic_load(&player->resamplers.reused),
+             atomic_load(&player->resamplers.saved_usec) / 1e3);
+}
+
+// Switches the clock trace on or off. The trace file is created when it
+// is first switched on.
+void player_set_clocktrace(player_t *player, bool enable) {
+  struct clocktrace *trace = atomic_load(&player->clocktrace);
+
+  if (trace == NULL && enable) {
+    const char *path = player->config.clocktrace_path != NULL ? player->config.clocktrace_path : CLOCKTRACE_PATH;
+
+    trace = clocktrace_open(path, CLOCKTRACE_CAPACITY);
+
+    if (trace == NULL)
+      return;
+
+    atomic_store(&player->clocktrace, trace);
   }
 
+  if (trace != NULL)
+    clocktrace_enable(trace, enable);
+}
+
+// Returns the missing frames that are due for a resend request, if any.
+struct missing_frames *player_poll_resend(player_t *player, uint64_t now_usec) {
+  pthread_mutex_lock(&player->mutex);
+  struct missing_frames *missing = resend_poll(&player->resend, player->cache, now_usec);
+
+  // Concealment does not wait for the next packet.
+  feed_queue(player);
+
   pthread_mutex_unlock(&player->mutex);
 
   return missing;
 }
 
-void estimate_remote_clock(struct remote_clock *clock, struct audio_frame *frame, struct audio_frame *successor) {
+void estimate_remote_clock(struct remote_clock *clock, struct clocktrace *trace, struct audio_frame *frame, struct audio_frame *successor) {
   assert(frame != NULL);
   assert(successor != NULL);
   assert(successor->seqnum > frame->seqnum);
@@ -632,11 +1424,15 @@ void estimate_remote_clock(struct remote_clock *clock, struct audio_frame *frame
 
   kalman2d_run(&clock->filter, delta_local, clock->ts_remote);
 
-  fprintf(clockfile, "%f %f %f %f %f\n",
-          (double)delta_local, (double)delta_remote, (double)clock->ts_remote,
-          kalman2d_get_x(&clock->filter), kalman2d_get_v(&clock->filter)
-         );
-  fflush(clockfile);
+  clocktrace_record(trace, &(struct clocktrace_record){
+    .ts_local_usec = ts_local,
+    .delta_local = delta_local,
+    .delta_remote = delta_remote,
+    .ts_remote = clock->ts_remote,
+    .filter_x = kalman2d_get_x(&clock->filter),
+    .filter_v = kalman2d_get_v(&clock->filter),
+    .filter_p = kalman2d_get_p(&clock->filter),
+  });
 // printf("%f\n", kalman2d_get_v(&clock->filter));
 
   if (kalman2d_get_p(&clock->filter) < 0.001) {
@@ -655,18 +1451,18 @@ bool process_frame(player_t *player, struct audio_frame *frame) {
   if (index < 0)
     return false;
 
-  printf("\033[7;0H");
-  printf("Handling frame %i %s %s media %" PRId64 " network %" PRId64 " ", frame->seqnum, frame->resent ? "(resent)" : "", frame->timestamped ? ("timestamped") : "no_timestamp"), frame->ts_media, frame->ts_network;
-  printf("latency: %.0fms", latency_to_usec(frame->ss.rate, frame->latency) / 1e3);
-  printf("\033[K");
+  struct frame_status *status = &player->status.frame;
+  status->seqnum = frame->seqnum;
+  status->resent = frame->resent;
+  status->timestamped = frame->timestamped;
+  status->ts_media = frame->ts_media;
+  status->ts_network = frame->ts_network;
+  status->latency_usec = latency_to_usec(frame->ss.rate, frame->latency);
 
   if (player->cache->frames[pos] != NULL)
     return false;
 
-  player->cache->frames[pos] = frame;
-
-  if (index > player->cache->latest_index)
-    player->cache->latest_index = index;
+  cache_insert(player->cache, index, frame);
 
   // Get previous frame to calculate timing.
 
@@ -683,15 +1479,23 @@ bool process_frame(player_t *player, struct audio_frame *frame) {
       !same_format(frame, predecessor))
     return true;
 
-  estimate_remote_clock(&player->remote_clock, predecessor, frame);
+  estimate_remote_clock(&player->remote_clock, atomic_load_explicit(&player->clocktrace, memory_order_acquire), predecessor, frame);
+  gauge_set(&player->metrics.clock_variance, kalman2d_get_p(&player->remote_clock.filter));
 
   return true;
 }
 
-void update_pa_filter(player_t *player) {
-  const pa_sample_spec *ss = pa_stream_get_sample_spec(player->pulse.stream);
-  pa_timing_info ti = *pa_stream_get_timing_info(player->pulse.stream);
-  uint64_t ts = (uint64_t)ti.timestamp.tv_sec * 1000000 + ti.timestamp.tv_usec;
+void update_pa_filter(player_t *player, struct output_stream *s) {
+  const pa_sample_spec *ss = &s->ss;
+  struct output_timing ti;
+
+  if (!output_get_timing(s, &ti))
+    return;
+
+  uint64_t ts = ti.timestamp_usec;
+
+  gauge_set(&player->metrics.playback_latency,
+            (ti.sink_usec + ti.transport_usec + pa_bytes_to_usec(ti.write_index - ti.read_index, ss)) / 1e6);
 
   if (player->timing.start_local_usec == 0) {
     // Prepare timing information
@@ -2,15 +2,21 @@
 
 #include <time.h>
 #include <stdint.h>
-#include <samplerate.h>
+#include <stdatomic.h>
 
 #include <OpenHome/Net/C/DvDevice.h>
 
 #include "ohm_v1.h"
 #include "output.h"
 #include "cache.h"
+#include "play_queue.h"
 #include "audio_frame.h"
 #include "kalman.h"
+#include "resend.h"
+#include "resampler.h"
+#include "conceal.h"
+#include "clocktrace.h"
+#include "metrics.h"
 
 enum PlayerState {STOPPED, STARTING, PLAYING, HALT};
 /*
@@ -64,26 +70,172 @@ struct timing {
 
   uint64_t local_last;
 
+  bool passthrough; // audio bypasses the resampler
+
+  // Output gain, faded out before the queue runs dry and back in after
+  // rebuffering.
+  float gain;
+  float gain_target;
+  float gain_step;     // per frame
+  bool rebuffering;    // writing silence until the queue has refilled
+  size_t rebuffer_bytes; // silence written while rebuffering
+
   kalman2d_t pa_filter;
 };
 
+struct player_config {
+  struct resend_config resend;
+  double passthrough_epsilon; // max. deviation of the ratio from 1, 0 disables
+  enum resampler_type resampler;
+  const char *clocktrace_path; // trace from the start if set
+  struct output *output;       // PulseAudio if not set
+};
+
+// Output frames written with and without the resampler.
+struct output_stats {
+  atomic_ulong passthrough_frames;
+  atomic_ulong resampled_frames;
+  atomic_ulong mode_switches;
+};
+
+// Drift correction state of the last write request, for the status
+// renderer.
+struct output_status {
+  double time_remote;
+  double time_pulseaudio;
+  double avg_delta;
+  double clock_ratio;
+  double latency_ratio;
+  double estimated_rate;
+  double effective_rate;
+  bool passthrough;
+};
+
+// Last frame received, written under the mutex.
+struct frame_status {
+  unsigned int seqnum;
+  bool resent;
+  bool timestamped;
+  uint64_t ts_media;
+  uint64_t ts_network;
+  double latency_usec;
+};
+
+// Read by the status renderer, which never blocks the packet or audio
+// path for longer than a copy.
+struct player_status {
+  struct frame_status frame;
+
+  // Last write request, published by the output callback. seq is odd
+  // while an update is in progress.
+  atomic_uint seq;
+  struct output_status output;
+};
+
+// Cache and output buffer sizes, chosen when a stream is prepared.
+// Written under the mutex.
+struct buffer_sizing {
+  unsigned int cache_frames;
+  double tlength_usec;
+  const char *tlength_reason;
+  uint64_t tlength_changed_usec;
+  double jitter_peak_usec;        // decaying peak of packet jitter
+  atomic_ulong underruns;         // output underflows while playing
+  unsigned long underruns_seen;
+};
+
+struct next_stream {
+  bool active; // thread started, not yet joined
+  pthread_t thread;
+  pa_sample_spec ss;
+  size_t tlength;
+  struct output_stream *stream;
+  struct resampler *resampler;
+};
+
+// Exposed through the metrics endpoint.
+struct player_metrics {
+  atomic_ulong frames;
+  atomic_ulong underflows;
+  atomic_ulong halts;
+  atomic_ulong preopened;
+  atomic_ulong rebuffers;
+  atomic_ulong concealed;       // frames
+  atomic_ulong concealed_usec;  // audio synthesized for them
+  _Atomic double state;
+  _Atomic double cache_frames;
+  _Atomic double cache_holes;
+  _Atomic double queue_bytes;
+  _Atomic double clock_variance;
+  _Atomic double effective_rate;
+  _Atomic double playback_latency; // seconds
+  _Atomic double cache_size;       // frames
+  _Atomic double buffer_latency;   // seconds, requested from the output
+  struct histogram jitter;   // deviation of packet inter-arrival times
+  struct histogram write_cb; // write callback service time
+
+  // Network thread only
+  uint64_t last_arrival_usec;
+  unsigned int last_seqnum;
+};
+
 typedef struct {
   struct DeviceContext dctx;
+  struct player_config config;
   pthread_mutex_t mutex;
-  enum PlayerState state;
+  _Atomic(enum PlayerState) state;
   struct cache *cache;
-  struct pulse pulse;
+
+  // Complete frames handed from the network thread to the output. The
+  // output callbacks own the consumer side, timing and resampler while a
+  // stream exists and never take the mutex.
+  struct play_queue queue;
+  pa_sample_spec queue_ss;
+  int queue_latency;
+  bool queue_closed;
+
+  // Audio of another format waits in the cache, so the stream can not
+  // continue past a HALT. Set by the network thread.
+  atomic_bool format_change_pending;
+  // The output continues the stream across a HALT, writing silence until
+  // the following audio is due. Set by the output.
+  atomic_bool bridging;
+  size_t bridged_bytes;
+
+  // The stream for the next format, opened in the background while the
+  // current one plays. Its callbacks only write silence while standby
+  // is set.
+  struct next_stream next;
+  atomic_bool standby;
+  struct resend_scheduler resend;
+  struct output *output;
+  // Guards stream, volume and mute. Volume and mute are set from the
+  // control threads while the network thread replaces the stream.
+  pthread_mutex_t stream_mutex;
+  struct output_stream *stream;
   struct timing timing;
   struct remote_clock remote_clock;
-  SRC_STATE *src;
+  _Atomic(struct clocktrace *) clocktrace;
+  struct resampler *resampler;
+  struct resampler_pool resamplers;
+  struct concealer concealer; // network thread
+  struct output_stats output_stats;
+  struct player_status status;
+  struct buffer_sizing sizing;
+  struct player_metrics metrics;
   int volume;
   int volume_limit;
   int mute;
 } player_t;
 
-void player_init(player_t *player);
+void player_config_defaults(struct player_config *config);
+void player_init(player_t *player, const struct player_config *config);
 void player_stop(player_t *player);
-struct missing_frames *handle_frame(player_t *player, ohm1_audio *frame, struct timespec *ts);
+void handle_frame(player_t *player, ohm1_audio *frame, struct timespec *ts);
+struct missing_frames *player_poll_resend(player_t *player, uint64_t now_usec);
+void print_output_stats(player_t *player);
+void print_player_status(player_t *player);
+void player_set_clocktrace(player_t *player, bool enable);
 
 void player_set_mute(player_t *player, int mute);
 int player_get_mute(player_t *player);
@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "polyphase.h"
+#include "kalman.h"
+
+#define POLYPHASE_BLOCK 2048 // input frames buffered per call
+
+typedef vector(float, 4) v4sf;
+
+struct polyphase_design {
+  int taps;
+  int phases;
+  double cutoff; // relative to Nyquist
+  double beta;   // Kaiser window
+};
+
+static const struct polyphase_design designs[] = {
+  [POLYPHASE_FAST] = { .taps = 8, .phases = 128, .cutoff = 0.80, .beta = 5.0 },
+  [POLYPHASE_MEDIUM] = { .taps = 16, .phases = 256, .cutoff = 0.90, .beta = 7.0 },
+  [POLYPHASE_BEST] = { .taps = 32, .phases = 512, .cutoff = 0.95, .beta = 9.0 },
+};
+
+// Modified Bessel function of the first kind, order 0.
+static double bessel_i0(double x) {
+  double sum = 1, term = 1;
+
+  for (int k = 1; k < 50 && term > sum * 1e-12; k++) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+  }
+
+  return sum;
+}
+
+// Output at position i + frac is the sum over taps k of
+// x[i - taps/2 + 1 + k] * h(k - taps/2 + 1 - frac). Each phase is
+// normalized to unity gain at DC.
+static void design_filter(struct polyphase *p, const struct polyphase_design *d) {
+  double half = p->taps / 2.0;
+
+  for (int phase = 0; phase <= p->phases; phase++) {
+    float *row = p->coefs + phase * p->taps;
+    double frac = (double)phase / p->phases;
+    double sum = 0;
+
+    for (int k = 0; k < p->taps; k++) {
+      double t = k - half + 1 - frac;
+      double x = M_PI * d->cutoff * t;
+      double sinc = t == 0 ? 1 : sin(x) / x;
+      double w = t / half;
+      double window = fabs(w) >= 1 ? 0 : bessel_i0(d->beta * sqrt(1 - w * w)) / bessel_i0(d->beta);
+
+      row[k] = sinc * window;
+      sum += row[k];
+    }
+
+    for (int k = 0; k < p->taps; k++)
+      row[k] /= sum;
+  }
+}
+
+struct polyphase *polyphase_new(enum polyphase_quality quality, int channels) {
+  const struct polyphase_design *d = &designs[quality];
+  struct polyphase *p = calloc(1, sizeof(struct polyphase));
+
+  if (p == NULL)
+    return NULL;
+
+  assert(d->taps % 4 == 0);
+
+  p->channels = channels;
+  p->taps = d->taps;
+  p->phases = d->phases;
+  p->capacity = p->taps + POLYPHASE_BLOCK;
+  p->coefs = aligned_alloc(sizeof(v4sf), (p->phases + 1) * p->taps * sizeof(float));
+  p->buf = calloc(channels, sizeof(float *));
+
+  if (p->coefs == NULL || p->buf == NULL)
+    goto error;
+
+  for (int c = 0; c < channels; c++) {
+    p->buf[c] = calloc(p->capacity, sizeof(float));
+
+    if (p->buf[c] == NULL)
+      goto error;
+  }
+
+  design_filter(p, d);
+  polyphase_reset(p);
+
+  return p;
+
+error:
+  polyphase_delete(p);
+  return NULL;
+}
+
+void polyphase_delete(struct polyphase *p) {
+  if (p == NULL)
+    return;
+
+  if (p->buf != NULL)
+    for (int c = 0; c < p->channels; c++)
+      free(p->buf[c]);
+
+  free(p->buf);
+  free(p->coefs);
+  free(p);
+}
+
+// Starts over with silent history, so that the first output frame lines
+// up with the first input frame.
+void polyphase_reset(struct polyphase *p) {
+  p->filled = p->taps / 2 - 1;
+  p->index = 0;
+  p->frac = 0;
+
+  for (int c = 0; c < p->channels; c++)
+    memset(p->buf[c], 0, p->filled * sizeof(float));
+}
+
+static float dot(const float *x, const float *h, int taps) {
+  v4sf acc = {0, 0, 0, 0};
+
+  for (int k = 0; k < taps; k += 4) {
+    v4sf xv;
+    memcpy(&xv, x + k, sizeof(xv));
+    acc += xv * *(const v4sf *)(h + k);
+  }
+
+  return acc[0] + acc[1] + acc[2] + acc[3];
+}
+
+// Same interface as src_process(): consumes as much interleaved input and
+// produces as much interleaved output as fits.
+void polyphase_process(struct polyphase *p, const float *in, size_t input_frames, size_t *input_frames_used,
+                       float *out, size_t output_frames, size_t *output_frames_gen, double ratio) {
+  if (ratio > 1 + POLYPHASE_MAX_DEVIATION)
+    ratio = 1 + POLYPHASE_MAX_DEVIATION;
+
+  if (ratio < 1 - POLYPHASE_MAX_DEVIATION)
+    ratio = 1 - POLYPHASE_MAX_DEVIATION;
+
+  size_t used = p->capacity - p->filled;
+
+  if (used > input_frames)
+    used = input_frames;
+
+  for (size_t i = 0; i < used; i++)
+    for (int c = 0; c < p->channels; c++)
+      p->buf[c][p->filled + i] = in[i * p->channels + c];
+
+  p->filled += used;
+
+  double step = 1 / ratio;
+  size_t gen = 0;
+  float h[p->taps] __attribute__ ((aligned(sizeof(v4sf))));
+
+  while (gen < output_frames && p->index + p->taps <= p->filled) {
+    double phase = p->frac * p->phases;
+    int n = phase;
+    float a = phase - n;
+
+    const float *h0 = p->coefs + n * p->taps;
+    const float *h1 = h0 + p->taps;
+
+    for (int k = 0; k < p->taps; k += 4) {
+      v4sf c0 = *(const v4sf *)(h0 + k);
+      v4sf c1 = *(const v4sf *)(h1 + k);
+      *(v4sf *)(h + k) = c0 + a * (c1 - c0);
+    }
+
+    for (int c = 0; c < p->channels; c++)
+      out[gen * p->channels + c] = dot(p->buf[c] + p->index, h, p->taps);
+
+    gen++;
+
+    p->frac += step;
+    int advance = p->frac;
+    p->frac -= advance;
+    p->index += advance;
+  }
+
+  // Keep the history still needed for the next output.
+  if (p->index > 0) {
+    for (int c = 0; c < p->channels; c++)
+      memmove(p->buf[c], p->buf[c] + p->index, (p->filled - p->index) * sizeof(float));
+
+    p->filled -= p->index;
+    p->index = 0;
+  }
+
+  *input_frames_used = used;
+  *output_frames_gen = gen;
+}
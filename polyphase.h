@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Windowed sinc polyphase resampler for ratios close to 1, as needed for
+// clock drift correction. Coefficients of neighbouring phases are
+// interpolated linearly.
+enum polyphase_quality {
+  POLYPHASE_FAST,
+  POLYPHASE_MEDIUM,
+  POLYPHASE_BEST,
+};
+
+// Ratios (output rate / input rate) are clamped to 1 +/- this.
+#define POLYPHASE_MAX_DEVIATION 0.01
+
+struct polyphase {
+  int channels;
+  int taps;    // per phase, a multiple of 4
+  int phases;
+  float *coefs; // (phases + 1) * taps, one row per phase
+
+  // Planar input history. Frame index is the first tap of the next output.
+  float **buf;
+  size_t capacity;
+  size_t filled;
+  size_t index;
+  double frac;
+};
+
+struct polyphase *polyphase_new(enum polyphase_quality quality, int channels);
+void polyphase_delete(struct polyphase *p);
+void polyphase_reset(struct polyphase *p);
+void polyphase_process(struct polyphase *p, const float *in, size_t input_frames, size_t *input_frames_used,
+                       float *out, size_t output_frames, size_t *output_frames_gen, double ratio);
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <error.h>
+#include <time.h>
+
+#include "resampler.h"
+#include "log.h"
+
+// Measures the drift correction resamplers. A sweep of sine tones is
+// resampled at a ratio off unity by a typical clock drift. THD+N is the
+// residual after fitting a sine of the expected output frequency,
+// relative to that sine. As input and output rate differ by only a few
+// hundred ppm there is no stop-band to fold from, so rejection is measured
+// as the level of a tone just below Nyquist, where each design rolls off.
+// Both are checked against per-quality limits, then the throughput is
+// measured on stereo frames. libsamplerate is measured alongside as the
+// reference, but not checked.
+
+#define CHECK_RATE 48000
+#define CHECK_CHANNELS 2
+#define CHECK_BLOCK 240      // frames per call, one 5 ms frame
+#define CHECK_LENGTH 24000   // input frames per tone
+#define CHECK_SETTLE 2400    // output frames skipped before measuring
+#define CHECK_AMPLITUDE 0.5
+#define CHECK_STOPBAND 0.98  // of Nyquist
+#define BENCH_DURATION 0.5   // seconds per resampler
+
+static const double sweep[] = { 100, 440, 1000, 3000, 6000, 10000, 15000 }; // Hz
+static const double ratios[] = { 1.0003, 0.9997 }; // +-300 ppm
+
+struct limits {
+  bool checked;       // false to only report
+  double thdn_db;     // at most, at and below passband_hz
+  double passband_hz; // tones above are only required to pass
+  double stopband_db; // at most
+};
+
+static const struct limits limits[] = {
+  [RESAMPLER_SRC] = { .checked = false, .passband_hz = 15000 },
+  [RESAMPLER_FAST] = { .checked = true, .thdn_db = -54, .passband_hz = 6000, .stopband_db = -12 },
+  [RESAMPLER_MEDIUM] = { .checked = true, .thdn_db = -72, .passband_hz = 10000, .stopband_db = -9 },
+  [RESAMPLER_BEST] = { .checked = true, .thdn_db = -92, .passband_hz = 15000, .stopband_db = -7 },
+};
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Resamples a tone of freq Hz, returns the output of the first channel.
+static float *resample_tone(enum resampler_type type, double freq, double ratio, size_t *frames) {
+  struct resampler *r = resampler_new(type, CHECK_CHANNELS);
+
+  if (r == NULL)
+    error(1, 0, "Could not create resampler %s", resampler_type_name(type));
+
+  static float in[CHECK_LENGTH * CHECK_CHANNELS];
+  size_t capacity = CHECK_LENGTH * 1.1;
+  float *out = calloc(capacity * CHECK_CHANNELS, sizeof(float));
+  float *mono = calloc(capacity, sizeof(float));
+
+  for (size_t i = 0; i < CHECK_LENGTH; i++)
+    for (int c = 0; c < CHECK_CHANNELS; c++)
+      in[i * CHECK_CHANNELS + c] = CHECK_AMPLITUDE * sin(2 * M_PI * freq * i / CHECK_RATE);
+
+  size_t used = 0, gen = 0;
+
+  while (used < CHECK_LENGTH && gen < capacity) {
+    size_t block = CHECK_LENGTH - used < CHECK_BLOCK ? CHECK_LENGTH - used : CHECK_BLOCK;
+
+    SRC_DATA data = {
+      .data_in = in + used * CHECK_CHANNELS,
+      .input_frames = block,
+      .data_out = out + gen * CHECK_CHANNELS,
+      .output_frames = capacity - gen,
+      .src_ratio = ratio,
+    };
+
+    resampler_process(r, &data);
+
+    used += data.input_frames_used;
+    gen += data.output_frames_gen;
+  }
+
+  for (size_t i = 0; i < gen; i++)
+    mono[i] = out[i * CHECK_CHANNELS];
+
+  free(out);
+  resampler_delete(r);
+
+  *frames = gen;
+
+  return mono;
+}
+
+// Least squares fit of a + b sin(wn) + c cos(wn). Returns the residual
+// power relative to the fitted sine in dB and the sine's amplitude.
+static double fit_sine(const float *x, size_t n, double w, double *amplitude) {
+  double s[3][3] = {{0}}, v[3] = {0};
+
+  for (size_t i = 0; i < n; i++) {
+    double b[3] = { 1, sin(w * i), cos(w * i) };
+
+    for (int j = 0; j < 3; j++) {
+      v[j] += b[j] * x[i];
+
+      for (int k = 0; k < 3; k++)
+        s[j][k] += b[j] * b[k];
+    }
+  }
+
+  // Gaussian elimination, the system is well conditioned.
+  for (int j = 0; j < 3; j++)
+    for (int k = j + 1; k < 3; k++) {
+      double f = s[k][j] / s[j][j];
+
+      for (int l = j; l < 3; l++)
+        s[k][l] -= f * s[j][l];
+
+      v[k] -= f * v[j];
+    }
+
+  double coef[3];
+
+  for (int j = 2; j >= 0; j--) {
+    coef[j] = v[j];
+
+    for (int k = j + 1; k < 3; k++)
+      coef[j] -= s[j][k] * coef[k];
+
+    coef[j] /= s[j][j];
+  }
+
+  double residual = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    double e = x[i] - (coef[0] + coef[1] * sin(w * i) + coef[2] * cos(w * i));
+    residual += e * e;
+  }
+
+  *amplitude = hypot(coef[1], coef[2]);
+
+  double signal = *amplitude * *amplitude / 2 * n;
+
+  return 10 * log10(residual / signal);
+}
+
+static double rms_db(const float *x, size_t n) {
+  double sum = 0;
+
+  for (size_t i = 0; i < n; i++)
+    sum += (double)x[i] * x[i];
+
+  return 10 * log10(sum / n / (CHECK_AMPLITUDE * CHECK_AMPLITUDE / 2));
+}
+
+// Stereo frames per second at a typical ratio.
+static double bench(enum resampler_type type) {
+  struct resampler *r = resampler_new(type, CHECK_CHANNELS);
+  static float in[CHECK_BLOCK * CHECK_CHANNELS], out[CHECK_BLOCK * 2 * CHECK_CHANNELS];
+  unsigned long frames = 0;
+
+  for (size_t i = 0; i < CHECK_BLOCK * CHECK_CHANNELS; i++)
+    in[i] = (float)rand() / RAND_MAX - 0.5f;
+
+  double start = now_sec(), elapsed;
+
+  do {
+    for (int i = 0; i < 100; i++) {
+      SRC_DATA data = {
+        .data_in = in,
+        .input_frames = CHECK_BLOCK,
+        .data_out = out,
+        .output_frames = CHECK_BLOCK * 2,
+        .src_ratio = ratios[0],
+      };
+
+      resampler_process(r, &data);
+      frames += data.input_frames_used;
+    }
+
+    elapsed = now_sec() - start;
+  } while (elapsed < BENCH_DURATION);
+
+  resampler_delete(r);
+
+  return frames / elapsed;
+}
+
+static bool check(enum resampler_type type) {
+  const struct limits *l = &limits[type];
+  double worst = -INFINITY;
+  bool ok = true;
+
+  for (size_t t = 0; t < sizeof(sweep) / sizeof(sweep[0]); t++)
+    for (size_t k = 0; k < sizeof(ratios) / sizeof(ratios[0]); k++) {
+      size_t frames;
+      float *out = resample_tone(type, sweep[t], ratios[k], &frames);
+      double w = 2 * M_PI * sweep[t] / CHECK_RATE / ratios[k];
+      double amplitude;
+      double thdn = fit_sine(out + CHECK_SETTLE, frames - 2 * CHECK_SETTLE, w, &amplitude);
+
+      free(out);
+
+      if (sweep[t] > l->passband_hz)
+        continue;
+
+      if (thdn > worst)
+        worst = thdn;
+
+      if (l->checked && (thdn > l->thdn_db || amplitude < CHECK_AMPLITUDE / 2)) {
+        printf("  %s: THD+N %.1f dB at %.0f Hz, ratio %.4f, exceeds %.0f dB\n", resampler_type_name(type),
+               thdn, sweep[t], ratios[k], l->thdn_db);
+        ok = false;
+      }
+    }
+
+  size_t frames;
+  float *out = resample_tone(type, CHECK_STOPBAND * CHECK_RATE / 2, ratios[0], &frames);
+  double stopband = rms_db(out + CHECK_SETTLE, frames - 2 * CHECK_SETTLE);
+
+  free(out);
+
+  if (l->checked && stopband > l->stopband_db) {
+    printf("  %s: stop-band %.1f dB exceeds %.0f dB\n", resampler_type_name(type), stopband, l->stopband_db);
+    ok = false;
+  }
+
+  printf("%-8s THD+N %6.1f dB up to %5.0f Hz, stop-band %6.1f dB, %6.1f Mframes/s%s\n",
+         resampler_type_name(type), worst, l->passband_hz, stopband, bench(type) / 1e6,
+         !l->checked ? "  (reference)" : ok ? "" : "  FAILED");
+
+  return ok;
+}
+
+int main(void) {
+  bool ok = true;
+
+  log_init();
+
+  for (enum resampler_type type = RESAMPLER_SRC; type <= RESAMPLER_BEST; type++)
+    ok = check(type) && ok;
+
+  log_flush();
+
+  if (!ok)
+    error(1, 0, "Resampler quality below limits");
+
+  return 0;
+}
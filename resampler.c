@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "resampler.h"
+#include "log.h"
+
+static const char *type_names[] = {
+  [RESAMPLER_SRC] = "src",
+  [RESAMPLER_FAST] = "fast",
+  [RESAMPLER_MEDIUM] = "medium",
+  [RESAMPLER_BEST] = "best",
+};
+
+static const enum polyphase_quality polyphase_qualities[] = {
+  [RESAMPLER_FAST] = POLYPHASE_FAST,
+  [RESAMPLER_MEDIUM] = POLYPHASE_MEDIUM,
+  [RESAMPLER_BEST] = POLYPHASE_BEST,
+};
+
+static uint64_t now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+struct resampler *resampler_new(enum resampler_type type, int channels) {
+  uint64_t start = now_usec();
+  struct resampler *r = calloc(1, sizeof(struct resampler));
+
+  if (r == NULL)
+    return NULL;
+
+  r->type = type;
+  r->channels = channels;
+
+  if (type == RESAMPLER_SRC) {
+    int error;
+    r->src = src_new(SRC_SINC_MEDIUM_QUALITY, channels, &error);
+
+    if (r->src == NULL)
+      log_printf("Could not create resampler: %s", src_strerror(error));
+  } else {
+    r->polyphase = polyphase_new(polyphase_qualities[type], channels);
+  }
+
+  if (r->src == NULL && r->polyphase == NULL) {
+    free(r);
+    return NULL;
+  }
+
+  r->create_usec = now_usec() - start;
+
+  return r;
+}
+
+void resampler_delete(struct resampler *r) {
+  if (r == NULL)
+    return;
+
+  if (r->src != NULL)
+    src_delete(r->src);
+
+  polyphase_delete(r->polyphase);
+  free(r);
+}
+
+void resampler_reset(struct resampler *r) {
+  if (r->src != NULL)
+    src_reset(r->src);
+  else
+    polyphase_reset(r->polyphase);
+}
+
+void resampler_pool_init(struct resampler_pool *pool) {
+  *pool = (struct resampler_pool){0};
+  pthread_mutex_init(&pool->mutex, NULL);
+}
+
+// Returns an idle resampler of this type and channel count after a reset,
+// or a new one.
+struct resampler *resampler_pool_get(struct resampler_pool *pool, enum resampler_type type, int channels) {
+  struct resampler *r = NULL;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  for (int i = 0; i < RESAMPLER_POOL_SIZE; i++)
+    if (pool->idle[i] != NULL && pool->idle[i]->type == type && pool->idle[i]->channels == channels) {
+      r = pool->idle[i];
+      pool->idle[i] = NULL;
+      break;
+    }
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (r == NULL) {
+    r = resampler_new(type, channels);
+
+    if (r != NULL)
+      atomic_fetch_add(&pool->created, 1);
+
+    return r;
+  }
+
+  uint64_t start = now_usec();
+  resampler_reset(r);
+  uint64_t reset_usec = now_usec() - start;
+
+  atomic_fetch_add(&pool->reused, 1);
+
+  if (r->create_usec > reset_usec)
+    atomic_fetch_add(&pool->saved_usec, r->create_usec - reset_usec);
+
+  return r;
+}
+
+// Keeps r for a later stream, most recent first. When the pool is full
+// the oldest idle resampler is deleted.
+void resampler_pool_put(struct resampler_pool *pool, struct resampler *r) {
+  if (r == NULL)
+    return;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  int i = 0;
+
+  while (i < RESAMPLER_POOL_SIZE - 1 && pool->idle[i] != NULL)
+    i++;
+
+  struct resampler *evicted = pool->idle[i];
+
+  memmove(&pool->idle[1], &pool->idle[0], i * sizeof(pool->idle[0]));
+  pool->idle[0] = r;
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  resampler_delete(evicted);
+}
+
+// Same semantics as src_process(). The polyphase resampler ignores
+// end_of_input: its lookahead is only a few frames.
+int resampler_process(struct resampler *r, SRC_DATA *data) {
+  if (r->src != NULL) {
+    src_set_ratio(r->src, data->src_ratio);
+    return src_process(r->src, data);
+  }
+
+  size_t used, gen;
+
+  polyphase_process(r->polyphase, data->data_in, data->input_frames, &used,
+                    data->data_out, data->output_frames, &gen, data->src_ratio);
+
+  data->input_frames_used = used;
+  data->output_frames_gen = gen;
+
+  return 0;
+}
+
+bool resampler_parse_type(const char *name, enum resampler_type *type) {
+  for (size_t i = 0; i < sizeof(type_names) / sizeof(type_names[0]); i++)
+    if (strcmp(name, type_names[i]) == 0) {
+      *type = i;
+      return true;
+    }
+
+  return false;
+}
+
+const char *resampler_type_name(enum resampler_type type) {
+  return type_names[type];
+}
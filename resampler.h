@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <samplerate.h>
+
+#include "polyphase.h"
+
+// Rate conversion for drift correction, either by libsamplerate or by the
+// native polyphase resampler.
+enum resampler_type {
+  RESAMPLER_SRC,
+  RESAMPLER_FAST,
+  RESAMPLER_MEDIUM,
+  RESAMPLER_BEST,
+};
+
+struct resampler {
+  enum resampler_type type;
+  int channels;
+  uint64_t create_usec; // time taken by resampler_new()
+  SRC_STATE *src;
+  struct polyphase *polyphase;
+};
+
+#define RESAMPLER_POOL_SIZE 4
+
+// Resamplers of stopped streams, kept so the next stream with the same
+// type and channel count only resets the filter state instead of
+// building the tables again.
+struct resampler_pool {
+  pthread_mutex_t mutex;
+  struct resampler *idle[RESAMPLER_POOL_SIZE];
+  atomic_ulong created;
+  atomic_ulong reused;
+  atomic_ulong saved_usec; // setup avoided by reuse
+};
+
+struct resampler *resampler_new(enum resampler_type type, int channels);
+void resampler_delete(struct resampler *r);
+void resampler_reset(struct resampler *r);
+int resampler_process(struct resampler *r, SRC_DATA *data);
+void resampler_pool_init(struct resampler_pool *pool);
+struct resampler *resampler_pool_get(struct resampler_pool *pool, enum resampler_type type, int channels);
+void resampler_pool_put(struct resampler_pool *pool, struct resampler *r);
+bool resampler_parse_type(const char *name, enum resampler_type *type);
+const char *resampler_type_name(enum resampler_type type);
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "resend.h"
+#include "log.h"
+
+void resend_init(struct resend_scheduler *r, unsigned int size, const struct resend_config *config) {
+  r->config = *config;
+  r->size = size;
+  r->entries = calloc(size, sizeof(struct resend_entry));
+  r->due = calloc(size, sizeof(unsigned int));
+
+  assert(r->entries != NULL && r->due != NULL);
+
+  atomic_init(&r->stats.requested, 0);
+  atomic_init(&r->stats.retried, 0);
+  atomic_init(&r->stats.satisfied, 0);
+  atomic_init(&r->stats.late, 0);
+  atomic_init(&r->stats.abandoned, 0);
+}
+
+// Forgets all missing frames, e.g. when the cache is reset.
+void resend_reset(struct resend_scheduler *r) {
+  memset(r->entries, 0, r->size * sizeof(struct resend_entry));
+}
+
+static void count(atomic_ulong *counter) {
+  atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+// Called for every received audio frame. stored tells whether the frame
+// made it into the cache.
+void resend_frame_arrived(struct resend_scheduler *r, unsigned int seqnum, bool resent, bool stored) {
+  struct resend_entry *e = &r->entries[seqnum % r->size];
+
+  if (e->state == RESEND_FREE || e->seqnum != seqnum) {
+    // A resent frame we no longer track, e.g. it was requested twice.
+    if (resent && !stored)
+      count(&r->stats.late);
+
+    return;
+  }
+
+  switch (e->state) {
+    case RESEND_REQUESTED:
+      count(stored ? &r->stats.satisfied : &r->stats.late);
+      break;
+    case RESEND_ABANDONED:
+      count(&r->stats.late);
+      break;
+    default:
+      // Arrived out of order within the reordering window.
+      break;
+  }
+
+  e->state = RESEND_FREE;
+}
+
+struct poll_ctx {
+  struct resend_scheduler *r;
+  unsigned int start_seqnum;
+  uint64_t now_usec;
+  int n_due;
+};
+
+static void poll_hole(void *ctx, int index) {
+  struct poll_ctx *p = ctx;
+  struct resend_scheduler *r = p->r;
+  unsigned int seqnum = p->start_seqnum + index;
+  struct resend_entry *e = &r->entries[seqnum % r->size];
+
+  if (e->state == RESEND_FREE || e->seqnum != seqnum) {
+    // The previous occupant has left the cache without arriving.
+    if (e->state == RESEND_REQUESTED)
+      count(&r->stats.abandoned);
+
+    *e = (struct resend_entry){
+      .seqnum = seqnum,
+      .state = RESEND_WAITING,
+      .requests = 0,
+      .first_seen_usec = p->now_usec,
+      .next_due_usec = p->now_usec + r->config.reorder_window_usec,
+    };
+  }
+
+  if (e->state == RESEND_ABANDONED || p->now_usec < e->next_due_usec)
+    return;
+
+  if (e->requests >= r->config.max_requests) {
+    e->state = RESEND_ABANDONED;
+    count(&r->stats.abandoned);
+    return;
+  }
+
+  count(e->requests == 0 ? &r->stats.requested : &r->stats.retried);
+
+  e->next_due_usec = p->now_usec + ((uint64_t)r->config.retry_interval_usec << e->requests);
+  e->requests++;
+  e->state = RESEND_REQUESTED;
+
+  r->due[p->n_due++] = seqnum;
+}
+
+// Walks the holes in the cache and returns all frames that are due for a
+// (repeated) request as one message, or NULL if none are due.
+struct missing_frames *resend_poll(struct resend_scheduler *r, struct cache *cache, uint64_t now_usec) {
+  unsigned int holes = cache_holes(cache);
+
+  if (holes == 0)
+    return NULL;
+
+  struct poll_ctx ctx = {
+    .r = r,
+    .start_seqnum = cache->start_seqnum,
+    .now_usec = now_usec,
+    .n_due = 0,
+  };
+
+  cache_scan_holes(cache, holes, poll_hole, &ctx);
+
+  if (ctx.n_due == 0)
+    return NULL;
+
+  struct missing_frames *d = malloc(sizeof(struct missing_frames) + sizeof(unsigned int) * ctx.n_due);
+  assert(d != NULL);
+
+  d->count = ctx.n_due;
+  memcpy(d->seqnums, r->due, sizeof(unsigned int) * ctx.n_due);
+
+  return d;
+}
+
+void print_resend_stats(struct resend_scheduler *r) {
+  log_printf("Resend: %lu requested, %lu retried, %lu satisfied, %lu late, %lu abandoned",
+             atomic_load(&r->stats.requested), atomic_load(&r->stats.retried),
+             atomic_load(&r->stats.satisfied), atomic_load(&r->stats.late),
+             atomic_load(&r->stats.abandoned));
+}
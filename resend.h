@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "cache.h"
+
+struct resend_config {
+  unsigned int reorder_window_usec; // wait this long before the first request
+  unsigned int retry_interval_usec; // doubled after every request
+  unsigned int max_requests;        // give up after this many requests
+};
+
+struct resend_stats {
+  atomic_ulong requested; // missing frames requested for the first time
+  atomic_ulong retried;   // repeated requests
+  atomic_ulong satisfied; // requested frames that arrived in time
+  atomic_ulong late;      // requested frames that arrived when no longer needed
+  atomic_ulong abandoned; // requested frames given up on
+};
+
+enum resend_state {RESEND_FREE, RESEND_WAITING, RESEND_REQUESTED, RESEND_ABANDONED};
+
+struct resend_entry {
+  unsigned int seqnum;
+  enum resend_state state;
+  unsigned int requests;
+  uint64_t first_seen_usec;
+  uint64_t next_due_usec;
+};
+
+// Tracks missing frames and decides when to ask the sender for them.
+// Entries are indexed by seqnum modulo size, which must be at least the
+// cache size.
+struct resend_scheduler {
+  struct resend_config config;
+  struct resend_stats stats;
+  unsigned int size;
+  struct resend_entry *entries;
+
+  // scratch space for collecting due seqnums
+  unsigned int *due;
+};
+
+void resend_init(struct resend_scheduler *r, unsigned int size, const struct resend_config *config);
+void resend_reset(struct resend_scheduler *r);
+void resend_frame_arrived(struct resend_scheduler *r, unsigned int seqnum, bool resent, bool stored);
+struct missing_frames *resend_poll(struct resend_scheduler *r, struct cache *cache, uint64_t now_usec);
+void print_resend_stats(struct resend_scheduler *r);
@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+#include <error.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "player.h"
+#include "upnpdevice.h"
+#include "ohm_v1.h"
+#include "log.h"
+
+// Replays OHM audio from a pcap capture through the player on a virtual
+// clock: packets arrive at their capture timestamps and the output is a
+// file sink playing at the nominal rate. Reports CPU time per second of
+// audio, resend behaviour and how long the clocks take to lock.
+
+#define REPLAY_TICK 5e3   // usec between output and resend polls
+#define REPLAY_DRAIN 1e6  // usec played after the last packet
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+
+struct pcap_header {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct pcap_record {
+  uint32_t ts_sec;
+  uint32_t ts_frac;
+  uint32_t caplen;
+  uint32_t len;
+};
+
+struct pcap {
+  FILE *file;
+  bool swapped;
+  bool nsec;
+  uint32_t linktype;
+};
+
+struct replay {
+  player_t player;
+  struct output *output;
+  unsigned int port; // 0 for any
+
+  uint64_t now_usec;
+  uint64_t next_tick_usec;
+  uint64_t first_usec;
+  uint64_t playing_usec; // first time in PLAYING
+  uint64_t locked_usec;  // drift correction active
+
+  unsigned long packets;
+  unsigned long audio_packets;
+  unsigned long skipped;
+  unsigned long resend_requests;
+};
+
+// The harness has no UPnP device.
+void device_set_volume_limit(struct DeviceContext *dctx, unsigned int volume) {}
+void device_set_volume(struct DeviceContext *dctx, unsigned int volume) {}
+void device_set_mute(struct DeviceContext *dctx, unsigned int mute) {}
+void device_set_transport_state(struct DeviceContext *dctx, const char *state) {}
+
+static uint32_t pcap32(struct pcap *pcap, uint32_t v) {
+  return pcap->swapped ? __builtin_bswap32(v) : v;
+}
+
+static void pcap_open(struct pcap *pcap, const char *path) {
+  struct pcap_header header;
+
+  pcap->file = fopen(path, "rb");
+
+  if (pcap->file == NULL)
+    error(1, errno, "%s", path);
+
+  if (fread(&header, sizeof(header), 1, pcap->file) != 1)
+    error(1, 0, "%s: not a pcap file", path);
+
+  switch (header.magic) {
+    case PCAP_MAGIC:
+      break;
+    case PCAP_MAGIC_NSEC:
+      pcap->nsec = true;
+      break;
+    default:
+      pcap->swapped = true;
+
+      if (__builtin_bswap32(header.magic) == PCAP_MAGIC_NSEC)
+        pcap->nsec = true;
+      else if (__builtin_bswap32(header.magic) != PCAP_MAGIC)
+        error(1, 0, "%s: not a pcap file (pcapng is not supported)", path);
+  }
+
+  pcap->linktype = pcap32(pcap, header.linktype);
+
+  if (pcap->linktype != LINKTYPE_NULL && pcap->linktype != LINKTYPE_ETHERNET &&
+      pcap->linktype != LINKTYPE_RAW && pcap->linktype != LINKTYPE_LINUX_SLL)
+    error(1, 0, "%s: unsupported link type %u", path, pcap->linktype);
+}
+
+// Reads the next record into buf. Returns its length, 0 at the end.
+static size_t pcap_next(struct pcap *pcap, uint8_t *buf, size_t size, uint64_t *ts_usec) {
+  struct pcap_record record;
+
+  if (fread(&record, sizeof(record), 1, pcap->file) != 1)
+    return 0;
+
+  size_t caplen = pcap32(pcap, record.caplen);
+  uint32_t frac = pcap32(pcap, record.ts_frac);
+
+  *ts_usec = (uint64_t)pcap32(pcap, record.ts_sec) * 1000000 + (pcap->nsec ? frac / 1000 : frac);
+
+  if (caplen > size)
+    error(1, 0, "Record of %zu bytes too large", caplen);
+
+  if (fread(buf, 1, caplen, pcap->file) != caplen)
+    return 0;
+
+  return caplen;
+}
+
+// Finds the UDP payload of a captured frame. Fragments are not reassembled.
+static uint8_t *udp_payload(struct replay *replay, uint32_t linktype, uint8_t *p, size_t n, size_t *length) {
+  uint16_t ethertype = 0x0800;
+
+  switch (linktype) {
+    case LINKTYPE_NULL:
+      if (n < 4)
+        return NULL;
+      p += 4;
+      n -= 4;
+      break;
+    case LINKTYPE_ETHERNET:
+      if (n < 14)
+        return NULL;
+      ethertype = p[12] << 8 | p[13];
+      p += 14;
+      n -= 14;
+
+      // 802.1Q
+      if (ethertype == 0x8100 && n >= 4) {
+        ethertype = p[2] << 8 | p[3];
+        p += 4;
+        n -= 4;
+      }
+      break;
+    case LINKTYPE_LINUX_SLL:
+      if (n < 16)
+        return NULL;
+      ethertype = p[14] << 8 | p[15];
+      p += 16;
+      n -= 16;
+      break;
+  }
+
+  if (ethertype != 0x0800 || n < 20 || (p[0] >> 4) != 4)
+    return NULL;
+
+  size_t ihl = (p[0] & 0x0f) * 4;
+  uint16_t fragment = p[6] << 8 | p[7];
+
+  if (p[9] != IPPROTO_UDP || (fragment & 0x3fff) != 0 || n < ihl + 8)
+    return NULL;
+
+  p += ihl;
+  n -= ihl;
+
+  uint16_t dport = p[2] << 8 | p[3];
+  size_t udp_length = p[4] << 8 | p[5];
+
+  if (replay->port != 0 && dport != replay->port)
+    return NULL;
+
+  if (udp_length < 8 || udp_length > n)
+    return NULL;
+
+  *length = udp_length - 8;
+
+  return p + 8;
+}
+
+// Lets the output play and the resend scheduler run up to now_usec.
+static void advance(struct replay *replay, uint64_t now_usec) {
+  if (replay->next_tick_usec == 0)
+    replay->next_tick_usec = now_usec;
+
+  while (replay->next_tick_usec <= now_usec) {
+    output_file_advance(replay->output, replay->next_tick_usec);
+
+    struct missing_frames *missing = player_poll_resend(&replay->player, replay->next_tick_usec);
+
+    if (missing != NULL)
+      replay->resend_requests++;
+
+    free(missing);
+
+    replay->next_tick_usec += REPLAY_TICK;
+  }
+
+  output_file_advance(replay->output, now_usec);
+  replay->now_usec = now_usec;
+
+  if (replay->playing_usec == 0 && replay->player.state == PLAYING)
+    replay->playing_usec = now_usec;
+
+  if (replay->locked_usec == 0 && replay->player.state == PLAYING &&
+      kalman2d_get_p(&replay->player.timing.pa_filter) < 1e-7 && replay->player.timing.n_delta > 30)
+    replay->locked_usec = now_usec;
+}
+
+static void handle_packet(struct replay *replay, uint8_t *buf, size_t n, uint64_t ts_usec) {
+  ohm1_header *hdr = (ohm1_header *)buf;
+
+  replay->packets++;
+
+  if (n < sizeof(ohm1_header) || strncmp((char *)hdr->signature, "Ohm ", 4) != 0 || hdr->version != 1)
+    return;
+
+  if (hdr->type != OHM1_AUDIO)
+    return;
+
+  if (n < sizeof(ohm1_audio)) {
+    replay->skipped++;
+    return;
+  }
+
+  struct timespec ts = {
+    .tv_sec = ts_usec / 1000000,
+    .tv_nsec = ts_usec % 1000000 * 1000,
+  };
+
+  replay->audio_packets++;
+  handle_frame(&replay->player, (ohm1_audio *)buf, &ts);
+}
+
+static double cpu_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options] capture.pcap\n"
+          "  -o file  raw float samples played (replay.raw)\n"
+          "  -p port  only replay packets sent to this UDP port\n"
+          "  -t file  write a clock trace\n"
+          "  -R type  resampler (src, fast, medium, best)\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  static struct replay replay;
+  const char *output_path = "replay.raw";
+  struct player_config config;
+
+  player_config_defaults(&config);
+
+  int c;
+  while ((c = getopt(argc, argv, "o:p:t:R:")) != -1)
+  switch (c) {
+    case 'o':
+      output_path = optarg;
+      break;
+    case 'p':
+      replay.port = atoi(optarg);
+      break;
+    case 't':
+      config.clocktrace_path = optarg;
+      break;
+    case 'R':
+      if (!resampler_parse_type(optarg, &config.resampler))
+        error(1, 0, "Unknown resampler %s", optarg);
+      break;
+    default:
+      usage(argv[0]);
+  }
+
+  if (optind + 1 != argc)
+    usage(argv[0]);
+
+  log_init();
+  log_printf("===== REPLAY %s =====", argv[optind]);
+
+  struct pcap pcap = {0};
+  pcap_open(&pcap, argv[optind]);
+
+  replay.output = output_file_new(output_path);
+
+  if (replay.output == NULL)
+    error(1, errno, "%s", output_path);
+
+  config.output = replay.output;
+  player_init(&replay.player, &config);
+
+  static uint8_t buf[65536];
+  uint64_t ts_usec;
+  size_t n;
+  double cpu_start = cpu_seconds();
+
+  while ((n = pcap_next(&pcap, buf, sizeof(buf), &ts_usec)) > 0) {
+    size_t length;
+    uint8_t *payload = udp_payload(&replay, pcap.linktype, buf, n, &length);
+
+    if (payload == NULL)
+      continue;
+
+    if (replay.first_usec == 0)
+      replay.first_usec = ts_usec;
+
+    advance(&replay, ts_usec);
+    handle_packet(&replay, payload, length, ts_usec);
+  }
+
+  if (replay.first_usec != 0)
+    advance(&replay, replay.now_usec + REPLAY_DRAIN);
+
+  double cpu = cpu_seconds() - cpu_start;
+  double played = output_file_played_usec(replay.output) / 1e6;
+
+  log_flush();
+
+  printf("Packets: %lu UDP, %lu audio, %lu skipped\n", replay.packets, replay.audio_packets, replay.skipped);
+  printf("Played: %.3f s of audio, capture spans %.3f s\n", played, (replay.now_usec - replay.first_usec) / 1e6);
+  printf("CPU: %.3f s, %.3f ms per second of audio\n", cpu, played > 0 ? cpu * 1e3 / played : 0.0);
+  printf("Resend: %lu requests sent\n", replay.resend_requests);
+
+  if (replay.playing_usec != 0)
+    printf("Playing after %.3f s\n", (replay.playing_usec - replay.first_usec) / 1e6);
+
+  if (replay.locked_usec != 0)
+    printf("Drift correction locked after %.3f s\n", (replay.locked_usec - replay.first_usec) / 1e6);
+
+  print_resend_stats(&replay.player.resend);
+  print_output_stats(&replay.player);
+  print_frame_pool_stats();
+
+  fclose(pcap.file);
+
+  return 0;
+}
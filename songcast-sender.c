@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+#include <error.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ohm_v1.h"
+
+// Synthetic OHM sender for exercising the receiver without a real
+// Songcast source. Sends a sine tone and answers resend requests. Loss,
+// reordering, duplication and clock drift can be injected.
+
+#define HISTORY_SIZE 4096 // sent packets kept for resend requests
+#define TONE_FREQUENCY 440
+#define TONE_AMPLITUDE 0.25
+#define HALT_GAP 1e6 // usec of silence after a HALT
+
+struct sender_config {
+  const char *host;
+  unsigned int port;
+  bool unicast;
+  unsigned int rate;
+  unsigned int alternate_rate; // switched to on every HALT, 0 to keep the format
+  unsigned int bitdepth;
+  unsigned int channels;
+  unsigned int samplecount;    // per packet
+  unsigned int latency_ms;
+  bool timestamps;
+  double halt_interval;        // seconds between HALTs, 0 for none
+  double duration;             // seconds, 0 to run forever
+  double loss;                 // probabilities per packet
+  double reorder;
+  double duplicate;
+  double drift_ppm;            // sender clock relative to ours
+};
+
+struct packet {
+  size_t length;
+  uint8_t data[OHM1_MAX_PACKET];
+};
+
+struct sender {
+  struct sender_config config;
+  int fd;
+  struct sockaddr_in dst;
+  bool have_dst;
+
+  unsigned int rate;
+  unsigned int seqnum;
+  uint64_t sample;
+  double phase;
+
+  struct packet *history;
+  struct packet held;  // delayed by reordering
+  bool holding;
+
+  struct {
+    unsigned long sent, lost, reordered, duplicated, resent, halts;
+  } stats;
+};
+
+static uint64_t monotonic_usec(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static bool chance(double probability) {
+  return probability > 0 && drand48() < probability;
+}
+
+// OHM timestamps count 256 ticks per sample of the 44.1 kHz or 48 kHz
+// family of the stream.
+static uint32_t usec_to_ticks(unsigned int rate, double usec) {
+  double multiplier = (rate % 441) == 0 ? 44100 : 48000;
+  return (uint64_t)(usec * 256.0 * multiplier / 1e6);
+}
+
+static void send_packet(struct sender *sender, const struct packet *packet) {
+  if (!sender->have_dst)
+    return;
+
+  if (sendto(sender->fd, packet->data, packet->length, 0, (struct sockaddr *)&sender->dst, sizeof(sender->dst)) < 0)
+    error(0, errno, "sendto");
+}
+
+static void build_audio(struct sender *sender, struct packet *packet, bool halt, uint64_t now_usec) {
+  const struct sender_config *config = &sender->config;
+  ohm1_audio *audio = (ohm1_audio *)packet->data;
+  size_t bytes_per_sample = config->bitdepth / 8;
+  size_t payload = config->samplecount * config->channels * bytes_per_sample;
+
+  memset(audio, 0, sizeof(ohm1_audio));
+
+  packet->length = sizeof(ohm1_audio) + payload;
+
+  audio->hdr = (ohm1_header){
+    .signature = "Ohm ",
+    .version = 1,
+    .type = OHM1_AUDIO,
+    .length = htons(packet->length),
+  };
+
+  // The sender clock runs off by drift_ppm.
+  double sender_usec = now_usec * (1 + config->drift_ppm * 1e-6);
+
+  audio->audio_hdr_length = 50;
+  audio->flags = OHM1_FLAG_LOSSLESS | (halt ? OHM1_FLAG_HALT : 0) | (config->timestamps ? OHM1_FLAG_TIMESTAMPED : 0);
+  audio->samplecount = htons(config->samplecount);
+  audio->frame = htonl(sender->seqnum);
+  audio->network_timestamp = htonl(config->timestamps ? usec_to_ticks(sender->rate, sender_usec) : 0);
+  audio->media_latency = htonl(usec_to_ticks(sender->rate, config->latency_ms * 1e3));
+  audio->media_timestamp = htonl(config->timestamps ? usec_to_ticks(sender->rate, sender->sample * 1e6 / sender->rate) : 0);
+  audio->start_sample = htobe64(sender->sample);
+  audio->total_samples = 0;
+  audio->samplerate = htonl(sender->rate);
+  audio->bitrate = htonl(sender->rate * config->bitdepth * config->channels);
+  audio->bitdepth = config->bitdepth;
+  audio->channels = config->channels;
+  audio->codec_length = 0;
+
+  uint8_t *p = audio->data;
+  double step = 2 * M_PI * TONE_FREQUENCY / sender->rate;
+
+  for (unsigned int i = 0; i < config->samplecount; i++) {
+    int32_t value = sin(sender->phase) * TONE_AMPLITUDE * (1 << (config->bitdepth - 1));
+
+    for (unsigned int c = 0; c < config->channels; c++)
+      for (int b = bytes_per_sample - 1; b >= 0; b--)
+        *p++ = value >> (8 * b);
+
+    sender->phase = fmod(sender->phase + step, 2 * M_PI);
+  }
+
+  sender->sample += config->samplecount;
+}
+
+// Sends the next packet through the impairment stages.
+static void emit(struct sender *sender, bool halt, uint64_t now_usec) {
+  struct packet *packet = &sender->history[sender->seqnum % HISTORY_SIZE];
+
+  build_audio(sender, packet, halt, now_usec);
+  sender->seqnum++;
+
+  if (chance(sender->config.loss)) {
+    sender->stats.lost++;
+    return;
+  }
+
+  if (!sender->holding && !halt && chance(sender->config.reorder)) {
+    sender->held = *packet;
+    sender->holding = true;
+    sender->stats.reordered++;
+    return;
+  }
+
+  send_packet(sender, packet);
+  sender->stats.sent++;
+
+  if (chance(sender->config.duplicate)) {
+    send_packet(sender, packet);
+    sender->stats.duplicated++;
+  }
+
+  if (sender->holding) {
+    send_packet(sender, &sender->held);
+    sender->holding = false;
+  }
+}
+
+static void handle_resend_request(struct sender *sender, ohm1_resend_request *request, size_t n) {
+  unsigned int count = ntohl(request->count);
+
+  if (sizeof(ohm1_resend_request) + count * sizeof(uint32_t) > n)
+    return;
+
+  for (unsigned int i = 0; i < count; i++) {
+    unsigned int seqnum = ntohl(request->seqnums[i]);
+
+    // Too old or not sent yet
+    if (seqnum >= sender->seqnum || sender->seqnum - seqnum > HISTORY_SIZE)
+      continue;
+
+    struct packet packet = sender->history[seqnum % HISTORY_SIZE];
+    ohm1_audio *audio = (ohm1_audio *)packet.data;
+    audio->flags |= OHM1_FLAG_RESENT;
+
+    send_packet(sender, &packet);
+    sender->stats.resent++;
+  }
+}
+
+static void handle_message(struct sender *sender) {
+  uint8_t buf[OHM1_MAX_PACKET];
+  struct sockaddr_in src;
+  socklen_t src_len = sizeof(src);
+
+  ssize_t n = recvfrom(sender->fd, buf, sizeof(buf), 0, (struct sockaddr *)&src, &src_len);
+
+  if (n < (ssize_t)sizeof(ohm1_header))
+    return;
+
+  ohm1_header *hdr = (ohm1_header *)buf;
+
+  if (strncmp((char *)hdr->signature, "Ohm ", 4) != 0 || hdr->version != 1)
+    return;
+
+  switch (hdr->type) {
+    case OHM1_JOIN:
+    case OHM1_LISTEN:
+      // Unicast receivers get the stream at the address they join from.
+      if (sender->config.unicast && (!sender->have_dst || sender->dst.sin_addr.s_addr != src.sin_addr.s_addr ||
+                                     sender->dst.sin_port != src.sin_port)) {
+        sender->dst = src;
+        sender->have_dst = true;
+        fprintf(stderr, "Receiver %s:%u joined\n", inet_ntoa(src.sin_addr), ntohs(src.sin_port));
+      }
+      break;
+    case OHM1_LEAVE:
+      if (sender->config.unicast && sender->have_dst) {
+        sender->have_dst = false;
+        fprintf(stderr, "Receiver left\n");
+      }
+      break;
+    case OHM1_RESEND_REQUEST:
+      handle_resend_request(sender, (ohm1_resend_request *)buf, n);
+      break;
+  }
+}
+
+static int open_socket(struct sender *sender) {
+  const struct sender_config *config = &sender->config;
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+  if (fd < 0)
+    error(1, errno, "Could not open socket");
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(config->port),
+    .sin_addr.s_addr = inet_addr(config->host),
+  };
+
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int)) < 0)
+    error(1, errno, "setsockopt(SO_REUSEADDR) failed");
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    error(1, errno, "Could not bind to %s:%u", config->host, config->port);
+
+  if (!config->unicast) {
+    struct ip_mreq mreq = {
+      .imr_multiaddr.s_addr = addr.sin_addr.s_addr,
+    };
+
+    // Resend requests are sent to the group.
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+      error(1, errno, "Could not join multicast group");
+
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &(int){ 1 }, sizeof(int)) < 0)
+      error(1, errno, "setsockopt(IP_MULTICAST_LOOP) failed");
+
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &(int){ 1 }, sizeof(int)) < 0)
+      error(1, errno, "setsockopt(IP_MULTICAST_TTL) failed");
+
+    sender->dst = addr;
+    sender->have_dst = true;
+  }
+
+  return fd;
+}
+
+static void print_stats(struct sender *sender) {
+  fprintf(stderr, "%u packets: %lu sent, %lu lost, %lu reordered, %lu duplicated, %lu resent, %lu halts\n",
+          sender->seqnum, sender->stats.sent, sender->stats.lost, sender->stats.reordered,
+          sender->stats.duplicated, sender->stats.resent, sender->stats.halts);
+}
+
+static void run(struct sender *sender) {
+  const struct sender_config *config = &sender->config;
+  uint64_t start = monotonic_usec();
+  uint64_t next = start;
+  uint64_t segment_start = start;
+  uint64_t last_stats = start;
+
+  for (;;) {
+    uint64_t now = monotonic_usec();
+
+    while (now >= next) {
+      double packet_usec = 1e6 * config->samplecount / sender->rate;
+      bool halt = config->halt_interval > 0 && next - segment_start >= config->halt_interval * 1e6;
+
+      emit(sender, halt, next);
+
+      // Pacing follows the sender clock.
+      next += packet_usec / (1 + config->drift_ppm * 1e-6);
+
+      if (halt) {
+        sender->stats.halts++;
+        next += HALT_GAP;
+        segment_start = next;
+
+        if (config->alternate_rate != 0)
+          sender->rate = sender->rate == config->rate ? config->alternate_rate : config->rate;
+      }
+    }
+
+    if (config->duration > 0 && now - start >= config->duration * 1e6)
+      break;
+
+    if (now - last_stats >= 10e6) {
+      print_stats(sender);
+      last_stats = now;
+    }
+
+    struct pollfd pfd = { .fd = sender->fd, .events = POLLIN };
+    int timeout = (next - now + 999) / 1000;
+
+    if (poll(&pfd, 1, timeout) > 0)
+      handle_message(sender);
+  }
+
+  // Let the receiver know the stream has ended.
+  emit(sender, true, monotonic_usec());
+  print_stats(sender);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -a host     multicast group or unicast address (239.255.255.250)\n"
+          "  -p port     (51972)\n"
+          "  -U          unicast, stream to the receiver that joins\n"
+          "  -r rate     sample rate (44100)\n"
+          "  -F rate     alternate sample rate, switched on every HALT\n"
+          "  -b bits     bit depth, 16 or 24 (16)\n"
+          "  -c count    channels (2)\n"
+          "  -n count    samples per packet (441)\n"
+          "  -l ms       media latency (100)\n"
+          "  -T          omit timestamps\n"
+          "  -h seconds  send a HALT every interval\n"
+          "  -d seconds  stop after duration\n"
+          "  -L percent  packet loss\n"
+          "  -O percent  reordering\n"
+          "  -D percent  duplication\n"
+          "  -X ppm      sender clock drift\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  struct sender sender = {
+    .config = {
+      .host = "239.255.255.250",
+      .port = 51972,
+      .rate = 44100,
+      .bitdepth = 16,
+      .channels = 2,
+      .samplecount = 441,
+      .latency_ms = 100,
+      .timestamps = true,
+    },
+  };
+
+  struct sender_config *config = &sender.config;
+
+  int c;
+  while ((c = getopt(argc, argv, "a:p:Ur:F:b:c:n:l:Th:d:L:O:D:X:")) != -1)
+  switch (c) {
+    case 'a':
+      config->host = optarg;
+      break;
+    case 'p':
+      config->port = atoi(optarg);
+      break;
+    case 'U':
+      config->unicast = true;
+      break;
+    case 'r':
+      config->rate = atoi(optarg);
+      break;
+    case 'F':
+      config->alternate_rate = atoi(optarg);
+      break;
+    case 'b':
+      config->bitdepth = atoi(optarg);
+      break;
+    case 'c':
+      config->channels = atoi(optarg);
+      break;
+    case 'n':
+      config->samplecount = atoi(optarg);
+      break;
+    case 'l':
+      config->latency_ms = atoi(optarg);
+      break;
+    case 'T':
+      config->timestamps = false;
+      break;
+    case 'h':
+      config->halt_interval = atof(optarg);
+      break;
+    case 'd':
+      config->duration = atof(optarg);
+      break;
+    case 'L':
+      config->loss = atof(optarg) / 100;
+      break;
+    case 'O':
+      config->reorder = atof(optarg) / 100;
+      break;
+    case 'D':
+      config->duplicate = atof(optarg) / 100;
+      break;
+    case 'X':
+      config->drift_ppm = atof(optarg);
+      break;
+    default:
+      usage(argv[0]);
+  }
+
+  if (config->bitdepth != 16 && config->bitdepth != 24)
+    error(1, 0, "Bit depth must be 16 or 24");
+
+  if (config->channels == 0 || config->samplecount == 0 || config->rate == 0)
+    error(1, 0, "Invalid format");
+
+  if (sizeof(ohm1_audio) + config->samplecount * config->channels * config->bitdepth / 8 > OHM1_MAX_PACKET)
+    error(1, 0, "Packets larger than %d bytes", OHM1_MAX_PACKET);
+
+  sender.history = calloc(HISTORY_SIZE, sizeof(struct packet));
+
+  if (sender.history == NULL)
+    error(1, errno, "calloc");
+
+  sender.rate = config->rate;
+  sender.fd = open_socket(&sender);
+
+  srand48(monotonic_usec());
+
+  fprintf(stderr, "Sending %u Hz, %u bit, %u channels, %u samples per packet to %s:%u (%s)\n",
+          config->rate, config->bitdepth, config->channels, config->samplecount,
+          config->host, config->port, config->unicast ? "unicast" : "multicast");
+
+  run(&sender);
+
+  close(sender.fd);
+  free(sender.history);
+
+  return 0;
+}
@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <error.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "spsc.h"
+#include "play_queue.h"
+#include "log.h"
+
+// Hammers the lock-free handoffs between the network thread and the output
+// callbacks from two threads. The ring is checked with sequence numbers,
+// the play queue with frames consumed in random chunks, as the output
+// does. Exits non-zero on the first item lost, duplicated or reordered.
+// Beforehand, the playable run the queue maintains incrementally is
+// compared with one recomputed from all queued frames after every step.
+
+#define STRESS_ITEMS 10000000 // ring elements
+#define STRESS_FRAMES 1000000 // play queue frames
+#define STRESS_CAPACITY 64    // small, so both sides often find it full or empty
+#define STRESS_FRAME_SAMPLES 240
+#define RUN_STEPS 200000      // random pushes, plays and trims
+
+struct element {
+  uint64_t seqnum;
+  uint64_t check;
+};
+
+static struct spsc ring;
+static struct play_queue queue;
+
+static pa_sample_spec ss = { .format = PA_SAMPLE_FLOAT32LE, .rate = 48000, .channels = 2 };
+
+static uint64_t check_value(uint64_t seqnum) {
+  return seqnum * 0x9e3779b97f4a7c15ULL;
+}
+
+// Same rules as the run in play_queue.c, applied to the whole queue.
+static bool frame_is_timed(struct audio_frame *frame) {
+  return !frame->resent && !frame->concealed && frame->audio == frame->readptr && frame->audio_length > 0 &&
+         (!frame->timestamped || frame->timestamp_is_good);
+}
+
+static struct play_queue_info recompute_run(struct play_queue *q) {
+  struct play_queue_info info = { .halt_index = -1, .format_change_index = -1, .timestamped = true };
+  struct audio_frame *first = NULL, **slot;
+  double sum = 0;
+  unsigned int n = 0;
+  int i;
+
+  for (i = 0; (slot = spsc_peek(&q->ring, i)) != NULL; i++) {
+    struct audio_frame *frame = *slot;
+
+    if (first == NULL) {
+      first = frame;
+    } else if (!pa_sample_spec_equal(&first->ss, &frame->ss) || first->latency != frame->latency) {
+      info.format_change = true;
+      info.format_change_index = i;
+      break;
+    }
+
+    info.available += frame->audio_length;
+    info.timestamped = info.timestamped && frame->timestamped;
+
+    if (frame_is_timed(frame)) {
+      double played = (double)info.available / pa_frame_size(&frame->ss) * 1e6 / frame->ss.rate;
+      sum += (int64_t)(frame->timestamped ? frame->ts_due_usec : frame->ts_recv_usec) - played;
+      n++;
+    }
+
+    if (frame->halt) {
+      info.halt = true;
+      info.halt_index = i;
+      break;
+    }
+  }
+
+  if (n >= 2) {
+    info.has_timing = true;
+    info.start = sum / n + 0.5;
+  }
+
+  return info;
+}
+
+static void check_run(void) {
+  static const pa_sample_spec formats[] = {
+    { .format = PA_SAMPLE_FLOAT32LE, .rate = 48000, .channels = 2 },
+    { .format = PA_SAMPLE_FLOAT32LE, .rate = 44100, .channels = 2 },
+  };
+  unsigned int seed = time(NULL), format = 0, pushed = 0;
+  int64_t due = 1000000;
+
+  if (!play_queue_init(&queue, STRESS_CAPACITY))
+    error(1, 0, "Could not allocate play queue");
+
+  for (unsigned int step = 0; step < RUN_STEPS; step++) {
+    unsigned int op = rand_r(&seed) % 8;
+    struct audio_frame *head = play_queue_head(&queue);
+
+    if (op < 4) {
+      if (rand_r(&seed) % 64 == 0)
+        format = !format;
+
+      size_t samples = 1 + rand_r(&seed) % STRESS_FRAME_SAMPLES;
+      struct audio_frame *frame = alloc_frame(samples * pa_frame_size(&formats[format]));
+
+      if (frame == NULL)
+        error(1, 0, "Could not allocate frame");
+
+      frame->ss = formats[format];
+      frame->seqnum = pushed;
+      frame->samplecount = samples;
+      frame->halt = rand_r(&seed) % 100 == 0;
+      frame->resent = rand_r(&seed) % 10 == 0;
+      frame->concealed = rand_r(&seed) % 20 == 0;
+      frame->timestamped = rand_r(&seed) % 10 != 0;
+      frame->timestamp_is_good = rand_r(&seed) % 10 != 0;
+
+      // Due times jitter around a steady rate.
+      due += samples * 1000000 / frame->ss.rate;
+      frame->ts_due_usec = due + rand_r(&seed) % 2000;
+      frame->ts_recv_usec = due + rand_r(&seed) % 2000;
+
+      if (!play_queue_push(&queue, frame))
+        free_frame(frame);
+      else
+        pushed++;
+    } else if (op < 7 && head != NULL) {
+      size_t frame_size = pa_frame_size(&head->ss);
+      size_t frames = head->audio_length / frame_size;
+
+      play_queue_consume(&queue, (1 + rand_r(&seed) % frames) * frame_size);
+    } else if (head != NULL && rand_r(&seed) % 64 == 0) {
+      struct play_queue_info info = play_queue_info(&queue);
+      size_t frame_size = pa_frame_size(&head->ss);
+
+      play_queue_trim(&queue, info.available / frame_size / 2 * frame_size);
+    }
+
+    // Querying after most steps, but not all, lets the run catch up on
+    // several pushes at once.
+    if (rand_r(&seed) % 4 == 0)
+      continue;
+
+    struct play_queue_info got = play_queue_info(&queue);
+    struct play_queue_info expected = recompute_run(&queue);
+
+    if (got.available != expected.available || got.halt != expected.halt ||
+        got.format_change != expected.format_change || got.halt_index != expected.halt_index ||
+        got.format_change_index != expected.format_change_index || got.timestamped != expected.timestamped ||
+        got.has_timing != expected.has_timing || (got.has_timing && llabs(got.start - expected.start) > 1))
+      error(1, 0, "Run: step %u: %zu bytes, start %" PRId64 ", expected %zu bytes, start %" PRId64,
+            step, got.available, got.start, expected.available, expected.start);
+  }
+
+  play_queue_flush(&queue);
+
+  if (play_queue_level(&queue) != 0)
+    error(1, 0, "Run: bytes left over after flush");
+
+  spsc_free(&queue.ring);
+
+  printf("Run: %d steps, %u frames pushed\n", RUN_STEPS, pushed);
+}
+
+static void *ring_producer(void *arg) {
+  (void)arg;
+
+  for (uint64_t i = 0; i < STRESS_ITEMS; ) {
+    // Alternate between both producer interfaces.
+    if (i & 1) {
+      struct element e = { .seqnum = i, .check = check_value(i) };
+
+      if (!spsc_push(&ring, &e)) {
+        sched_yield();
+        continue;
+      }
+    } else {
+      struct element *slot = spsc_write_slot(&ring);
+
+      if (slot == NULL) {
+        sched_yield();
+        continue;
+      }
+
+      *slot = (struct element){ .seqnum = i, .check = check_value(i) };
+      spsc_commit(&ring);
+    }
+
+    i++;
+  }
+
+  return NULL;
+}
+
+static void stress_ring(void) {
+  pthread_t producer;
+
+  if (!spsc_init(&ring, STRESS_CAPACITY, sizeof(struct element)))
+    error(1, 0, "Could not allocate ring");
+
+  pthread_create(&producer, NULL, ring_producer, NULL);
+
+  for (uint64_t expected = 0; expected < STRESS_ITEMS; ) {
+    struct element e;
+
+    // Peeking ahead must see the elements that follow, in order.
+    struct element *ahead = spsc_peek(&ring, 3);
+
+    if (ahead != NULL && ahead->seqnum != expected + 3)
+      error(1, 0, "Ring: peeked %" PRIu64 ", expected %" PRIu64, ahead->seqnum, expected + 3);
+
+    if (!spsc_pop(&ring, &e)) {
+      sched_yield();
+      continue;
+    }
+
+    if (e.seqnum != expected || e.check != check_value(e.seqnum))
+      error(1, 0, "Ring: got %" PRIu64 ", expected %" PRIu64, e.seqnum, expected);
+
+    expected++;
+  }
+
+  pthread_join(producer, NULL);
+
+  if (spsc_read_slot(&ring) != NULL)
+    error(1, 0, "Ring: elements left over");
+
+  spsc_free(&ring);
+
+  printf("Ring: %d elements in order\n", STRESS_ITEMS);
+}
+
+static void *queue_producer(void *arg) {
+  (void)arg;
+
+  size_t length = STRESS_FRAME_SAMPLES * pa_frame_size(&ss);
+
+  for (unsigned int i = 0; i < STRESS_FRAMES; i++) {
+    struct audio_frame *frame = alloc_frame(length);
+
+    if (frame == NULL)
+      error(1, 0, "Could not allocate frame");
+
+    frame->ss = ss;
+    frame->seqnum = i;
+    frame->samplecount = STRESS_FRAME_SAMPLES;
+
+    float *audio = frame->audio;
+
+    for (size_t k = 0; k < length / sizeof(float); k++)
+      audio[k] = i;
+
+    while (!play_queue_push(&queue, frame))
+      sched_yield();
+  }
+
+  return NULL;
+}
+
+static void stress_queue(void) {
+  pthread_t producer;
+  size_t frame_size = pa_frame_size(&ss);
+  unsigned int seed = time(NULL);
+  uint64_t bytes = 0;
+
+  if (!play_queue_init(&queue, STRESS_CAPACITY))
+    error(1, 0, "Could not allocate play queue");
+
+  pthread_create(&producer, NULL, queue_producer, NULL);
+
+  for (unsigned int expected = 0; expected < STRESS_FRAMES; ) {
+    struct play_queue_info info = play_queue_info(&queue);
+    struct audio_frame *frame = play_queue_head(&queue);
+
+    if (frame == NULL) {
+      sched_yield();
+      continue;
+    }
+
+    if (info.available < frame->audio_length)
+      error(1, 0, "Queue: %zu bytes available, head frame has %zu", info.available, frame->audio_length);
+
+    if (frame->seqnum != expected || *(float *)frame->readptr != expected)
+      error(1, 0, "Queue: got frame %u, expected %u", frame->seqnum, expected);
+
+    // Play a random part of the frame, like a write request would.
+    size_t frames = frame->audio_length / frame_size;
+    size_t play = 1 + rand_r(&seed) % frames;
+    bool last = play == frames;
+
+    play_queue_consume(&queue, play * frame_size);
+    bytes += play * frame_size;
+
+    if (last)
+      expected++;
+  }
+
+  pthread_join(producer, NULL);
+
+  if (play_queue_head(&queue) != NULL || play_queue_level(&queue) != 0)
+    error(1, 0, "Queue: frames left over");
+
+  if (bytes != (uint64_t)STRESS_FRAMES * STRESS_FRAME_SAMPLES * frame_size)
+    error(1, 0, "Queue: played %" PRIu64 " bytes", bytes);
+
+  printf("Play queue: %d frames in order, %" PRIu64 " bytes\n", STRESS_FRAMES, bytes);
+}
+
+int main(void) {
+  log_init();
+  frame_pool_init(STRESS_CAPACITY * 2);
+
+  check_run();
+  stress_ring();
+  stress_queue();
+
+  print_frame_pool_stats();
+
+  return 0;
+}
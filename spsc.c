@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+
+// capacity is rounded up to a power of two.
+bool spsc_init(struct spsc *q, size_t capacity, size_t elem_size) {
+  size_t size = 1;
+
+  while (size < capacity)
+    size <<= 1;
+
+  q->data = calloc(size, elem_size);
+
+  if (q->data == NULL)
+    return false;
+
+  q->mask = size - 1;
+  q->elem_size = elem_size;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+
+  return true;
+}
+
+void spsc_free(struct spsc *q) {
+  free(q->data);
+  q->data = NULL;
+}
+
+// Returns the next free slot or NULL if the ring is full. The slot becomes
+// visible to the consumer with spsc_commit().
+void *spsc_write_slot(struct spsc *q) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+  if (head - tail > q->mask)
+    return NULL;
+
+  return q->data + (head & q->mask) * q->elem_size;
+}
+
+void spsc_commit(struct spsc *q) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+}
+
+bool spsc_push(struct spsc *q, const void *elem) {
+  void *slot = spsc_write_slot(q);
+
+  if (slot == NULL)
+    return false;
+
+  memcpy(slot, elem, q->elem_size);
+  spsc_commit(q);
+
+  return true;
+}
+
+// Returns the oldest element or NULL if the ring is empty. The slot is
+// handed back to the producer with spsc_release().
+void *spsc_read_slot(struct spsc *q) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  if (tail == head)
+    return NULL;
+
+  return q->data + (tail & q->mask) * q->elem_size;
+}
+
+void spsc_release(struct spsc *q) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+bool spsc_pop(struct spsc *q, void *elem) {
+  void *slot = spsc_read_slot(q);
+
+  if (slot == NULL)
+    return false;
+
+  memcpy(elem, slot, q->elem_size);
+  spsc_release(q);
+
+  return true;
+}
+
+// Returns the i-th oldest element without removing it, or NULL if fewer
+// elements are available. Consumer only.
+void *spsc_peek(struct spsc *q, size_t i) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  if (head - tail <= i)
+    return NULL;
+
+  return q->data + ((tail + i) & q->mask) * q->elem_size;
+}
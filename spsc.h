@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Lock-free single-producer/single-consumer ring of fixed size elements.
+// Exactly one thread may call the producer functions (write_slot, commit,
+// push) and exactly one thread the consumer functions (read_slot, release,
+// pop).
+struct spsc {
+  _Alignas(64) atomic_size_t head; // next slot to write, owned by producer
+  _Alignas(64) atomic_size_t tail; // next slot to read, owned by consumer
+  _Alignas(64) size_t mask;
+  size_t elem_size;
+  uint8_t *data;
+};
+
+bool spsc_init(struct spsc *q, size_t capacity, size_t elem_size);
+void spsc_free(struct spsc *q);
+
+void *spsc_write_slot(struct spsc *q);
+void spsc_commit(struct spsc *q);
+bool spsc_push(struct spsc *q, const void *elem);
+
+void *spsc_read_slot(struct spsc *q);
+void spsc_release(struct spsc *q);
+bool spsc_pop(struct spsc *q, void *elem);
+void *spsc_peek(struct spsc *q, size_t i);